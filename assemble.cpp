@@ -1,62 +1,66 @@
-#pragma once
-
 #include "assemble.h"
+#include <charconv>
 
-std::string IntToString(int val) {
-    if (val == 0) {
-        return "0";
+void AssembleAtom(Object *obj, std::string *out) {
+    if (obj == nullptr) {
+        out->append("()");
+        return;
     }
-    std::string result;
-    if (val < 0) {
-        result = "-";
-        val = -val;
+    if (obj->type_ == 1) {
+        out->append(static_cast<Symbol *>(obj)->GetName());
+        return;
     }
-    std::vector<char> res;
-    while (val > 0) {
-        res.push_back(char(val % 10 + '0'));
-        val /= 10;
+    if (obj->type_ == 0) {
+        char digits[16];
+        auto end = std::to_chars(digits, digits + sizeof(digits),
+                                 static_cast<Number *>(obj)->GetValue()).ptr;
+        out->append(digits, end);
+        return;
     }
-    for (int i = res.size(); i > 0; --i) {
-        result += res[i - 1];
+    if (obj->type_ == 3) {
+        out->append(static_cast<Bool *>(obj)->Get() ? "#t" : "#f");
     }
-    return result;
 }
 
-std::string Assemble(std::shared_ptr<Object> obj) {
-    if (obj == nullptr) {
-        return "()";
-    }
-    if (IsSymbol(obj)) {
-        return AsSymbol(obj)->GetName();
-    }
-    if (IsNumber(obj)) {
-        int result = AsNumber(obj)->GetValue();
-        return IntToString(result);
-    }
-    if (IsBool(obj)) {
-        bool result = AsBool(obj)->Get();
-        if (result) {
-            return "#t";
-        } else {
-            return "#f";
+// Lists are walked in place: the cdr chain is followed in a loop and every list whose car is
+// being printed keeps its remaining tail on an explicit stack, so neither long nor deeply
+// nested data recurses.
+void Assemble(const std::shared_ptr<Object> &obj, std::string *out) {
+    std::vector<Object *> tails;
+    Object *cur = obj.get();
+    while (true) {
+        if (cur != nullptr && cur->type_ == 2) {
+            auto cell = static_cast<Cell *>(cur);
+            out->push_back('(');
+            tails.push_back(cell->GetSecond().get());
+            cur = cell->GetFirst().get();
+            continue;
         }
-    }
-    if (IsCell(obj)) {
-        std::string result = "(";
-        while (IsCell(obj)) {
-            auto cell = AsCell(obj);
-            result += Assemble(cell->GetFirst());
-            obj = cell->GetSecond();
-            if (IsCell(obj)) {
-                result += " ";
+        AssembleAtom(cur, out);
+        while (true) {
+            if (tails.empty()) {
+                return;
             }
+            Object *tail = tails.back();
+            if (tail != nullptr && tail->type_ == 2) {
+                auto cell = static_cast<Cell *>(tail);
+                out->push_back(' ');
+                tails.back() = cell->GetSecond().get();
+                cur = cell->GetFirst().get();
+                break;
+            }
+            if (tail != nullptr) {
+                out->append(" . ");
+                AssembleAtom(tail, out);
+            }
+            out->push_back(')');
+            tails.pop_back();
         }
-        if (obj != nullptr) {
-            result += " . ";
-            result += Assemble(obj);
-        }
-        result += ")";
-        return result;
     }
-    return "";
+}
+
+std::string Assemble(std::shared_ptr<Object> obj) {
+    std::string result;
+    Assemble(obj, &result);
+    return result;
 }
@@ -3,3 +3,6 @@
 #include "object.h"
 
 std::string Assemble(std::shared_ptr<Object>);
+
+// Appends the printed form of obj to out, so one buffer can be reused for many results.
+void Assemble(const std::shared_ptr<Object> &obj, std::string *out);
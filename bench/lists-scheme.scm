@@ -0,0 +1,17 @@
+; The same work as lists.scm, with the list procedures written in Scheme.
+(define (iota n) (let loop ((i n) (acc '())) (if (= i 0) acc (loop (- i 1) (cons i acc)))))
+(define xs (iota 200000))
+(define (odd? x) (= (- x (* 2 (/ x 2))) 1))
+(define (square x) (- (* x x) (* x (- x 1))))
+(define (my-reverse l) (let loop ((l l) (acc '())) (if (null? l) acc (loop (cdr l) (cons (car l) acc)))))
+(define (my-map f l) (my-reverse (let loop ((l l) (acc '())) (if (null? l) acc (loop (cdr l) (cons (f (car l)) acc))))))
+(define (my-filter p l)
+  (my-reverse (let loop ((l l) (acc '()))
+                (cond ((null? l) acc) ((p (car l)) (loop (cdr l) (cons (car l) acc))) (else (loop (cdr l) acc))))))
+(define (my-fold f init l) (if (null? l) init (my-fold f (f (car l) init) (cdr l))))
+(define (my-length l) (let loop ((l l) (n 0)) (if (null? l) n (loop (cdr l) (+ n 1)))))
+(define squares (my-map square xs))
+(define odds (my-filter odd? squares))
+(define total (my-fold + 0 odds))
+(define count (+ (my-length odds) (my-length (my-reverse xs))))
+(list total count)
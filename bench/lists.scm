@@ -0,0 +1,13 @@
+; map, filter, fold, length and reverse over a 200000 element list with the builtins.
+; Compare with lists-scheme.scm:
+;   time ./interpreter -q bench/lists.scm
+;   time ./interpreter -q bench/lists-scheme.scm
+(define (iota n) (let loop ((i n) (acc '())) (if (= i 0) acc (loop (- i 1) (cons i acc)))))
+(define xs (iota 200000))
+(define (odd? x) (= (- x (* 2 (/ x 2))) 1))
+(define (square x) (- (* x x) (* x (- x 1))))
+(define squares (map square xs))
+(define odds (filter odd? squares))
+(define total (fold + 0 odds))
+(define count (+ (length odds) (length (reverse xs))))
+(list total count)
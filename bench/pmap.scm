@@ -0,0 +1,5 @@
+; CPU bound work spread over the threads of pmap and preduce; see scaling.sh.
+(define (iota n) (let loop ((i n) (acc '())) (if (= i 0) acc (loop (- i 1) (cons i acc)))))
+(define (work n) (let loop ((i 0) (acc 0)) (if (= i 2000) acc (loop (+ i 1) (+ acc (- n i))))))
+(define xs (iota 300))
+(preduce + 0 (pmap work xs))
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Runs bench/pmap.scm with 1 to N threads, N being the number of cores unless given, and
+# prints the time of every run and its speedup over the run with one thread.
+# Usage: bench/scaling.sh ./interpreter [N]
+set -e
+interpreter=${1:?usage: bench/scaling.sh ./interpreter [N]}
+max=${2:-$(nproc)}
+script=$(dirname "$0")/pmap.scm
+base=
+threads=1
+while [ "$threads" -le "$max" ]; do
+    start=$(date +%s%N)
+    "$interpreter" -q -j "$threads" "$script"
+    end=$(date +%s%N)
+    ms=$(( (end - start) / 1000000 ))
+    base=${base:-$ms}
+    awk -v t="$threads" -v ms="$ms" -v base="$base" \
+        'BEGIN { printf "%2d threads: %6d ms, speedup %.2f\n", t, ms, base / ms }'
+    threads=$((threads + 1))
+done
@@ -0,0 +1,609 @@
+#include "object.h"
+#include "pool.h"
+#include <algorithm>
+#include <set>
+
+namespace {
+bool IsSymbolNamed(const std::shared_ptr<Object> &obj, const char *name) {
+    return IsSymbol(obj) && AsSymbol(obj)->GetName() == name;
+}
+
+// A procedure being analyzed on this thread, or a let-syntax form in one: the names its frame
+// binds, if any, and the macros it defines.
+struct Analysis {
+    const std::vector<std::string> *names = nullptr;
+    std::vector<std::pair<std::string, std::shared_ptr<Macro>>> macros;
+};
+thread_local std::vector<const Analysis *> analyses;
+
+class Analyzing {
+public:
+    explicit Analyzing(const Analysis *analysis) {
+        analyses.push_back(analysis);
+    }
+    Analyzing(const Analyzing &) = delete;
+    Analyzing &operator=(const Analyzing &) = delete;
+    ~Analyzing() {
+        analyses.pop_back();
+    }
+};
+
+// The macro that a form with this head uses, if it is known already: one the analyses around
+// define, or else a global one, unless one of them binds the name to a variable.
+std::shared_ptr<Macro> KnownMacro(const std::string &name) {
+    if (IsSpecialForm(name)) {
+        return nullptr;
+    }
+    for (size_t i = analyses.size(); i > 0; --i) {
+        const Analysis &analysis = *analyses[i - 1];
+        for (const auto &macro : analysis.macros) {
+            if (macro.first == name) {
+                return macro.second;
+            }
+        }
+        if (analysis.names != nullptr &&
+            std::find(analysis.names->begin(), analysis.names->end(), name) !=
+                analysis.names->end()) {
+            return nullptr;
+        }
+    }
+    auto global = RunningScope::Current();
+    std::shared_ptr<Object> value;
+    if (global == nullptr || !global->Lookup(name, &value) || !IsMacro(value)) {
+        return nullptr;
+    }
+    return AsMacro(value);
+}
+
+// Adds the macro of a (define-syntax name rules) form or a let-syntax binding to analysis. A
+// malformed one is left for the evaluator to report when it gets there.
+void AddMacro(const std::shared_ptr<Object> &name, const std::shared_ptr<Object> &spec,
+              Analysis *analysis) {
+    if (!IsSymbol(name)) {
+        return;
+    }
+    try {
+        analysis->macros.emplace_back(AsSymbol(name)->GetName(), MakeMacro(spec));
+    } catch (const SyntaxError &) {
+    }
+}
+
+void CollectMacros(const std::shared_ptr<Object> &expr, Analysis *analysis) {
+    if (!IsCell(expr) || !IsSymbol(AsCell(expr)->GetFirst())) {
+        return;
+    }
+    const auto &name = AsSymbol(AsCell(expr)->GetFirst())->GetName();
+    auto args = AsCell(expr)->GetSecond();
+    if (name == "begin") {
+        for (; IsCell(args); args = AsCell(args)->GetSecond()) {
+            CollectMacros(AsCell(args)->GetFirst(), analysis);
+        }
+    } else if (name == "define-syntax" && IsCell(args) && IsCell(AsCell(args)->GetSecond())) {
+        AddMacro(AsCell(args)->GetFirst(), AsCell(AsCell(args)->GetSecond())->GetFirst(),
+                 analysis);
+    }
+}
+
+bool IsParameterList(std::shared_ptr<Object> params) {
+    while (IsCell(params)) {
+        if (!IsSymbol(AsCell(params)->GetFirst())) {
+            return false;
+        }
+        params = AsCell(params)->GetSecond();
+    }
+    return params == nullptr || IsSymbol(params);
+}
+
+// The names bound by a (define ...) form at the top of a body. Definitions inside begin forms
+// are spliced into the body, so those count too.
+void CollectDefinitions(const std::shared_ptr<Object> &expr, std::vector<std::string> *names) {
+    if (!IsCell(expr)) {
+        return;
+    }
+    auto form = AsCell(expr);
+    std::string defined;
+    if (IsLambda(form->GetFirst())) {
+        defined = AsLambda(form->GetFirst())->name;
+    } else if (IsSymbolNamed(form->GetFirst(), "begin")) {
+        for (auto rest = form->GetSecond(); IsCell(rest); rest = AsCell(rest)->GetSecond()) {
+            CollectDefinitions(AsCell(rest)->GetFirst(), names);
+        }
+        return;
+    } else if ((IsSymbolNamed(form->GetFirst(), "define") ||
+                IsSymbolNamed(form->GetFirst(), "define-syntax")) &&
+               IsCell(form->GetSecond())) {
+        auto target = AsCell(form->GetSecond())->GetFirst();
+        if (IsCell(target)) {
+            target = AsCell(target)->GetFirst();
+        }
+        if (IsSymbol(target)) {
+            defined = AsSymbol(target)->GetName();
+        }
+    }
+    if (!defined.empty() && std::find(names->begin(), names->end(), defined) == names->end()) {
+        names->push_back(defined);
+    }
+}
+
+// Every symbol the body may refer to as a variable. Quoted data is skipped and nested lambda
+// forms are analyzed (and replaced by their analysis) on the way, so that only their free
+// variables count, and so are the uses of the macros known by now, whose expansions may refer
+// to variables the use does not name. Other special forms are walked like calls: a name too
+// many only makes a closure capture a variable it does not need.
+void CollectReferences(const std::shared_ptr<Object> &body, std::set<std::string> *refs) {
+    std::vector<Object *> pending{body.get()};
+    while (!pending.empty()) {
+        Object *expr = pending.back();
+        pending.pop_back();
+        if (expr == nullptr) {
+            continue;
+        }
+        if (expr->type_ == 1) {
+            refs->insert(static_cast<Symbol *>(expr)->GetName());
+            continue;
+        }
+        if (expr->type_ == 13) {
+            pending.push_back(static_cast<TailCons *>(expr)->name.get());
+            continue;
+        }
+        if (expr->type_ != 2) {
+            continue;
+        }
+        auto form = static_cast<Cell *>(expr);
+        const auto &head = form->GetFirst();
+        const auto &args = form->GetSecond();
+        std::shared_ptr<Lambda> nested;
+        if (IsPipeline(head)) {
+            // The call as it was written, with the names of all the stages.
+            for (const auto &name : AsPipeline(head)->names) {
+                pending.push_back(name.get());
+            }
+            for (auto arg = AsPipeline(head)->args; IsCell(arg); arg = AsCell(arg)->GetSecond()) {
+                pending.push_back(AsCell(arg)->GetFirst().get());
+            }
+            continue;
+        }
+        if (IsSymbol(head)) {
+            if (auto macro = KnownMacro(AsSymbol(head)->GetName())) {
+                std::shared_ptr<Object> expansion;
+                try {
+                    expansion = macro->Expand(form);
+                } catch (const SyntaxError &) {
+                    // Reported if the use is ever evaluated.
+                    continue;
+                }
+                ReplaceForm(form, std::move(expansion));
+                pending.push_back(expr);
+                continue;
+            }
+        }
+        if (IsLambda(head)) {
+            nested = AsLambda(head);
+        } else if (IsSymbolNamed(head, "quote")) {
+            continue;
+        } else if (IsSymbolNamed(head, "quasiquote") && IsCell(args) &&
+                   AsCell(args)->GetSecond() == nullptr) {
+            // Only the unquoted parts of the template are code.
+            ReplaceForm(form, CompileQuasiquote(AsCell(args)->GetFirst()));
+            pending.push_back(expr);
+            continue;
+        } else if ((IsSymbolNamed(head, "let-syntax") || IsSymbolNamed(head, "letrec-syntax")) &&
+                   IsCell(args)) {
+            // The body is walked with the macros of the bindings known.
+            Analysis analysis;
+            for (auto binding = AsCell(args)->GetFirst(); IsCell(binding);
+                 binding = AsCell(binding)->GetSecond()) {
+                auto pair = AsCell(binding)->GetFirst();
+                if (IsCell(pair) && IsCell(AsCell(pair)->GetSecond())) {
+                    AddMacro(AsCell(pair)->GetFirst(),
+                             AsCell(AsCell(pair)->GetSecond())->GetFirst(), &analysis);
+                }
+            }
+            Analyzing analyzing(&analysis);
+            CollectReferences(AsCell(args)->GetSecond(), refs);
+            continue;
+        } else if (IsSymbolNamed(head, "lambda") && IsCell(args) &&
+                   IsCell(AsCell(args)->GetSecond()) &&
+                   IsParameterList(AsCell(args)->GetFirst())) {
+            nested = std::make_shared<Lambda>("", AsCell(args)->GetFirst(),
+                                              AsCell(args)->GetSecond());
+            form->SetFirst(nested);
+        } else if (IsSymbolNamed(head, "define") && IsCell(args) &&
+                   IsCell(AsCell(args)->GetFirst()) && IsCell(AsCell(args)->GetSecond())) {
+            auto signature = AsCell(AsCell(args)->GetFirst());
+            if (IsSymbol(signature->GetFirst()) && IsParameterList(signature->GetSecond())) {
+                nested = std::make_shared<Lambda>(AsSymbol(signature->GetFirst())->GetName(),
+                                                  signature->GetSecond(),
+                                                  AsCell(args)->GetSecond());
+                form->SetFirst(nested);
+            }
+        }
+        if (nested != nullptr) {
+            if (!nested->name.empty()) {
+                refs->insert(nested->name);
+            }
+            refs->insert(nested->free.begin(), nested->free.end());
+            continue;
+        }
+        Object *rest = expr;
+        while (rest != nullptr && rest->type_ == 2) {
+            pending.push_back(static_cast<Cell *>(rest)->GetFirst().get());
+            rest = static_cast<Cell *>(rest)->GetSecond().get();
+        }
+        pending.push_back(rest);
+    }
+}
+
+// The last element of a list, or null.
+std::shared_ptr<Object> Last(std::shared_ptr<Object> list) {
+    if (!IsCell(list)) {
+        return nullptr;
+    }
+    while (IsCell(AsCell(list)->GetSecond())) {
+        list = AsCell(list)->GetSecond();
+    }
+    return AsCell(list)->GetFirst();
+}
+
+// The calls of name in tail position of expr: after them nothing is left to do in the loop
+// body, so they can start the next iteration in place. Nested loops keep a frame of their
+// own until they finish, so their bodies are not tail positions of the outer loop.
+void FindTailCalls(const std::shared_ptr<Object> &expr, const std::string &name,
+                   std::vector<Cell *> *calls) {
+    if (!IsCell(expr)) {
+        return;
+    }
+    auto form = AsCell(expr);
+    const auto &head = form->GetFirst();
+    const auto &args = form->GetSecond();
+    if (IsSymbolNamed(head, name.c_str())) {
+        calls->push_back(form.get());
+        return;
+    }
+    if (IsCell(head) && IsLambda(AsCell(head)->GetFirst())) {
+        // A let that has been rewritten into a call of a lambda form already.
+        FindTailCalls(Last(AsLambda(AsCell(head)->GetFirst())->body), name, calls);
+        return;
+    }
+    if (!IsSymbol(head) || !IsCell(args)) {
+        return;
+    }
+    const auto &form_name = AsSymbol(head)->GetName();
+    if (form_name == "if") {
+        for (auto branch = AsCell(args)->GetSecond(); IsCell(branch);
+             branch = AsCell(branch)->GetSecond()) {
+            FindTailCalls(AsCell(branch)->GetFirst(), name, calls);
+        }
+    } else if (form_name == "begin" || form_name == "and" || form_name == "or") {
+        FindTailCalls(Last(args), name, calls);
+    } else if (form_name == "when" || form_name == "unless") {
+        FindTailCalls(Last(AsCell(args)->GetSecond()), name, calls);
+    } else if (form_name == "cond") {
+        for (auto clauses = args; IsCell(clauses); clauses = AsCell(clauses)->GetSecond()) {
+            auto clause = AsCell(clauses)->GetFirst();
+            if (!IsCell(clause) || !IsCell(AsCell(clause)->GetSecond()) ||
+                IsSymbolNamed(AsCell(AsCell(clause)->GetSecond())->GetFirst(), "=>")) {
+                continue;
+            }
+            FindTailCalls(Last(AsCell(clause)->GetSecond()), name, calls);
+        }
+    } else if (form_name == "let" || form_name == "let*" || form_name == "letrec" ||
+               form_name == "letrec*") {
+        if (!IsSymbol(AsCell(args)->GetFirst())) {
+            FindTailCalls(Last(AsCell(args)->GetSecond()), name, calls);
+        }
+    }
+}
+
+// How many times the symbol occurs in code, quoted data aside.
+size_t CountOccurrences(const std::shared_ptr<Object> &code, const std::string &name) {
+    size_t count = 0;
+    std::vector<Object *> pending{code.get()};
+    while (!pending.empty()) {
+        Object *expr = pending.back();
+        pending.pop_back();
+        if (expr == nullptr) {
+            continue;
+        }
+        if (expr->type_ == 1) {
+            count += static_cast<Symbol *>(expr)->GetName() == name;
+            continue;
+        }
+        if (expr->type_ == 8) {
+            auto lambda = static_cast<Lambda *>(expr);
+            count += lambda->name == name;
+            pending.push_back(lambda->params.get());
+            pending.push_back(lambda->body.get());
+            continue;
+        }
+        if (expr->type_ != 2) {
+            continue;
+        }
+        auto form = static_cast<Cell *>(expr);
+        if (IsSymbolNamed(form->GetFirst(), "quote")) {
+            continue;
+        }
+        if (IsLambda(form->GetFirst())) {
+            pending.push_back(form->GetFirst().get());
+            continue;
+        }
+        if (IsPipeline(form->GetFirst())) {
+            for (const auto &name : AsPipeline(form->GetFirst())->names) {
+                pending.push_back(name.get());
+            }
+            auto arg = AsPipeline(form->GetFirst())->args;
+            for (; IsCell(arg); arg = AsCell(arg)->GetSecond()) {
+                pending.push_back(AsCell(arg)->GetFirst().get());
+            }
+            continue;
+        }
+        Object *rest = expr;
+        while (rest != nullptr && rest->type_ == 2) {
+            pending.push_back(static_cast<Cell *>(rest)->GetFirst().get());
+            rest = static_cast<Cell *>(rest)->GetSecond().get();
+        }
+        pending.push_back(rest);
+    }
+    return count;
+}
+
+std::shared_ptr<Object> MakeList(const std::vector<std::shared_ptr<Object>> &items) {
+    std::shared_ptr<Object> list;
+    for (size_t i = items.size(); i > 0; --i) {
+        list = std::make_shared<Cell>(items[i - 1], std::move(list));
+    }
+    return list;
+}
+}  // namespace
+
+void ParseBindings(std::shared_ptr<Object> bindings, std::vector<std::shared_ptr<Object>> *names,
+                   std::vector<std::shared_ptr<Object>> *inits,
+                   std::vector<std::shared_ptr<Object>> *steps) {
+    for (; IsCell(bindings); bindings = AsCell(bindings)->GetSecond()) {
+        auto binding = AsCell(bindings)->GetFirst();
+        if (!IsCell(binding) || !IsSymbol(AsCell(binding)->GetFirst())) {
+            throw SyntaxError{};
+        }
+        auto init = AsCell(binding)->GetSecond();
+        if (!IsCell(init)) {
+            throw SyntaxError{};
+        }
+        auto step = AsCell(init)->GetSecond();
+        if (steps != nullptr && IsCell(step) && AsCell(step)->GetSecond() == nullptr) {
+            steps->push_back(AsCell(step)->GetFirst());
+        } else if (step != nullptr) {
+            throw SyntaxError{};
+        } else if (steps != nullptr) {
+            steps->push_back(nullptr);
+        }
+        names->push_back(AsCell(binding)->GetFirst());
+        inits->push_back(AsCell(init)->GetFirst());
+    }
+    if (bindings != nullptr) {
+        throw SyntaxError{};
+    }
+}
+
+std::shared_ptr<Loop> AnalyzeDo(const std::shared_ptr<Object> &args) {
+    if (!IsCell(args) || !IsCell(AsCell(args)->GetSecond())) {
+        throw SyntaxError{};
+    }
+    std::vector<std::shared_ptr<Object>> names;
+    std::vector<std::shared_ptr<Object>> inits;
+    std::vector<std::shared_ptr<Object>> steps;
+    ParseBindings(AsCell(args)->GetFirst(), &names, &inits, &steps);
+    auto rest = AsCell(AsCell(args)->GetSecond());
+    if (!IsCell(rest->GetFirst())) {
+        throw SyntaxError{};
+    }
+    auto exit = AsCell(rest->GetFirst());
+    auto lambda = std::make_shared<Lambda>("", MakeList(names), rest->GetSecond());
+    auto loop = std::make_shared<Loop>(std::move(lambda), MakeList(inits));
+    loop->is_do = true;
+    loop->test = exit->GetFirst();
+    loop->result = exit->GetSecond();
+    for (size_t i = 0; i < steps.size(); ++i) {
+        if (steps[i] != nullptr) {
+            loop->steps.emplace_back(i, steps[i]);
+        }
+    }
+    return loop;
+}
+
+std::shared_ptr<Loop> AnalyzeNamedLet(const std::shared_ptr<Object> &args) {
+    auto rest = AsCell(args)->GetSecond();
+    if (!IsCell(rest) || !IsCell(AsCell(rest)->GetSecond())) {
+        throw SyntaxError{};
+    }
+    const auto &name = AsSymbol(AsCell(args)->GetFirst())->GetName();
+    std::vector<std::shared_ptr<Object>> names;
+    std::vector<std::shared_ptr<Object>> inits;
+    ParseBindings(AsCell(rest)->GetFirst(), &names, &inits);
+    for (const auto &variable : names) {
+        if (AsSymbol(variable)->GetName() == name) {
+            return nullptr;
+        }
+    }
+    const auto &body = AsCell(rest)->GetSecond();
+    std::vector<Cell *> calls;
+    FindTailCalls(Last(body), name, &calls);
+    if (CountOccurrences(body, name) != calls.size()) {
+        return nullptr;
+    }
+    auto lambda = std::make_shared<Lambda>("", MakeList(names), body);
+    auto loop = std::make_shared<Loop>(std::move(lambda), MakeList(inits));
+    for (Cell *call : calls) {
+        call->SetFirst(std::make_shared<Recur>(loop.get()));
+    }
+    return loop;
+}
+
+std::shared_ptr<Object> CopyCode(const std::shared_ptr<Object> &code) {
+    if (!IsCell(code) || IsSymbolNamed(AsCell(code)->GetFirst(), "quote")) {
+        return code;
+    }
+    ListBuilder copy;
+    auto rest = code;
+    for (; IsCell(rest); rest = AsCell(rest)->GetSecond()) {
+        copy.Add(CopyCode(AsCell(rest)->GetFirst()));
+    }
+    return copy.Finish(rest);
+}
+
+void MarkTailConses(const std::shared_ptr<Object> &body, const std::string &name) {
+    std::vector<Cell *> calls;
+    FindTailCalls(Last(body), "cons", &calls);
+    for (Cell *call : calls) {
+        auto args = call->GetSecond();
+        if (!IsCell(args) || !IsCell(AsCell(args)->GetSecond())) {
+            continue;
+        }
+        auto rest = AsCell(AsCell(args)->GetSecond());
+        if (rest->GetSecond() == nullptr && IsCell(rest->GetFirst()) &&
+            IsSymbolNamed(AsCell(rest->GetFirst())->GetFirst(), name.c_str())) {
+            call->SetFirst(std::make_shared<TailCons>(call->GetFirst()));
+        }
+    }
+}
+
+Lambda::Lambda(std::string name, std::shared_ptr<Object> params, std::shared_ptr<Object> body)
+    : Object(8), name(std::move(name)), params(std::move(params)), body(std::move(body)) {
+    auto layout = std::make_shared<Layout>();
+    auto &names = layout->names;
+    auto variables = this->params;
+    while (IsCell(variables)) {
+        auto cell = AsCell(variables);
+        if (!IsSymbol(cell->GetFirst())) {
+            throw SyntaxError{};
+        }
+        names.push_back(AsSymbol(cell->GetFirst())->GetName());
+        variables = cell->GetSecond();
+    }
+    layout->param_count = names.size();
+    if (IsSymbol(variables)) {
+        names.push_back(AsSymbol(variables)->GetName());
+        layout->has_rest = true;
+    } else if (variables != nullptr) {
+        throw SyntaxError{};
+    }
+    for (auto expr = this->body; IsCell(expr); expr = AsCell(expr)->GetSecond()) {
+        CollectDefinitions(AsCell(expr)->GetFirst(), &names);
+    }
+    layout->capture_start = names.size();
+    own = layout;
+
+    std::set<std::string> refs;
+    Analysis analysis;
+    analysis.names = &names;
+    for (auto expr = this->body; IsCell(expr); expr = AsCell(expr)->GetSecond()) {
+        CollectMacros(AsCell(expr)->GetFirst(), &analysis);
+    }
+    {
+        Analyzing analyzing(&analysis);
+        CollectReferences(this->body, &refs);
+    }
+    for (const auto &ref : refs) {
+        if (std::find(names.begin(), names.end(), ref) == names.end()) {
+            free.push_back(ref);
+        }
+    }
+    if (!this->name.empty()) {
+        MarkTailConses(this->body, this->name);
+    }
+}
+
+// Closures of one form are nearly always made in frames of one procedure, so the last shape
+// is kept and recomputed only when the layouts of the enclosing frames change. Shapes are not
+// changed once made, so a thread can go on with one while another replaces it.
+std::shared_ptr<const Lambda::ClosureShape> Lambda::Shape(const Scope &scope) {
+    std::shared_ptr<const ClosureShape> shape;
+    {
+        std::unique_lock<std::mutex> lock(shape_mutex_, std::defer_lock);
+        if (IsCodeShared()) {
+            lock.lock();
+        }
+        shape = shape_;
+    }
+    bool is_same = shape != nullptr;
+    size_t depth = 0;
+    for (const Scope *frame = &scope; is_same && frame->layout != nullptr;
+         frame = frame->father.get()) {
+        is_same = depth < shape->enclosing.size() && shape->enclosing[depth] == frame->layout;
+        ++depth;
+    }
+    if (is_same && depth == shape->enclosing.size()) {
+        return shape;
+    }
+    auto fresh = std::make_shared<ClosureShape>();
+    for (const Scope *frame = &scope; frame->layout != nullptr; frame = frame->father.get()) {
+        fresh->enclosing.push_back(frame->layout);
+    }
+    auto layout = std::make_shared<Layout>(*own);
+    for (const auto &variable : free) {
+        for (size_t i = 0; i < fresh->enclosing.size(); ++i) {
+            const auto &outer = fresh->enclosing[i]->names;
+            auto it = std::find(outer.begin(), outer.end(), variable);
+            if (it != outer.end()) {
+                layout->names.push_back(variable);
+                fresh->captures.push_back({i, static_cast<size_t>(it - outer.begin())});
+                break;
+            }
+        }
+    }
+    fresh->layout = std::move(layout);
+    std::unique_lock<std::mutex> lock(shape_mutex_, std::defer_lock);
+    if (IsCodeShared()) {
+        lock.lock();
+    }
+    shape_ = fresh;
+    return fresh;
+}
+
+std::shared_ptr<Scope> Lambda::MakeFrame(const std::shared_ptr<Scope> &scope,
+                                         const std::shared_ptr<Object> *args, size_t count) {
+    return BindArguments(own, scope, args, count);
+}
+
+bool IsLambda(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 8;
+}
+
+std::shared_ptr<Lambda> AsLambda(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<Lambda>(obj);
+}
+
+bool IsLoop(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 9;
+}
+
+std::shared_ptr<Loop> AsLoop(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<Loop>(obj);
+}
+
+bool IsRecur(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 10;
+}
+
+std::shared_ptr<Recur> AsRecur(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<Recur>(obj);
+}
+
+bool IsTailCons(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 13;
+}
+
+std::shared_ptr<TailCons> AsTailCons(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<TailCons>(obj);
+}
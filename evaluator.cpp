@@ -0,0 +1,1528 @@
+#include "evaluator.h"
+#include "green.h"
+#include "image.h"
+#include "pool.h"
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+// The evaluators whose RunLoops are on the C++ stack of this thread, innermost last.
+thread_local std::vector<const Evaluator *> running_evaluators;
+
+// Builtins such as sort call procedures of the program on evaluators nested on the C++ stack,
+// which is much smaller than the heap stack of an evaluator, so their nesting is bounded.
+constexpr size_t kMaxNesting = 1000;
+thread_local size_t nesting = 0;
+
+// Everything but #f counts as true in cond, when and unless, like in and and or.
+bool IsTrue(const std::shared_ptr<Object> &value) {
+    return !IsBool(value) || AsBool(value)->Get();
+}
+
+// (first second)
+std::shared_ptr<Object> ListOf(std::shared_ptr<Object> first, std::shared_ptr<Object> second) {
+    return std::make_shared<Cell>(std::move(first),
+                                  std::make_shared<Cell>(std::move(second), nullptr));
+}
+
+const std::shared_ptr<Object> &MapBuiltin() {
+    static const std::shared_ptr<Object> kMap = Builtin("map");
+    return kMap;
+}
+
+const std::shared_ptr<Object> &ForEachBuiltin() {
+    static const std::shared_ptr<Object> kForEach = Builtin("for-each");
+    return kForEach;
+}
+
+const std::shared_ptr<Object> &FilterBuiltin() {
+    static const std::shared_ptr<Object> kFilter = Builtin("filter");
+    return kFilter;
+}
+
+const std::shared_ptr<Object> &FoldBuiltin() {
+    static const std::shared_ptr<Object> kFold = Builtin("fold");
+    return kFold;
+}
+
+// The builtins StartIteration runs on the frames of the evaluator.
+bool IsIteration(const std::shared_ptr<Object> &func) {
+    return func == MapBuiltin() || func == ForEachBuiltin() || func == FilterBuiltin() ||
+           func == FoldBuiltin();
+}
+
+}  // namespace
+
+// The names StartSpecialForm handles.
+bool IsSpecialForm(const std::string &name) {
+    static const char *const kNames[] = {"quote", "quasiquote", "future", "unquote",
+                                         "unquote-splicing", "save-image", "define",
+                                         "define-syntax", "let-syntax", "letrec-syntax",
+                                         "set!", "set-car!", "set-cdr!", "if", "lambda",
+                                         "let", "let*", "letrec", "letrec*", "do", "begin",
+                                         "and", "or", "when", "unless", "cond"};
+    for (const char *special : kNames) {
+        if (name == special) {
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace {
+// Whether evaluating the form rewrites it in place.
+bool IsRewrittenOnUse(Cell *form) {
+    const auto &head = form->GetFirst();
+    if (IsCell(head)) {
+        const auto &op = AsCell(head)->GetFirst();
+        return IsSymbol(op) && AsSymbol(op)->GetName() == "lambda";
+    }
+    if (!IsSymbol(head)) {
+        return false;
+    }
+    const auto &name = AsSymbol(head)->GetName();
+    if (name == "define") {
+        return IsCell(form->GetSecond()) && IsCell(AsCell(form->GetSecond())->GetFirst());
+    }
+    return name == "lambda" || name == "let" || name == "let*" || name == "letrec" ||
+           name == "letrec*" || name == "let-syntax" || name == "letrec-syntax" ||
+           name == "do" || name == "quasiquote" || name == "future";
+}
+
+// The rewritten copies of forms that several threads may be running, by form. The first thread
+// to evaluate such a form rewrites a copy of its own and publishes it, and from then on every
+// thread evaluates that copy, whose own forms are published in turn; the shared forms never
+// change. Every thread remembers the copies it has looked up, so that only its first lookup of
+// a form takes a lock.
+class SharedRewrites {
+public:
+    static SharedRewrites &Instance() {
+        static SharedRewrites instance;
+        return instance;
+    }
+
+    // The published copy of the form, or nullptr.
+    std::shared_ptr<Cell> Find(const std::shared_ptr<Cell> &form) {
+        thread_local Table seen;
+        if (auto copy = seen.Find(form)) {
+            return copy;
+        }
+        Shard &shard = shards_[reinterpret_cast<uintptr_t>(form.get()) / sizeof(Cell) % kShards];
+        std::shared_ptr<Cell> copy;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            copy = shard.table.Find(form);
+        }
+        if (copy != nullptr) {
+            seen.Add(form, copy);
+        }
+        return copy;
+    }
+
+    // Publishes the copy unless another thread has been first, and returns the one published.
+    std::shared_ptr<Cell> Publish(const std::shared_ptr<Cell> &form, std::shared_ptr<Cell> copy) {
+        Shard &shard = shards_[reinterpret_cast<uintptr_t>(form.get()) / sizeof(Cell) % kShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (auto published = shard.table.Find(form)) {
+            return published;
+        }
+        shard.table.Add(form, copy);
+        return copy;
+    }
+
+private:
+    // The forms are held weakly; the entries of those that are gone are dropped as it grows.
+    class Table {
+    public:
+        std::shared_ptr<Cell> Find(const std::shared_ptr<Cell> &form) {
+            auto it = entries_.find(form.get());
+            if (it == entries_.end()) {
+                return nullptr;
+            }
+            if (it->second.form.expired()) {
+                entries_.erase(it);
+                return nullptr;
+            }
+            return it->second.copy;
+        }
+
+        void Add(const std::shared_ptr<Cell> &form, std::shared_ptr<Cell> copy) {
+            if (entries_.size() >= sweep_at_) {
+                for (auto it = entries_.begin(); it != entries_.end();) {
+                    it = it->second.form.expired() ? entries_.erase(it) : std::next(it);
+                }
+                sweep_at_ = std::max<size_t>(kMinSweep, 2 * entries_.size());
+            }
+            entries_[form.get()] = {form, std::move(copy)};
+        }
+
+    private:
+        struct Entry {
+            std::weak_ptr<Cell> form;
+            std::shared_ptr<Cell> copy;
+        };
+
+        static constexpr size_t kMinSweep = 64;
+        std::unordered_map<const Cell *, Entry> entries_;
+        size_t sweep_at_ = kMinSweep;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        Table table;
+    };
+
+    static constexpr size_t kShards = 64;
+    Shard shards_[kShards];
+};
+}  // namespace
+
+Evaluator::~Evaluator() {
+    CutStack(0, 0);
+}
+
+std::shared_ptr<Object> Evaluator::Run(const std::shared_ptr<Object> &expr,
+                                       const std::shared_ptr<Scope> &scope) {
+    size_t bottom = frames_.size();
+    size_t values_bottom = values_.size();
+    Eval(expr, scope);
+    return RunLoop(bottom, values_bottom);
+}
+
+std::shared_ptr<Object> Evaluator::RunBody(const std::shared_ptr<Object> &body,
+                                           const std::shared_ptr<Scope> &scope) {
+    size_t bottom = frames_.size();
+    size_t values_bottom = values_.size();
+    EvalSequence(FrameType::BODY, body, scope);
+    return RunLoop(bottom, values_bottom);
+}
+
+std::shared_ptr<Object> Evaluator::RunCallCC(const std::shared_ptr<Object> &proc) {
+    size_t bottom = frames_.size();
+    size_t values_bottom = values_.size();
+    StartCallCC(proc);
+    return RunLoop(bottom, values_bottom);
+}
+
+std::shared_ptr<Object> Evaluator::RunContinuation(
+    const std::shared_ptr<Continuation> &continuation, const std::shared_ptr<Object> &value) {
+    if (continuation->is_live_) {
+        Escape(continuation, value);
+    }
+    size_t bottom = frames_.size();
+    size_t values_bottom = values_.size();
+    Reinstate(continuation, value, bottom, values_bottom);
+    return RunLoop(bottom, values_bottom);
+}
+
+void Evaluator::Start(const std::shared_ptr<Object> &expr, const std::shared_ptr<Scope> &scope) {
+    Eval(expr, scope);
+}
+
+bool Evaluator::RunSlice(size_t steps, std::shared_ptr<Object> *value) {
+    steps_left_ = steps;
+    is_paused_ = false;
+    try {
+        *value = RunLoop(0, 0);
+    } catch (...) {
+        steps_left_ = kNoLimit;
+        throw;
+    }
+    steps_left_ = kNoLimit;
+    return !is_paused_;
+}
+
+void Evaluator::Pause() {
+    steps_left_ = 0;
+    is_paused_ = true;
+}
+
+void Evaluator::SetValue(std::shared_ptr<Object> value) {
+    value_ = std::move(value);
+}
+
+// Frames below bottom belong to an outer Run that called into C++ code which called us back.
+// A continuation escape stops at the RunLoop that holds the marker frame of the continuation.
+std::shared_ptr<Object> Evaluator::RunLoop(size_t bottom, size_t values_bottom) {
+    struct Running {
+        explicit Running(const Evaluator *evaluator) {
+            if (nesting == kMaxNesting) {
+                throw RuntimeError{};
+            }
+            running_evaluators.push_back(evaluator);
+            ++nesting;
+        }
+        ~Running() {
+            running_evaluators.pop_back();
+            --nesting;
+        }
+    } running(this);
+    size_t outer_bottom = bottom_;
+    size_t outer_values_bottom = values_bottom_;
+    bottom_ = bottom;
+    values_bottom_ = values_bottom;
+    while (true) {
+        try {
+            while (!has_value_ || frames_.size() > bottom) {
+                if (steps_left_-- == 0) {
+                    // The end of a slice: everything stays as it is for the next one.
+                    is_paused_ = true;
+                    bottom_ = outer_bottom;
+                    values_bottom_ = outer_values_bottom;
+                    return nullptr;
+                }
+                if (!has_value_) {
+                    Step();
+                } else {
+                    Continue();
+                }
+            }
+            if (is_paused_) {
+                // Paused by the last step, such as a receive in tail position: the value stays
+                // for the next slice, which may replace it first.
+                bottom_ = outer_bottom;
+                values_bottom_ = outer_values_bottom;
+                return nullptr;
+            }
+            break;
+        } catch (ContinuationEscape &escape) {
+            if (OwnsLive(*escape.continuation) && escape.continuation->depth_ > bottom) {
+                Resume(escape.continuation, std::move(escape.value));
+                continue;
+            }
+            CutStack(bottom, values_bottom);
+            has_value_ = false;
+            bottom_ = outer_bottom;
+            values_bottom_ = outer_values_bottom;
+            throw;
+        } catch (...) {
+            CutStack(bottom, values_bottom);
+            has_value_ = false;
+            bottom_ = outer_bottom;
+            values_bottom_ = outer_values_bottom;
+            throw;
+        }
+    }
+    has_value_ = false;
+    expr_ = nullptr;
+    scope_ = nullptr;
+    bottom_ = outer_bottom;
+    values_bottom_ = outer_values_bottom;
+    return std::move(value_);
+}
+
+void Evaluator::Eval(std::shared_ptr<Object> expr, std::shared_ptr<Scope> scope) {
+    expr_ = std::move(expr);
+    scope_ = std::move(scope);
+    has_value_ = false;
+}
+
+void Evaluator::Return(std::shared_ptr<Object> value) {
+    value_ = std::move(value);
+    has_value_ = true;
+}
+
+void Evaluator::Step() {
+    if (IsSymbol(expr_)) {
+        Return(AsSymbol(expr_)->Eval(scope_.get()));
+        return;
+    }
+    if (!IsCell(expr_)) {
+        if (expr_ == nullptr) {
+            throw RuntimeError{};
+        }
+        // Numbers, booleans and procedures are immutable and evaluate to themselves.
+        Return(expr_);
+        return;
+    }
+    auto form = AsCell(expr_);
+    if (!IsCodeShared() || !IsRewrittenOnUse(form.get())) {
+        StartForm(form);
+        return;
+    }
+    // Other threads may be running the same code, so the form is rewritten once, in a copy that
+    // this thread publishes when it has rewritten it.
+    auto &rewrites = SharedRewrites::Instance();
+    if (auto copy = rewrites.Find(form)) {
+        expr_ = copy;
+        StartForm(copy);
+        return;
+    }
+    auto copy = AsCell(CopyCode(form));
+    expr_ = copy;
+    StartForm(copy);
+    rewrites.Publish(form, std::move(copy));
+}
+
+void Evaluator::StartForm(const std::shared_ptr<Cell> &form) {
+    if (IsLambda(form->GetFirst())) {
+        MakeClosure(AsLambda(form->GetFirst()));
+        return;
+    }
+    std::shared_ptr<Object> op;
+    if (IsSymbol(form->GetFirst())) {
+        if (StartSpecialForm(form)) {
+            return;
+        }
+        if (IsSymbol(form->GetFirst())) {
+            op = AsSymbol(form->GetFirst())->Eval(scope_.get());
+            if (IsMacro(op)) {
+                // The expansion replaces the use; the next step evaluates it.
+                ExpandMacro(form, *AsMacro(op));
+                return;
+            }
+            if (!IsCodeShared() && FusePipeline(form.get(), op)) {
+                return;
+            }
+        }
+    } else if (IsPipeline(form->GetFirst())) {
+        StartPipeline(form);
+        return;
+    } else if (IsTailCons(form->GetFirst())) {
+        StartTailCons(form);
+        return;
+    }
+    frames_.push_back({FrameType::ARGUMENTS, form->GetSecond(), scope_, values_.size()});
+    if (op != nullptr) {
+        Return(std::move(op));
+        return;
+    }
+    if (auto lambda = AppliedLambda(form->GetFirst())) {
+        // The analysis stands in for the procedure, which is never made.
+        Return(std::move(lambda));
+        return;
+    }
+    Eval(form->GetFirst(), scope_);
+}
+
+// The pipeline is called with the operands of the form and runs its stages in one pass. When
+// a stage has been redefined, the outermost call is made with its arguments as written
+// instead, and the calls inside them are fused again or not on their own.
+void Evaluator::StartPipeline(const std::shared_ptr<Cell> &form) {
+    auto pipeline = AsPipeline(form->GetFirst());
+    if (IsPipelineIntact(*pipeline, scope_.get())) {
+        frames_.push_back({FrameType::ARGUMENTS, form->GetSecond(), scope_, values_.size()});
+        Return(std::move(pipeline));
+        return;
+    }
+    auto op = AsSymbol(pipeline->names[0])->Eval(scope_.get());
+    if (IsMacro(op)) {
+        Eval(std::make_shared<Cell>(pipeline->names[0], pipeline->args), scope_);
+        return;
+    }
+    frames_.push_back({FrameType::ARGUMENTS, pipeline->args, scope_, values_.size()});
+    Return(std::move(op));
+}
+
+// (cons x (f ...)): the pair is made as soon as x is known and f is called in tail position,
+// with its value going into the cdr. When the value of this form goes into the cdr of another
+// such pair, the frame of that one is reused, so a chain of these calls takes one frame.
+void Evaluator::StartTailCons(const std::shared_ptr<Cell> &form) {
+    static const std::shared_ptr<Object> kCons = Builtin("cons");
+    auto name = AsTailCons(form->GetFirst())->name;
+    auto op = AsSymbol(name)->Eval(scope_.get());
+    if (op != kCons) {
+        Eval(std::make_shared<Cell>(std::move(name), form->GetSecond()), scope_);
+        return;
+    }
+    auto args = AsCell(form->GetSecond());
+    frames_.push_back({FrameType::CONS_FIRST, args->GetSecond(), scope_, 0});
+    Eval(args->GetFirst(), scope_);
+}
+
+void Evaluator::ContinueTailCons() {
+    Frame &frame = frames_.back();
+    auto cell = std::make_shared<Cell>(std::move(value_), nullptr);
+    auto rest = AsCell(frame.expr)->GetFirst();
+    auto scope = std::move(frame.scope);
+    frames_.pop_back();
+    if (frames_.size() > bottom_ && frames_.back().type == FrameType::CONS_TAIL) {
+        Frame &tail = frames_.back();
+        AsCell(tail.expr)->SetSecond(cell);
+        tail.expr = std::move(cell);
+    } else {
+        frames_.push_back({FrameType::CONS_TAIL, cell, nullptr, values_.size()});
+        values_.push_back(std::move(cell));
+    }
+    Eval(std::move(rest), std::move(scope));
+}
+
+// A lambda form in operator position is called right away and cannot escape.
+std::shared_ptr<Lambda> Evaluator::AppliedLambda(const std::shared_ptr<Object> &op) {
+    if (!IsCell(op)) {
+        return nullptr;
+    }
+    auto form = AsCell(op);
+    if (IsLambda(form->GetFirst())) {
+        auto lambda = AsLambda(form->GetFirst());
+        return lambda->name.empty() ? lambda : nullptr;
+    }
+    const auto &args = form->GetSecond();
+    if (!IsSymbol(form->GetFirst()) || AsSymbol(form->GetFirst())->GetName() != "lambda" ||
+        !IsCell(args) || !IsCell(AsCell(args)->GetSecond())) {
+        return nullptr;
+    }
+    auto lambda = std::make_shared<Lambda>("", AsCell(args)->GetFirst(), AsCell(args)->GetSecond());
+    form->SetFirst(lambda);
+    return lambda;
+}
+
+// map, for-each, filter and fold call their procedure only while they run, so a lambda form
+// passed to them cannot escape either. Code that other threads may be running is not rewritten
+// here, so there it has to have been rewritten already.
+std::shared_ptr<Lambda> Evaluator::DownwardLambda(const std::shared_ptr<Object> &arg) {
+    if (IsCodeShared() && !(IsCell(arg) && IsLambda(AsCell(arg)->GetFirst()))) {
+        return nullptr;
+    }
+    return AppliedLambda(arg);
+}
+
+void Evaluator::Continue() {
+    Frame &frame = frames_.back();
+    switch (frame.type) {
+        case FrameType::ARGUMENTS: {
+            values_.push_back(std::move(value_));
+            if (IsCell(frame.expr)) {
+                auto cell = AsCell(frame.expr);
+                frame.expr = cell->GetSecond();
+                if (values_.size() == frame.base + 1 && IsIteration(values_[frame.base])) {
+                    if (auto lambda = DownwardLambda(cell->GetFirst())) {
+                        Return(std::move(lambda));
+                        return;
+                    }
+                }
+                Eval(cell->GetFirst(), frame.scope);
+                return;
+            }
+            size_t base = frame.base;
+            if (IsLoop(values_[base])) {
+                auto scope = std::move(frame.scope);
+                frames_.pop_back();
+                EnterLoop(base, std::move(scope));
+                return;
+            }
+            if (IsRecur(values_[base])) {
+                frames_.pop_back();
+                RestartLoop(base);
+                return;
+            }
+            if (IsLambda(values_[base])) {
+                auto scope = std::move(frame.scope);
+                frames_.pop_back();
+                auto lambda = AsLambda(values_[base]);
+                auto body_scope = lambda->MakeFrame(scope, values_.data() + base + 1,
+                                                    values_.size() - base - 1);
+                values_.resize(base);
+                EvalSequence(FrameType::BODY, lambda->body, std::move(body_scope));
+                return;
+            }
+            if (values_.size() > base + 1 && IsLambda(values_[base + 1])) {
+                // The iteration calls the analysis in frames that chain to this scope.
+                auto scope = std::move(frame.scope);
+                frames_.pop_back();
+                auto func = values_[base];
+                StartIteration(func, base, std::move(scope));
+                return;
+            }
+            frames_.pop_back();
+            ApplyProcedure(base);
+            return;
+        }
+        case FrameType::BODY:
+            ContinueSequence();
+            return;
+        case FrameType::IF: {
+            if (!IsBool(value_)) {
+                throw SyntaxError{};
+            }
+            auto branches = AsCell(frame.expr);
+            auto scope = std::move(frame.scope);
+            frames_.pop_back();
+            if (AsBool(value_)->Get()) {
+                Eval(branches->GetFirst(), std::move(scope));
+            } else if (branches->GetSecond() == nullptr) {
+                Return(nullptr);
+            } else {
+                Eval(AsCell(branches->GetSecond())->GetFirst(), std::move(scope));
+            }
+            return;
+        }
+        case FrameType::DEFINE:
+            frame.scope->Init(AsSymbol(frame.expr)->GetName(), std::move(value_));
+            frames_.pop_back();
+            Return(nullptr);
+            return;
+        case FrameType::SET:
+            frame.scope->Set(AsSymbol(frame.expr)->GetName(), std::move(value_));
+            frames_.pop_back();
+            Return(nullptr);
+            return;
+        case FrameType::SET_CAR:
+        case FrameType::SET_CDR: {
+            const auto &name = AsSymbol(frame.expr)->GetName();
+            auto pair = frame.scope->Get(name);
+            if (!IsCell(pair)) {
+                throw SyntaxError{};
+            }
+            auto cell = AsCell(pair);
+            if (frame.type == FrameType::SET_CAR) {
+                frame.scope->Set(name, std::make_shared<Cell>(value_, cell->GetSecond()));
+            } else {
+                frame.scope->Set(name, std::make_shared<Cell>(cell->GetFirst(), value_));
+            }
+            frames_.pop_back();
+            Return(nullptr);
+            return;
+        }
+        case FrameType::AND:
+            if (IsBool(value_) && !AsBool(value_)->Get()) {
+                frames_.pop_back();
+                Return(std::make_shared<Bool>(false));
+                return;
+            }
+            ContinueSequence();
+            return;
+        case FrameType::OR:
+            if (!IsBool(value_)) {
+                frames_.pop_back();
+                Return(std::move(value_));
+                return;
+            }
+            if (AsBool(value_)->Get()) {
+                frames_.pop_back();
+                Return(std::make_shared<Bool>(true));
+                return;
+            }
+            ContinueSequence();
+            return;
+        case FrameType::COND:
+            ContinueCond();
+            return;
+        case FrameType::WHEN:
+        case FrameType::UNLESS:
+            if (IsTrue(value_) == (frame.type == FrameType::WHEN)) {
+                frame.type = FrameType::BODY;
+                ContinueSequence();
+            } else {
+                frames_.pop_back();
+                Return(nullptr);
+            }
+            return;
+        case FrameType::LOOP:
+            if (!AsLoop(frame.expr)->is_do) {
+                // The body of a named let ended without calling the loop again.
+                frames_.pop_back();
+                return;
+            }
+            StartSteps();
+            return;
+        case FrameType::LOOP_TEST: {
+            auto loop = static_cast<Loop *>(frame.expr.get());
+            if (IsTrue(value_)) {
+                if (loop->result == nullptr) {
+                    frames_.pop_back();
+                    Return(nullptr);
+                    return;
+                }
+                frame.type = FrameType::BODY;
+                frame.expr = loop->result;
+                ContinueSequence();
+            } else if (loop->lambda->body != nullptr) {
+                frame.type = FrameType::LOOP;
+                EvalSequence(FrameType::BODY, loop->lambda->body, frame.scope);
+            } else {
+                StartSteps();
+            }
+            return;
+        }
+        case FrameType::LOOP_STEP:
+            values_.push_back(std::move(value_));
+            NextStep();
+            return;
+        case FrameType::CONS_FIRST:
+            ContinueTailCons();
+            return;
+        case FrameType::CONS_TAIL: {
+            // The value is the rest of the list; the first pair of the chain is the result.
+            AsCell(frame.expr)->SetSecond(std::move(value_));
+            size_t base = frame.base;
+            frames_.pop_back();
+            Return(std::move(values_[base]));
+            values_.resize(base);
+            return;
+        }
+        case FrameType::ITERATION:
+            ContinueIteration();
+            return;
+        case FrameType::PIPELINE:
+            ContinuePipeline();
+            return;
+        case FrameType::CONTINUATION:
+            // call/cc returned normally, its value goes on to the frame below.
+            ReleaseMarker(&frame);
+            frames_.pop_back();
+            return;
+    }
+}
+
+bool Evaluator::StartSpecialForm(const std::shared_ptr<Cell> &form) {
+    const auto &name = AsSymbol(form->GetFirst())->GetName();
+    const auto &args = form->GetSecond();
+    if (name == "quote") {
+        if (!IsCell(args)) {
+            throw RuntimeError{};
+        }
+        Return(AsCell(args)->GetFirst());
+        return true;
+    }
+    if (name == "quasiquote") {
+        // Compiled in place, once; the next step evaluates the construction code.
+        if (!IsCell(args) || AsCell(args)->GetSecond() != nullptr) {
+            throw SyntaxError{};
+        }
+        ReplaceForm(form.get(), CompileQuasiquote(AsCell(args)->GetFirst()));
+        return true;
+    }
+    if (name == "future") {
+        // Rewritten in place, once, into a call that starts a thunk of the body.
+        if (!IsCell(args)) {
+            throw SyntaxError{};
+        }
+        static const auto spawn = std::make_shared<SpawnFuture>();
+        auto thunk = std::make_shared<Cell>(std::make_shared<Symbol>("lambda"),
+                                            std::make_shared<Cell>(nullptr, args));
+        ReplaceForm(form.get(), ListOf(spawn, std::move(thunk)));
+        return true;
+    }
+    if (name == "unquote" || name == "unquote-splicing") {
+        throw SyntaxError{};
+    }
+    if (name == "save-image") {
+        // (save-image file): the name of the file is not evaluated, and in double quotes it
+        // may have dots in it.
+        if (!IsCell(args) || !IsSymbol(AsCell(args)->GetFirst()) ||
+            AsCell(args)->GetSecond() != nullptr) {
+            throw SyntaxError{};
+        }
+        std::string path = AsSymbol(AsCell(args)->GetFirst())->GetName();
+        if (path.size() > 2 && path.front() == '"' && path.back() == '"') {
+            path = path.substr(1, path.size() - 2);
+        }
+        SaveImage(path, scope_.get());
+        Return(nullptr);
+        return true;
+    }
+    if (name == "if") {
+        if (!IsCell(args) || !IsCell(AsCell(args)->GetSecond())) {
+            throw SyntaxError{};
+        }
+        auto branches = AsCell(args)->GetSecond();
+        auto rest = AsCell(branches)->GetSecond();
+        if (rest != nullptr && (!IsCell(rest) || AsCell(rest)->GetSecond() != nullptr)) {
+            throw SyntaxError{};
+        }
+        frames_.push_back({FrameType::IF, branches, scope_, 0});
+        Eval(AsCell(args)->GetFirst(), scope_);
+        return true;
+    }
+    if (name == "define") {
+        if (IsCell(args) && IsCell(AsCell(args)->GetFirst())) {
+            auto signature = AsCell(AsCell(args)->GetFirst());
+            auto body = AsCell(args)->GetSecond();
+            if (!IsSymbol(signature->GetFirst()) || !IsCell(body)) {
+                throw SyntaxError{};
+            }
+            auto lambda = std::make_shared<Lambda>(AsSymbol(signature->GetFirst())->GetName(),
+                                                   signature->GetSecond(), body);
+            form->SetFirst(lambda);
+            MakeClosure(lambda);
+            return true;
+        }
+        StartAssignment(FrameType::DEFINE, args);
+        return true;
+    }
+    if (name == "set!") {
+        StartAssignment(FrameType::SET, args);
+        return true;
+    }
+    if (name == "set-car!") {
+        StartAssignment(FrameType::SET_CAR, args);
+        return true;
+    }
+    if (name == "set-cdr!") {
+        StartAssignment(FrameType::SET_CDR, args);
+        return true;
+    }
+    if (name == "lambda") {
+        if (!IsCell(args) || !IsCell(AsCell(args)->GetSecond())) {
+            throw SyntaxError{};
+        }
+        auto lambda = std::make_shared<Lambda>("", AsCell(args)->GetFirst(),
+                                               AsCell(args)->GetSecond());
+        form->SetFirst(lambda);
+        MakeClosure(lambda);
+        return true;
+    }
+    if (name == "and") {
+        if (args == nullptr) {
+            Return(std::make_shared<Bool>(true));
+        } else {
+            EvalSequence(FrameType::AND, args, scope_);
+        }
+        return true;
+    }
+    if (name == "or") {
+        if (args == nullptr) {
+            Return(std::make_shared<Bool>(false));
+        } else {
+            EvalSequence(FrameType::OR, args, scope_);
+        }
+        return true;
+    }
+    if (name == "begin") {
+        EvalSequence(FrameType::BODY, args, scope_);
+        return true;
+    }
+    if (name == "let" || name == "let*" || name == "letrec" || name == "letrec*") {
+        // The form becomes a call of a lambda form or a loop, which the caller goes on to
+        // evaluate.
+        RewriteLet(form);
+        return false;
+    }
+    if (name == "define-syntax") {
+        if (!IsCell(args) || !IsSymbol(AsCell(args)->GetFirst()) ||
+            !IsCell(AsCell(args)->GetSecond()) ||
+            AsCell(AsCell(args)->GetSecond())->GetSecond() != nullptr) {
+            throw SyntaxError{};
+        }
+        scope_->Init(AsSymbol(AsCell(args)->GetFirst())->GetName(),
+                     MakeMacro(AsCell(AsCell(args)->GetSecond())->GetFirst()));
+        Return(nullptr);
+        return true;
+    }
+    if (name == "let-syntax" || name == "letrec-syntax") {
+        // ((lambda () (define-syntax name rules)... body...)), rewritten in place.
+        if (!IsCell(args) || !IsCell(AsCell(args)->GetSecond())) {
+            throw SyntaxError{};
+        }
+        std::vector<std::shared_ptr<Object>> names;
+        std::vector<std::shared_ptr<Object>> specs;
+        ParseBindings(AsCell(args)->GetFirst(), &names, &specs);
+        auto body = AsCell(args)->GetSecond();
+        auto define = std::make_shared<Symbol>("define-syntax");
+        for (size_t i = names.size(); i > 0; --i) {
+            auto definition = std::make_shared<Cell>(define, ListOf(names[i - 1], specs[i - 1]));
+            body = std::make_shared<Cell>(std::move(definition), std::move(body));
+        }
+        auto lambda = std::make_shared<Lambda>("", nullptr, std::move(body));
+        form->SetFirst(std::make_shared<Cell>(std::move(lambda), nullptr));
+        form->SetSecond(nullptr);
+        return false;
+    }
+    if (name == "do") {
+        auto loop = AnalyzeDo(args);
+        form->SetFirst(loop);
+        form->SetSecond(loop->inits);
+        return false;
+    }
+    if (name == "cond") {
+        if (args == nullptr) {
+            Return(nullptr);
+            return true;
+        }
+        frames_.push_back({FrameType::COND, args, scope_, 0});
+        NextCondClause();
+        return true;
+    }
+    if (name == "when" || name == "unless") {
+        if (!IsCell(args) || !IsCell(AsCell(args)->GetSecond())) {
+            throw SyntaxError{};
+        }
+        auto type = name == "when" ? FrameType::WHEN : FrameType::UNLESS;
+        frames_.push_back({type, AsCell(args)->GetSecond(), scope_, 0});
+        Eval(AsCell(args)->GetFirst(), scope_);
+        return true;
+    }
+    return false;
+}
+
+// Makes a closure of an analyzed lambda form, or binds it for (define (name . params) ...).
+void Evaluator::MakeClosure(const std::shared_ptr<Lambda> &lambda) {
+    auto closure = std::make_shared<RefFunction>(lambda, scope_);
+    if (lambda->name.empty()) {
+        Return(std::move(closure));
+        return;
+    }
+    scope_->Init(lambda->name, std::move(closure));
+    Return(nullptr);
+}
+
+// Rewrites the let forms in place, once, into calls of lambda forms, which bind their frames
+// without making a procedure:
+//   (let ((x a) (y b)) body...)      => ((lambda (x y) body...) a b)
+//   (let* ((x a) (y b)) body...)     => ((lambda (x) ((lambda (y) body...) b)) a)
+//   (letrec ((x a) (y b)) body...)   => ((lambda () (define x a) (define y b) body...))
+// A named let becomes a loop when it can, and otherwise
+//   (let f ((x a)) body...)          => ((letrec ((f (lambda (x) body...))) f) a)
+void Evaluator::RewriteLet(const std::shared_ptr<Cell> &form) {
+    const auto &kind = AsSymbol(form->GetFirst())->GetName();
+    bool is_sequential = kind == "let*";
+    bool is_recursive = kind == "letrec" || kind == "letrec*";
+    auto args = form->GetSecond();
+    if (!IsCell(args) || !IsCell(AsCell(args)->GetSecond())) {
+        throw SyntaxError{};
+    }
+    if (kind == "let" && IsSymbol(AsCell(args)->GetFirst())) {
+        if (auto loop = AnalyzeNamedLet(args)) {
+            form->SetFirst(loop);
+            form->SetSecond(loop->inits);
+            return;
+        }
+        auto name = AsCell(args)->GetFirst();
+        args = AsCell(args)->GetSecond();
+        std::vector<std::shared_ptr<Object>> names;
+        std::vector<std::shared_ptr<Object>> inits;
+        ParseBindings(AsCell(args)->GetFirst(), &names, &inits);
+        MarkTailConses(AsCell(args)->GetSecond(), AsSymbol(name)->GetName());
+        std::shared_ptr<Object> params;
+        std::shared_ptr<Object> operands;
+        for (size_t i = names.size(); i > 0; --i) {
+            params = std::make_shared<Cell>(names[i - 1], std::move(params));
+            operands = std::make_shared<Cell>(inits[i - 1], std::move(operands));
+        }
+        auto procedure = std::make_shared<Cell>(
+            std::make_shared<Symbol>("lambda"),
+            std::make_shared<Cell>(std::move(params), AsCell(args)->GetSecond()));
+        auto bindings = std::make_shared<Cell>(ListOf(name, std::move(procedure)), nullptr);
+        auto letrec = std::make_shared<Cell>(std::make_shared<Symbol>("letrec"),
+                                             ListOf(std::move(bindings), name));
+        form->SetFirst(std::move(letrec));
+        form->SetSecond(std::move(operands));
+        return;
+    }
+    std::vector<std::shared_ptr<Object>> names;
+    std::vector<std::shared_ptr<Object>> inits;
+    ParseBindings(AsCell(args)->GetFirst(), &names, &inits);
+    std::shared_ptr<Object> body = AsCell(args)->GetSecond();
+    std::shared_ptr<Object> params;
+    std::shared_ptr<Object> operands;
+    if (is_recursive) {
+        auto define = std::make_shared<Symbol>("define");
+        for (size_t i = names.size(); i > 0; --i) {
+            auto definition =
+                std::make_shared<Cell>(define, ListOf(names[i - 1], inits[i - 1]));
+            body = std::make_shared<Cell>(std::move(definition), std::move(body));
+        }
+    } else if (is_sequential && names.size() > 1) {
+        for (size_t i = names.size(); i > 1; --i) {
+            auto lambda = std::make_shared<Lambda>(
+                "", std::make_shared<Cell>(names[i - 1], nullptr), std::move(body));
+            auto op = std::make_shared<Cell>(std::move(lambda), nullptr);
+            auto call = ListOf(std::move(op), inits[i - 1]);
+            body = std::make_shared<Cell>(std::move(call), nullptr);
+        }
+        params = std::make_shared<Cell>(names[0], nullptr);
+        operands = std::make_shared<Cell>(inits[0], nullptr);
+    } else {
+        for (size_t i = names.size(); i > 0; --i) {
+            params = std::make_shared<Cell>(names[i - 1], std::move(params));
+            operands = std::make_shared<Cell>(inits[i - 1], std::move(operands));
+        }
+    }
+    auto lambda = std::make_shared<Lambda>("", std::move(params), std::move(body));
+    form->SetFirst(std::make_shared<Cell>(std::move(lambda), nullptr));
+    form->SetSecond(std::move(operands));
+}
+
+// The frame of a loop is made once, when the loop is entered, and then rebound in place.
+void Evaluator::EnterLoop(size_t base, std::shared_ptr<Scope> scope) {
+    auto loop = AsLoop(values_[base]);
+    auto frame = loop->lambda->MakeFrame(scope, values_.data() + base + 1,
+                                         values_.size() - base - 1);
+    values_.resize(base);
+    frames_.push_back({FrameType::LOOP, std::move(loop), std::move(frame), 0});
+    NextIteration();
+}
+
+void Evaluator::NextIteration() {
+    Frame &frame = frames_.back();
+    auto loop = static_cast<Loop *>(frame.expr.get());
+    if (loop->is_do) {
+        frame.type = FrameType::LOOP_TEST;
+        Eval(loop->test, frame.scope);
+    } else {
+        frame.type = FrameType::LOOP;
+        EvalSequence(FrameType::BODY, loop->lambda->body, frame.scope);
+    }
+}
+
+// A tail call of a named let: the body is over, so the loop frame is on top of the stack and
+// gets fresh variables. Closures made by the previous iteration keep the old boxes.
+void Evaluator::RestartLoop(size_t base) {
+    auto recur = static_cast<Recur *>(values_[base].get());
+    if (frames_.size() <= bottom_ || frames_.back().type != FrameType::LOOP ||
+        frames_.back().expr.get() != recur->loop) {
+        throw RuntimeError{};
+    }
+    Scope *scope = frames_.back().scope.get();
+    for (auto &slot : scope->slots) {
+        slot = Slot{};
+    }
+    BindParameters(scope, values_.data() + base + 1, values_.size() - base - 1);
+    values_.resize(base);
+    NextIteration();
+}
+
+// The steps of a do are all evaluated before any variable is rebound.
+void Evaluator::StartSteps() {
+    Frame &frame = frames_.back();
+    frame.type = FrameType::LOOP_STEP;
+    frame.base = values_.size();
+    NextStep();
+}
+
+void Evaluator::NextStep() {
+    Frame &frame = frames_.back();
+    auto loop = static_cast<Loop *>(frame.expr.get());
+    size_t index = values_.size() - frame.base;
+    if (index < loop->steps.size()) {
+        Eval(loop->steps[index].second, frame.scope);
+        return;
+    }
+    auto &slots = frame.scope->slots;
+    for (size_t i = 0; i < loop->steps.size(); ++i) {
+        slots[loop->steps[i].first] = Slot{std::move(values_[frame.base + i]), nullptr, true};
+    }
+    values_.resize(frame.base);
+    NextIteration();
+}
+
+// The expansion takes the place of the use.
+// Code that other threads may be running keeps the use, and the evaluator goes on with the
+// published expansion instead.
+void Evaluator::ExpandMacro(const std::shared_ptr<Cell> &form, const Macro &macro) {
+    if (!IsCodeShared()) {
+        ReplaceForm(form.get(), macro.Expand(form.get()));
+        return;
+    }
+    auto &rewrites = SharedRewrites::Instance();
+    auto expansion = rewrites.Find(form);
+    if (expansion == nullptr) {
+        expansion = std::make_shared<Cell>(nullptr, nullptr);
+        ReplaceForm(expansion.get(), macro.Expand(form.get()));
+        expansion = rewrites.Publish(form, std::move(expansion));
+    }
+    expr_ = std::move(expansion);
+}
+
+// Starts the test of the clause on top of the cond frame. An else clause, which must be the
+// last one, turns the frame into the sequence of its expressions.
+void Evaluator::NextCondClause() {
+    Frame &frame = frames_.back();
+    auto clause = AsCell(frame.expr)->GetFirst();
+    if (!IsCell(clause)) {
+        throw SyntaxError{};
+    }
+    const auto &test = AsCell(clause)->GetFirst();
+    if (IsSymbol(test) && AsSymbol(test)->GetName() == "else") {
+        if (AsCell(frame.expr)->GetSecond() != nullptr) {
+            throw SyntaxError{};
+        }
+        frame.type = FrameType::BODY;
+        frame.expr = AsCell(clause)->GetSecond();
+        ContinueSequence();
+        return;
+    }
+    Eval(test, frame.scope);
+}
+
+// The clauses are tried one after another in the same frame, without nested ifs.
+void Evaluator::ContinueCond() {
+    Frame &frame = frames_.back();
+    auto clauses = AsCell(frame.expr);
+    if (!IsTrue(value_)) {
+        if (!IsCell(clauses->GetSecond())) {
+            if (clauses->GetSecond() != nullptr) {
+                throw SyntaxError{};
+            }
+            frames_.pop_back();
+            Return(nullptr);
+            return;
+        }
+        frame.expr = clauses->GetSecond();
+        NextCondClause();
+        return;
+    }
+    auto body = AsCell(clauses->GetFirst())->GetSecond();
+    if (body == nullptr) {
+        // (test) gives the value of the test.
+        frames_.pop_back();
+        return;
+    }
+    if (!IsCell(body)) {
+        throw SyntaxError{};
+    }
+    const auto &head = AsCell(body)->GetFirst();
+    if (IsSymbol(head) && AsSymbol(head)->GetName() == "=>") {
+        // (test => receiver) calls the receiver with the value of the test.
+        auto receiver = AsCell(body)->GetSecond();
+        if (!IsCell(receiver) || AsCell(receiver)->GetSecond() != nullptr) {
+            throw SyntaxError{};
+        }
+        auto scope = std::move(frame.scope);
+        frames_.pop_back();
+        auto operand = ListOf(std::make_shared<Symbol>("quote"), std::move(value_));
+        auto operands = std::make_shared<Cell>(std::move(operand), nullptr);
+        frames_.push_back({FrameType::ARGUMENTS, std::move(operands), scope, values_.size()});
+        Eval(AsCell(receiver)->GetFirst(), std::move(scope));
+        return;
+    }
+    frame.type = FrameType::BODY;
+    frame.expr = std::move(body);
+    ContinueSequence();
+}
+
+// (define name value), (set! name value) and friends: exactly a symbol and one expression.
+void Evaluator::StartAssignment(FrameType type, const std::shared_ptr<Object> &args) {
+    if (!IsCell(args) || !IsSymbol(AsCell(args)->GetFirst())) {
+        throw SyntaxError{};
+    }
+    auto value = AsCell(args)->GetSecond();
+    if (!IsCell(value) || AsCell(value)->GetSecond() != nullptr) {
+        throw SyntaxError{};
+    }
+    frames_.push_back({type, AsCell(args)->GetFirst(), scope_, 0});
+    Eval(AsCell(value)->GetFirst(), scope_);
+}
+
+void Evaluator::EvalSequence(FrameType type, const std::shared_ptr<Object> &exprs,
+                             std::shared_ptr<Scope> scope) {
+    frames_.push_back({type, exprs, std::move(scope), 0});
+    ContinueSequence();
+}
+
+// Evaluates the next expression of the sequence in the top frame. The last one is evaluated
+// after the frame is gone, in tail position.
+void Evaluator::ContinueSequence() {
+    Frame &frame = frames_.back();
+    if (!IsCell(frame.expr)) {
+        throw SyntaxError{};
+    }
+    auto cell = AsCell(frame.expr);
+    if (cell->GetSecond() == nullptr) {
+        auto scope = std::move(frame.scope);
+        frames_.pop_back();
+        Eval(cell->GetFirst(), std::move(scope));
+    } else {
+        frame.expr = cell->GetSecond();
+        Eval(cell->GetFirst(), frame.scope);
+    }
+}
+
+void Evaluator::ApplyProcedure(size_t base) {
+    auto func = std::move(values_[base]);
+    if (IsContinuation(func)) {
+        if (values_.size() != base + 2) {
+            throw RuntimeError{};
+        }
+        auto value = std::move(values_[base + 1]);
+        values_.resize(base);
+        Resume(AsContinuation(func), std::move(value));
+        return;
+    }
+    if (IsCallCC(func)) {
+        if (values_.size() != base + 2) {
+            throw RuntimeError{};
+        }
+        auto proc = std::move(values_[base + 1]);
+        values_.resize(base);
+        StartCallCC(proc);
+        return;
+    }
+    if (IsRefFunction(func)) {
+        auto function = AsRefFunction(func);
+        auto frame = function->MakeFrame(values_.data() + base + 1, values_.size() - base - 1);
+        values_.resize(base);
+        EvalSequence(FrameType::BODY, function->GetBody(), std::move(frame));
+        return;
+    }
+    if (IsPipeline(func)) {
+        EnterPipeline(base, AsPipeline(func));
+        return;
+    }
+    if (!IsFunction(func)) {
+        throw RuntimeError{};
+    }
+    if (StartIteration(func, base)) {
+        return;
+    }
+    std::vector<std::shared_ptr<Object>> args(std::make_move_iterator(values_.begin() + base + 1),
+                                              std::make_move_iterator(values_.end()));
+    values_.resize(base);
+    if (IsChannelOperation(func)) {
+        // Called from here, a green thread can be parked until the channel is ready.
+        Return(AsChannelOperation(func)->Call(args, this));
+        return;
+    }
+    Return(func->Apply(args));
+}
+
+// map, for-each, filter and fold called from the program call the procedure on this stack
+// instead of on a nested evaluator, so the procedure may recurse into them as deep as into
+// itself, capture continuations and wait for channels. Their state is never changed in
+// place, so a continuation captured in the procedure can be re-entered. A procedure that is
+// the analysis of a lambda form is called in frames that chain to scope.
+bool Evaluator::StartIteration(const std::shared_ptr<Object> &func, size_t base,
+                               std::shared_ptr<Scope> scope) {
+    bool is_fold = func == FoldBuiltin();
+    bool is_filter = func == FilterBuiltin();
+    if (!is_fold && !is_filter && func != MapBuiltin() && func != ForEachBuiltin()) {
+        return false;
+    }
+    size_t count = values_.size() - base - 1;
+    if (is_filter ? count != 2 : count < (is_fold ? 3u : 2u)) {
+        throw RuntimeError{};
+    }
+    size_t first_list = base + (is_fold ? 3 : 2);
+    std::vector<std::shared_ptr<Object>> lists(std::make_move_iterator(values_.begin() + first_list),
+                                               std::make_move_iterator(values_.end()));
+    auto proc = std::move(values_[base + 1]);
+    auto result = is_fold ? std::move(values_[base + 2]) : nullptr;
+    values_.resize(base);
+    values_.push_back(std::move(proc));
+    values_.push_back(std::move(result));
+    values_.push_back(is_filter ? lists[0] : nullptr);
+    values_.insert(values_.end(), std::make_move_iterator(lists.begin()),
+                   std::make_move_iterator(lists.end()));
+    frames_.push_back({FrameType::ITERATION, func, std::move(scope), base});
+    NextElement();
+    return true;
+}
+
+// Calls the procedure on the next elements, or returns the result once the shortest list ends.
+void Evaluator::NextElement() {
+    Frame &frame = frames_.back();
+    size_t base = frame.base;
+    bool is_fold = frame.expr == FoldBuiltin();
+    bool is_ended = false;
+    for (size_t i = base + 3; i < values_.size(); ++i) {
+        is_ended = is_ended || !IsCell(values_[i]);
+    }
+    if (!is_ended) {
+        size_t call = values_.size();
+        values_.push_back(values_[base]);
+        for (size_t i = base + 3; i < call; ++i) {
+            values_.push_back(AsCell(values_[i])->GetFirst());
+        }
+        if (is_fold) {
+            values_.push_back(values_[base + 1]);
+        }
+        if (IsLambda(values_[call])) {
+            auto lambda = AsLambda(values_[call]);
+            auto scope = lambda->MakeFrame(frame.scope, values_.data() + call + 1,
+                                           values_.size() - call - 1);
+            values_.resize(call);
+            EvalSequence(FrameType::BODY, lambda->body, std::move(scope));
+            return;
+        }
+        ApplyProcedure(call);
+        return;
+    }
+    std::shared_ptr<Object> result;
+    if (is_fold) {
+        result = std::move(values_[base + 1]);
+    } else if (frame.expr == FilterBuiltin()) {
+        if (values_[base + 3] != nullptr) {
+            throw RuntimeError{};
+        }
+        // The elements kept before the shared tail are in reverse order.
+        result = std::move(values_[base + 2]);
+        for (auto kept = values_[base + 1]; kept != nullptr; kept = AsCell(kept)->GetSecond()) {
+            result = std::make_shared<Cell>(AsCell(kept)->GetFirst(), std::move(result));
+        }
+    } else if (frame.expr == MapBuiltin()) {
+        for (auto mapped = values_[base + 1]; mapped != nullptr;
+             mapped = AsCell(mapped)->GetSecond()) {
+            result = std::make_shared<Cell>(AsCell(mapped)->GetFirst(), std::move(result));
+        }
+    }
+    frames_.pop_back();
+    values_.resize(base);
+    Return(std::move(result));
+}
+
+void Evaluator::ContinueIteration() {
+    Frame &frame = frames_.back();
+    size_t base = frame.base;
+    if (frame.expr == MapBuiltin()) {
+        values_[base + 1] = std::make_shared<Cell>(std::move(value_), values_[base + 1]);
+    } else if (frame.expr == FoldBuiltin()) {
+        values_[base + 1] = std::move(value_);
+    } else if (frame.expr == FilterBuiltin() && IsFalse(value_)) {
+        // The elements between the shared tail and the dropped one are kept as copies.
+        const auto &dropped = values_[base + 3];
+        auto kept = std::move(values_[base + 2]);
+        for (; kept != dropped; kept = AsCell(kept)->GetSecond()) {
+            values_[base + 1] =
+                std::make_shared<Cell>(AsCell(kept)->GetFirst(), std::move(values_[base + 1]));
+        }
+        values_[base + 2] = AsCell(dropped)->GetSecond();
+    }
+    for (size_t i = base + 3; i < values_.size(); ++i) {
+        values_[i] = AsCell(values_[i])->GetSecond();
+    }
+    NextElement();
+}
+
+// The stages run from the innermost one, the last, to the sink, the first, on one element of
+// the list at a time.
+void Evaluator::EnterPipeline(size_t base, std::shared_ptr<Pipeline> pipeline) {
+    using Stage = Pipeline::Stage;
+    const auto &stages = pipeline->stages;
+    std::vector<std::shared_ptr<Object>> state;
+    std::shared_ptr<Object> result;
+    size_t next = base + 1;
+    for (auto stage : stages) {
+        size_t arity = StageArity(stage);
+        if (next + arity >= values_.size()) {
+            throw RuntimeError{};
+        }
+        state.push_back(arity > 0 ? std::move(values_[next]) : nullptr);
+        if (stage == Stage::FOLD) {
+            result = std::move(values_[next + 1]);
+        }
+        next += arity;
+    }
+    if (next + 1 != values_.size()) {
+        throw RuntimeError{};
+    }
+    if (stages[0] == Stage::LENGTH) {
+        result = std::make_shared<Number>(0);
+    }
+    state.push_back(std::move(result));
+    state.push_back(std::move(values_[next]));
+    state.push_back(nullptr);
+    values_.resize(base);
+    values_.insert(values_.end(), std::make_move_iterator(state.begin()),
+                   std::make_move_iterator(state.end()));
+    frames_.push_back({FrameType::PIPELINE, std::move(pipeline), nullptr, base});
+    NextPipelineElement(base);
+}
+
+void Evaluator::NextPipelineElement(size_t base) {
+    using Stage = Pipeline::Stage;
+    const auto &stages = static_cast<Pipeline *>(frames_.back().expr.get())->stages;
+    size_t count = stages.size();
+    const auto &list = values_[base + count + 1];
+    if (IsCell(list)) {
+        values_[base + count + 2] = AsCell(list)->GetFirst();
+        RunStage(base, count - 1);
+        return;
+    }
+    if (list != nullptr) {
+        throw RuntimeError{};
+    }
+    std::shared_ptr<Object> result;
+    if (stages[0] == Stage::MAP || stages[0] == Stage::FILTER) {
+        for (auto mapped = values_[base + count]; mapped != nullptr;
+             mapped = AsCell(mapped)->GetSecond()) {
+            result = std::make_shared<Cell>(AsCell(mapped)->GetFirst(), std::move(result));
+        }
+    } else if (stages[0] != Stage::FOR_EACH) {
+        result = std::move(values_[base + count]);
+    }
+    frames_.pop_back();
+    values_.resize(base);
+    Return(std::move(result));
+}
+
+void Evaluator::RunStage(size_t base, size_t stage) {
+    const auto &stages = static_cast<Pipeline *>(frames_.back().expr.get())->stages;
+    size_t count = stages.size();
+    if (stages[stage] == Pipeline::Stage::LENGTH) {
+        auto &length = values_[base + count];
+        length = std::make_shared<Number>(static_cast<Number *>(length.get())->GetValue() + 1);
+        values_[base + count + 1] = AsCell(values_[base + count + 1])->GetSecond();
+        NextPipelineElement(base);
+        return;
+    }
+    frames_.back().base = base + stage;
+    size_t call = values_.size();
+    values_.push_back(values_[base + stage]);
+    values_.push_back(values_[base + count + 2]);
+    if (stages[stage] == Pipeline::Stage::FOLD) {
+        values_.push_back(values_[base + count]);
+    }
+    ApplyProcedure(call);
+}
+
+void Evaluator::ContinuePipeline() {
+    using Stage = Pipeline::Stage;
+    Frame &frame = frames_.back();
+    const auto &stages = static_cast<Pipeline *>(frame.expr.get())->stages;
+    size_t count = stages.size();
+    // The state ends where the call of the stage was made.
+    size_t base = values_.size() - count - 3;
+    size_t stage = frame.base - base;
+    frame.base = base;
+    auto &result = values_[base + count];
+    auto &item = values_[base + count + 2];
+    bool is_kept = stages[stage] != Stage::FILTER || !IsFalse(value_);
+    if (stage > 0) {
+        if (stages[stage] == Stage::MAP) {
+            item = std::move(value_);
+        }
+        if (is_kept) {
+            RunStage(base, stage - 1);
+            return;
+        }
+    } else if (stages[0] == Stage::MAP) {
+        result = std::make_shared<Cell>(std::move(value_), std::move(result));
+    } else if (stages[0] == Stage::FILTER && is_kept) {
+        result = std::make_shared<Cell>(std::move(item), std::move(result));
+    } else if (stages[0] == Stage::FOLD) {
+        result = std::move(value_);
+    }
+    values_[base + count + 1] = AsCell(values_[base + count + 1])->GetSecond();
+    NextPipelineElement(base);
+}
+
+void Evaluator::StartCallCC(const std::shared_ptr<Object> &proc) {
+    auto continuation = std::make_shared<Continuation>(this, frames_.size() + 1, bottom_,
+                                                       values_bottom_, values_.size());
+    frames_.push_back({FrameType::CONTINUATION, continuation, nullptr, 0});
+    size_t base = values_.size();
+    values_.push_back(proc);
+    values_.push_back(std::move(continuation));
+    ApplyProcedure(base);
+}
+
+void Evaluator::Resume(const std::shared_ptr<Continuation> &continuation,
+                       std::shared_ptr<Object> value) {
+    if (!continuation->is_live_) {
+        Reinstate(continuation, std::move(value), bottom_, values_bottom_);
+        return;
+    }
+    if (!OwnsLive(*continuation) || continuation->depth_ <= bottom_) {
+        Escape(continuation, std::move(value));
+    }
+    CutStack(continuation->depth_, continuation->values_depth_);
+    Return(std::move(value));
+}
+
+// A live continuation is resumed by unwinding the C++ stack to a RunLoop of its owner, so the
+// owner has to be running below on this thread. The continuation of a parked green thread or
+// of another OS thread cannot be reached that way.
+void Evaluator::Escape(const std::shared_ptr<Continuation> &continuation,
+                       std::shared_ptr<Object> value) {
+    if (std::find(running_evaluators.begin(), running_evaluators.end(),
+                  continuation->owner_) == running_evaluators.end()) {
+        throw RuntimeError{};
+    }
+    throw ContinuationEscape{continuation, std::move(value)};
+}
+
+// Replaces everything above bottom with the frames saved in the continuation.
+void Evaluator::Reinstate(const std::shared_ptr<Continuation> &continuation,
+                          std::shared_ptr<Object> value, size_t bottom, size_t values_bottom) {
+    if (!continuation->is_saved_) {
+        throw RuntimeError{};
+    }
+    CutStack(bottom, values_bottom);
+    for (const auto &frame : continuation->frames_) {
+        frames_.push_back(frame);
+        frames_.back().base += values_bottom;
+    }
+    values_.insert(values_.end(), continuation->values_.begin(), continuation->values_.end());
+    for (size_t i = frames_.size() - continuation->frames_.size(); i < frames_.size(); ++i) {
+        if (frames_[i].type == FrameType::CONS_TAIL) {
+            CopyPartialList(&frames_[i]);
+        }
+    }
+    Return(std::move(value));
+}
+
+// The pairs a list under construction has so far may be part of a list that was returned
+// already, so a re-entered continuation goes on with a copy of them.
+void Evaluator::CopyPartialList(Frame *frame) {
+    std::shared_ptr<Object> cell = values_[frame->base];
+    auto head = std::make_shared<Cell>(AsCell(cell)->GetFirst(), nullptr);
+    auto last = head;
+    while (cell != frame->expr) {
+        cell = AsCell(cell)->GetSecond();
+        auto copy = std::make_shared<Cell>(AsCell(cell)->GetFirst(), nullptr);
+        last->SetSecond(copy);
+        last = std::move(copy);
+    }
+    values_[frame->base] = std::move(head);
+    frame->expr = std::move(last);
+}
+
+bool Evaluator::OwnsLive(const Continuation &continuation) {
+    return continuation.is_live_ && continuation.owner_ == this;
+}
+
+// The top frame is a marker that leaves the stack. If something still refers to its
+// continuation, the frames below the marker are copied into it so it can be re-entered.
+// Markers that came back with reinstated frames are copies and are just dropped.
+void Evaluator::ReleaseMarker(Frame *frame) {
+    auto continuation = AsContinuation(frame->expr);
+    if (!OwnsLive(*continuation) || continuation->depth_ != frames_.size()) {
+        return;
+    }
+    continuation->is_live_ = false;
+    frame->expr = nullptr;
+    if (continuation.use_count() == 1) {
+        return;
+    }
+    size_t values_bottom = continuation->values_bottom_;
+    for (size_t i = continuation->bottom_; i + 1 < continuation->depth_; ++i) {
+        continuation->frames_.push_back(frames_[i]);
+        continuation->frames_.back().base -= values_bottom;
+    }
+    continuation->values_.assign(values_.begin() + values_bottom,
+                                 values_.begin() + continuation->values_depth_);
+    continuation->is_saved_ = true;
+}
+
+void Evaluator::CutStack(size_t depth, size_t values_depth) {
+    expr_ = nullptr;
+    scope_ = nullptr;
+    value_ = nullptr;
+    while (frames_.size() > depth) {
+        if (frames_.back().type == FrameType::CONTINUATION) {
+            ReleaseMarker(&frames_.back());
+        }
+        frames_.pop_back();
+    }
+    values_.erase(values_.begin() + values_depth, values_.end());
+}
+
+std::shared_ptr<Object> Continuation::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (args.size() != 1) {
+        throw RuntimeError{};
+    }
+    Evaluator evaluator;
+    return evaluator.RunContinuation(shared_from_this(), args[0]);
+}
+
+EscapeBarrier::EscapeBarrier() {
+    outer_.swap(running_evaluators);
+}
+
+EscapeBarrier::~EscapeBarrier() {
+    outer_.swap(running_evaluators);
+}
+
+bool IsContinuation(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 6;
+}
+
+std::shared_ptr<Continuation> AsContinuation(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<Continuation>(obj);
+}
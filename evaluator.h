@@ -0,0 +1,189 @@
+#pragma once
+
+#include "object.h"
+
+class Continuation;
+
+// Evaluates expressions on its own stack of continuation frames kept on the heap instead of
+// the C++ call stack. Non-tail recursion in Scheme is bounded only by memory, every frame has
+// the same small size, and calls in tail position do not grow the stack at all.
+class Evaluator {
+public:
+    Evaluator() = default;
+    Evaluator(const Evaluator &) = delete;
+    Evaluator &operator=(const Evaluator &) = delete;
+    ~Evaluator();
+    std::shared_ptr<Object> Run(const std::shared_ptr<Object> &expr,
+                                const std::shared_ptr<Scope> &scope);
+    // Evaluates the expressions of a procedure body in order and returns the last value.
+    std::shared_ptr<Object> RunBody(const std::shared_ptr<Object> &body,
+                                    const std::shared_ptr<Scope> &scope);
+    std::shared_ptr<Object> RunCallCC(const std::shared_ptr<Object> &proc);
+    std::shared_ptr<Object> RunContinuation(const std::shared_ptr<Continuation> &continuation,
+                                            const std::shared_ptr<Object> &value);
+    // Green threads evaluate in slices: Start begins the evaluation and RunSlice goes on with it
+    // for at most steps steps and returns whether it has finished, with the value in *value.
+    // Pause ends the running slice at the next step, and SetValue replaces the value a paused
+    // evaluation goes on with.
+    void Start(const std::shared_ptr<Object> &expr, const std::shared_ptr<Scope> &scope);
+    bool RunSlice(size_t steps, std::shared_ptr<Object> *value);
+    void Pause();
+    void SetValue(std::shared_ptr<Object> value);
+
+    enum struct FrameType {
+        ARGUMENTS,
+        BODY,
+        IF,
+        DEFINE,
+        SET,
+        SET_CAR,
+        SET_CDR,
+        AND,
+        OR,
+        COND,
+        WHEN,
+        UNLESS,
+        LOOP,
+        LOOP_TEST,
+        LOOP_STEP,
+        CONS_FIRST,
+        CONS_TAIL,
+        ITERATION,
+        PIPELINE,
+        CONTINUATION
+    };
+
+    // What is left to do with the value of the expression being evaluated.
+    struct Frame {
+        FrameType type;
+        // The part of the form that is not evaluated yet, the variable to assign, the last pair
+        // of a list under construction, the continuation this frame marks, or the builtin or
+        // pipeline that iterates.
+        std::shared_ptr<Object> expr;
+        std::shared_ptr<Scope> scope;
+        // Where the operator and the evaluated operands of a call start on the value stack, or
+        // where the state of an iteration starts: the procedure, the result so far, the tail
+        // filter keeps as it is, and the lists. A pipeline keeps the procedures of its stages,
+        // the result so far, the list and the element, and its frame points to the procedure
+        // of the stage that runs.
+        size_t base;
+    };
+
+private:
+    std::shared_ptr<Object> RunLoop(size_t bottom, size_t values_bottom);
+    void Eval(std::shared_ptr<Object> expr, std::shared_ptr<Scope> scope);
+    void Return(std::shared_ptr<Object> value);
+    void Step();
+    void StartForm(const std::shared_ptr<Cell> &form);
+    void Continue();
+    bool StartSpecialForm(const std::shared_ptr<Cell> &form);
+    void StartPipeline(const std::shared_ptr<Cell> &form);
+    void StartTailCons(const std::shared_ptr<Cell> &form);
+    void ContinueTailCons();
+    std::shared_ptr<Lambda> AppliedLambda(const std::shared_ptr<Object> &op);
+    std::shared_ptr<Lambda> DownwardLambda(const std::shared_ptr<Object> &arg);
+    void MakeClosure(const std::shared_ptr<Lambda> &lambda);
+    void RewriteLet(const std::shared_ptr<Cell> &form);
+    void EnterLoop(size_t base, std::shared_ptr<Scope> scope);
+    void NextIteration();
+    void RestartLoop(size_t base);
+    void StartSteps();
+    void NextStep();
+    void ExpandMacro(const std::shared_ptr<Cell> &form, const Macro &macro);
+    void NextCondClause();
+    void ContinueCond();
+    void StartAssignment(FrameType type, const std::shared_ptr<Object> &args);
+    void EvalSequence(FrameType type, const std::shared_ptr<Object> &exprs,
+                      std::shared_ptr<Scope> scope);
+    void ContinueSequence();
+    void ApplyProcedure(size_t base);
+    bool StartIteration(const std::shared_ptr<Object> &func, size_t base,
+                        std::shared_ptr<Scope> scope = nullptr);
+    void NextElement();
+    void ContinueIteration();
+    void EnterPipeline(size_t base, std::shared_ptr<Pipeline> pipeline);
+    void NextPipelineElement(size_t base);
+    void RunStage(size_t base, size_t stage);
+    void ContinuePipeline();
+    void StartCallCC(const std::shared_ptr<Object> &proc);
+    void Resume(const std::shared_ptr<Continuation> &continuation,
+                std::shared_ptr<Object> value);
+    void Reinstate(const std::shared_ptr<Continuation> &continuation,
+                   std::shared_ptr<Object> value, size_t bottom, size_t values_bottom);
+    void CopyPartialList(Frame *frame);
+    bool OwnsLive(const Continuation &continuation);
+    [[noreturn]] static void Escape(const std::shared_ptr<Continuation> &continuation,
+                                    std::shared_ptr<Object> value);
+    void ReleaseMarker(Frame *frame);
+    void CutStack(size_t depth, size_t values_depth);
+
+    std::vector<Frame> frames_;
+    std::vector<std::shared_ptr<Object>> values_;
+    // The part of both stacks that belongs to the innermost running RunLoop.
+    size_t bottom_ = 0;
+    size_t values_bottom_ = 0;
+    std::shared_ptr<Object> expr_;
+    std::shared_ptr<Scope> scope_;
+    std::shared_ptr<Object> value_;
+    bool has_value_ = false;
+    // Steps left in the running slice; outside of slices there is no limit.
+    static constexpr size_t kNoLimit = static_cast<size_t>(-1);
+    size_t steps_left_ = kNoLimit;
+    bool is_paused_ = false;
+};
+
+// The rest of the computation at the point where call/cc was called. While that call/cc has
+// not returned, the frames are still on the stack of the evaluator and invoking the
+// continuation just cuts the stack back to its marker frame, which costs about as much as a
+// call. Only a continuation that outlives its call/cc gets a copy of the frames below the
+// marker, so that it can be re-entered later.
+class Continuation : public Object, public std::enable_shared_from_this<Continuation> {
+public:
+    Continuation(Evaluator *owner, size_t depth, size_t bottom, size_t values_bottom,
+                 size_t values_depth)
+        : Object(6),
+          owner_(owner),
+          depth_(depth),
+          bottom_(bottom),
+          values_bottom_(values_bottom),
+          values_depth_(values_depth) {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+
+private:
+    friend class Evaluator;
+    Evaluator *owner_;
+    // The marker frame is frames_[depth_ - 1] of the owner while is_live_ is set.
+    size_t depth_;
+    size_t bottom_;
+    size_t values_bottom_;
+    size_t values_depth_;
+    bool is_live_ = true;
+    bool is_saved_ = false;
+    std::vector<Evaluator::Frame> frames_;
+    std::vector<std::shared_ptr<Object>> values_;
+};
+
+// Thrown to reach the RunLoop that owns the marker frame of a continuation invoked from an
+// inner RunLoop or from another evaluator.
+struct ContinuationEscape {
+    std::shared_ptr<Continuation> continuation;
+    std::shared_ptr<Object> value;
+};
+
+// While it lives, the evaluators that were running on this thread before are out of reach of
+// the continuations invoked by those that run now, as if they ran on a thread of their own.
+class EscapeBarrier {
+public:
+    EscapeBarrier();
+    EscapeBarrier(const EscapeBarrier &) = delete;
+    EscapeBarrier &operator=(const EscapeBarrier &) = delete;
+    ~EscapeBarrier();
+
+private:
+    std::vector<const Evaluator *> outer_;
+};
+
+bool IsContinuation(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<Continuation> AsContinuation(const std::shared_ptr<Object> &obj);
@@ -0,0 +1,117 @@
+#include "object.h"
+
+namespace {
+using Stage = Pipeline::Stage;
+
+struct StageInfo {
+    Stage stage;
+    const char *name;
+    // How many procedure and initial value arguments come before the list.
+    size_t arity;
+};
+
+const StageInfo kStages[] = {{Stage::MAP, "map", 1},
+                             {Stage::FILTER, "filter", 1},
+                             {Stage::FOLD, "fold", 2},
+                             {Stage::FOR_EACH, "for-each", 1},
+                             {Stage::LENGTH, "length", 0}};
+
+const StageInfo &Info(Stage stage) {
+    return kStages[static_cast<size_t>(stage)];
+}
+
+const std::shared_ptr<Object> &StageBuiltin(Stage stage) {
+    static const std::shared_ptr<Object> builtins[] = {Builtin("map"), Builtin("filter"),
+                                                       Builtin("fold"), Builtin("for-each"),
+                                                       Builtin("length")};
+    return builtins[static_cast<size_t>(stage)];
+}
+
+// The arguments of form if it has exactly count of them.
+bool SplitArguments(Cell *form, size_t count, std::vector<std::shared_ptr<Object>> *args) {
+    args->clear();
+    auto rest = form->GetSecond();
+    for (; IsCell(rest); rest = AsCell(rest)->GetSecond()) {
+        args->push_back(AsCell(rest)->GetFirst());
+    }
+    return rest == nullptr && args->size() == count;
+}
+
+// (map f list) or (filter p list) inside a pipeline.
+bool IsInnerStage(const std::shared_ptr<Object> &expr, Stage *stage) {
+    if (!IsCell(expr) || !IsSymbol(AsCell(expr)->GetFirst())) {
+        return false;
+    }
+    const auto &name = AsSymbol(AsCell(expr)->GetFirst())->GetName();
+    for (Stage inner : {Stage::MAP, Stage::FILTER}) {
+        if (name == Info(inner).name) {
+            *stage = inner;
+            return true;
+        }
+    }
+    return false;
+}
+}  // namespace
+
+bool FusePipeline(Cell *form, const std::shared_ptr<Object> &op) {
+    const StageInfo *sink = nullptr;
+    for (const auto &info : kStages) {
+        if (op == StageBuiltin(info.stage)) {
+            sink = &info;
+        }
+    }
+    std::vector<std::shared_ptr<Object>> args;
+    Stage stage;
+    if (sink == nullptr || !SplitArguments(form, sink->arity + 1, &args) ||
+        !IsInnerStage(args.back(), &stage)) {
+        return false;
+    }
+    auto pipeline = std::make_shared<Pipeline>();
+    pipeline->stages.push_back(sink->stage);
+    pipeline->names.push_back(form->GetFirst());
+    pipeline->args = form->GetSecond();
+    auto list = std::move(args.back());
+    args.pop_back();
+    std::vector<std::shared_ptr<Object>> inner;
+    while (IsInnerStage(list, &stage) && SplitArguments(AsCell(list).get(), 2, &inner)) {
+        pipeline->stages.push_back(stage);
+        pipeline->names.push_back(AsCell(list)->GetFirst());
+        args.push_back(std::move(inner[0]));
+        list = std::move(inner[1]);
+    }
+    if (pipeline->stages.size() == 1) {
+        return false;
+    }
+    args.push_back(std::move(list));
+    ListBuilder operands;
+    for (auto &arg : args) {
+        operands.Add(std::move(arg));
+    }
+    form->SetFirst(std::move(pipeline));
+    form->SetSecond(operands.Finish());
+    return true;
+}
+
+size_t StageArity(Stage stage) {
+    return Info(stage).arity;
+}
+
+bool IsPipelineIntact(const Pipeline &pipeline, Scope *scope) {
+    for (size_t i = 0; i < pipeline.stages.size(); ++i) {
+        if (AsSymbol(pipeline.names[i])->Eval(scope) != StageBuiltin(pipeline.stages[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IsPipeline(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 12;
+}
+
+std::shared_ptr<Pipeline> AsPipeline(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<Pipeline>(obj);
+}
@@ -0,0 +1,251 @@
+#include "green.h"
+#include "isolate.h"
+#include <iostream>
+
+Scheduler &Scheduler::Current() {
+    thread_local Scheduler scheduler;
+    return scheduler;
+}
+
+std::shared_ptr<Object> Scheduler::Run(Evaluator *evaluator, const std::shared_ptr<Object> &expr,
+                                       const std::shared_ptr<Scope> &scope) {
+    std::shared_ptr<Object> value;
+    evaluator->Start(expr, scope);
+    while (!evaluator->RunSlice(kSliceSteps, &value)) {
+        ThrowIfCancelled();
+        RunRound();
+    }
+    while (RunRound()) {
+        ThrowIfCancelled();
+    }
+    return value;
+}
+
+void Scheduler::Spawn(const std::shared_ptr<Object> &thunk) {
+    auto thread = std::make_shared<GreenThread>();
+    thread->evaluator.Start(std::make_shared<Cell>(thunk, nullptr), nullptr);
+    ready_.push_back(std::move(thread));
+}
+
+void Scheduler::Yield() {
+    if (running_ != nullptr) {
+        running_->evaluator.Pause();
+    } else {
+        RunRound();
+    }
+}
+
+void Scheduler::Send(const std::shared_ptr<Object> &channel, std::shared_ptr<Object> value,
+                     Evaluator *caller) {
+    if (IsSharedChannel(channel)) {
+        auto shared = AsSharedChannel(channel);
+        auto message = CopyMessage(value);
+        if (shared->TryPush(&message)) {
+            return;
+        }
+        if (running_ != nullptr && caller == &running_->evaluator) {
+            Park(std::move(shared), std::move(message), true);
+            return;
+        }
+        while (!shared->TryPush(&message)) {
+            WaitABit();
+        }
+        return;
+    }
+    if (!IsChannel(channel)) {
+        throw RuntimeError{};
+    }
+    auto &queue = *AsChannel(channel);
+    if (queue.receivers_.empty()) {
+        queue.values_.push_back(std::move(value));
+        return;
+    }
+    auto thread = std::move(queue.receivers_.front());
+    queue.receivers_.pop_front();
+    thread->evaluator.SetValue(std::move(value));
+    thread->is_parked = false;
+    ready_.push_back(std::move(thread));
+}
+
+std::shared_ptr<Object> Scheduler::Receive(const std::shared_ptr<Object> &channel,
+                                           Evaluator *caller) {
+    bool is_direct = running_ != nullptr && caller == &running_->evaluator;
+    std::shared_ptr<Object> value;
+    if (IsSharedChannel(channel)) {
+        auto shared = AsSharedChannel(channel);
+        if (shared->TryPop(&value)) {
+            return value;
+        }
+        if (is_direct) {
+            Park(std::move(shared), nullptr, false);
+            return nullptr;
+        }
+        while (!shared->TryPop(&value)) {
+            WaitABit();
+        }
+        return value;
+    }
+    if (!IsChannel(channel)) {
+        throw RuntimeError{};
+    }
+    auto &queue = *AsChannel(channel);
+    if (queue.values_.empty() && is_direct) {
+        // The value the call returns is replaced by the one a sender hands over.
+        running_->is_parked = true;
+        running_->evaluator.Pause();
+        queue.receivers_.push_back(running_);
+        return nullptr;
+    }
+    while (queue.values_.empty()) {
+        if (!RunRound()) {
+            // Nothing can ever send to it.
+            throw RuntimeError{};
+        }
+    }
+    value = std::move(queue.values_.front());
+    queue.values_.pop_front();
+    return value;
+}
+
+void Scheduler::WaitABit() {
+    ThrowIfCancelled();
+    if (!RunRound()) {
+        std::this_thread::yield();
+    }
+}
+
+void Scheduler::ThrowIfCancelled() const {
+    if (cancel_flag_ != nullptr && cancel_flag_->load(std::memory_order_relaxed)) {
+        throw RuntimeError{};
+    }
+}
+
+void Scheduler::Park(std::shared_ptr<SharedChannel> channel, std::shared_ptr<Object> message,
+                     bool is_send) {
+    running_->is_parked = true;
+    running_->evaluator.Pause();
+    polling_.push_back({running_, std::move(channel), std::move(message), is_send});
+}
+
+void Scheduler::PollSharedChannels() {
+    for (size_t i = 0; i < polling_.size();) {
+        Poll &poll = polling_[i];
+        std::shared_ptr<Object> value;
+        if (poll.is_send ? !poll.channel->TryPush(&poll.message) : !poll.channel->TryPop(&value)) {
+            ++i;
+            continue;
+        }
+        if (!poll.is_send) {
+            poll.thread->evaluator.SetValue(std::move(value));
+        }
+        poll.thread->is_parked = false;
+        ready_.push_back(std::move(poll.thread));
+        polling_[i] = std::move(polling_.back());
+        polling_.pop_back();
+    }
+}
+
+// Threads that become ready during the round wait for the next one. A round can be started
+// from inside another one by a thread that waits for a channel in a nested call.
+bool Scheduler::RunRound() {
+    if (!polling_.empty()) {
+        PollSharedChannels();
+    }
+    size_t count = ready_.size();
+    for (size_t i = 0; i < count && !ready_.empty(); ++i) {
+        auto thread = std::move(ready_.front());
+        ready_.pop_front();
+        RunThread(std::move(thread));
+    }
+    return count > 0;
+}
+
+void Scheduler::RunThread(std::shared_ptr<GreenThread> thread) {
+    auto outer = std::move(running_);
+    running_ = thread;
+    bool is_finished = true;
+    const char *error = nullptr;
+    try {
+        EscapeBarrier barrier;
+        std::shared_ptr<Object> value;
+        is_finished = thread->evaluator.RunSlice(kSliceSteps, &value);
+    } catch (const SyntaxError &) {
+        error = "syntax error";
+    } catch (const NameError &) {
+        error = "name error";
+    } catch (const RuntimeError &) {
+        error = "runtime error";
+    } catch (...) {
+        running_ = std::move(outer);
+        throw;
+    }
+    running_ = std::move(outer);
+    if (error != nullptr) {
+        std::cerr << "green thread: " << error << "\n";
+        return;
+    }
+    if (!is_finished && !thread->is_parked) {
+        ready_.push_back(std::move(thread));
+    }
+}
+
+bool IsChannel(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 15;
+}
+
+std::shared_ptr<Channel> AsChannel(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<Channel>(obj);
+}
+
+bool IsChannelOperation(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 16;
+}
+
+std::shared_ptr<ChannelOperation> AsChannelOperation(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<ChannelOperation>(obj);
+}
+
+std::shared_ptr<Object> Spawn::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (args.size() != 1 || !IsFunction(args[0])) {
+        throw RuntimeError{};
+    }
+    Scheduler::Current().Spawn(args[0]);
+    return nullptr;
+}
+
+std::shared_ptr<Object> Yield::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (!args.empty()) {
+        throw RuntimeError{};
+    }
+    Scheduler::Current().Yield();
+    return nullptr;
+}
+
+std::shared_ptr<Object> MakeChannel::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (!args.empty()) {
+        throw RuntimeError{};
+    }
+    return std::make_shared<Channel>();
+}
+
+std::shared_ptr<Object> ChannelOperation::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    return Call(args, nullptr);
+}
+
+std::shared_ptr<Object> ChannelOperation::Call(const std::vector<std::shared_ptr<Object>> &args,
+                                               Evaluator *caller) {
+    if (args.size() != (is_send_ ? 2 : 1)) {
+        throw RuntimeError{};
+    }
+    if (is_send_) {
+        Scheduler::Current().Send(args[0], args[1], caller);
+        return nullptr;
+    }
+    return Scheduler::Current().Receive(args[0], caller);
+}
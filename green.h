@@ -0,0 +1,123 @@
+#pragma once
+
+#include "evaluator.h"
+#include <deque>
+
+class SharedChannel;
+
+// A thread of the interpreter: the evaluation of a thunk on an evaluator of its own, which the
+// scheduler of the OS thread that spawned it runs in slices of a fixed number of steps.
+struct GreenThread {
+    Evaluator evaluator;
+    // Waiting on a channel instead of in the run queue.
+    bool is_parked = false;
+};
+
+// An unbounded queue of values between green threads. Receiving from an empty channel blocks
+// until some thread sends to it.
+class Channel : public Object {
+public:
+    Channel() : Object(15) {
+    }
+
+private:
+    friend class Scheduler;
+    std::deque<std::shared_ptr<Object>> values_;
+    std::deque<std::shared_ptr<GreenThread>> receivers_;
+};
+
+bool IsChannel(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<Channel> AsChannel(const std::shared_ptr<Object> &obj);
+
+// Runs the green threads of one OS thread. A thread gives up the processor when its slice
+// ends, when it yields, when it receives from an empty channel and when it sends to a full
+// shared channel; a thread that waits for a shared channel is retried at every round, since
+// other OS threads do not know about it. The main program is
+// stopped at the end of its slices too, gives its turn to the other threads when it yields
+// or waits for a channel, and lets them run until they are all finished or blocked after
+// every top-level form. An error ends only the green thread that raised it and is reported on
+// stderr. A green thread cannot invoke the live continuations of other threads, nor they its.
+class Scheduler {
+public:
+    static constexpr size_t kSliceSteps = 1000;
+
+    static Scheduler &Current();
+
+    // Evaluates a top-level form of the main program.
+    std::shared_ptr<Object> Run(Evaluator *evaluator, const std::shared_ptr<Object> &expr,
+                                const std::shared_ptr<Scope> &scope);
+    void Spawn(const std::shared_ptr<Object> &thunk);
+    void Yield();
+    // The caller is the evaluator that calls the channel operation directly, or null. Only a
+    // green thread called from its own evaluator is parked; everybody else runs the other
+    // threads until the channel is ready.
+    void Send(const std::shared_ptr<Object> &channel, std::shared_ptr<Object> value,
+              Evaluator *caller);
+    std::shared_ptr<Object> Receive(const std::shared_ptr<Object> &channel, Evaluator *caller);
+    // Gives every thread that is ready now one slice; false if none is.
+    bool RunRound();
+    // Runs a round, or lets the other OS threads run if there is nothing to do here.
+    void WaitABit();
+    // Whether a thread waits for a shared channel, which other OS threads may make ready.
+    bool IsPolling() const {
+        return !polling_.empty();
+    }
+    // Once *flag is set, the main program and the waits for shared channels stop with a
+    // runtime error at their next turn, for an isolate that is cancelled.
+    void SetCancelFlag(const std::atomic<bool> *flag) {
+        cancel_flag_ = flag;
+    }
+
+private:
+    // A thread parked on a shared channel, with the message it sends, if it does.
+    struct Poll {
+        std::shared_ptr<GreenThread> thread;
+        std::shared_ptr<SharedChannel> channel;
+        std::shared_ptr<Object> message;
+        bool is_send;
+    };
+    void RunThread(std::shared_ptr<GreenThread> thread);
+    void Park(std::shared_ptr<SharedChannel> channel, std::shared_ptr<Object> message,
+              bool is_send);
+    void PollSharedChannels();
+    void ThrowIfCancelled() const;
+
+    std::deque<std::shared_ptr<GreenThread>> ready_;
+    std::shared_ptr<GreenThread> running_;
+    std::vector<Poll> polling_;
+    const std::atomic<bool> *cancel_flag_ = nullptr;
+};
+
+class Spawn : public Function {
+public:
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+};
+
+class Yield : public Function {
+public:
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+};
+
+class MakeChannel : public Function {
+public:
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+};
+
+// channel-send and channel-receive: procedures with a type of their own, so that the
+// evaluator can tell a direct call of them.
+class ChannelOperation : public Object {
+public:
+    explicit ChannelOperation(bool is_send) : Object(16), is_send_(is_send) {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+    std::shared_ptr<Object> Call(const std::vector<std::shared_ptr<Object>> &args,
+                                 Evaluator *caller);
+
+private:
+    bool is_send_;
+};
+
+bool IsChannelOperation(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<ChannelOperation> AsChannelOperation(const std::shared_ptr<Object> &obj);
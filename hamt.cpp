@@ -0,0 +1,119 @@
+#include "hamt.h"
+#include <functional>
+
+namespace {
+constexpr unsigned kBits = 5;
+constexpr unsigned kHashBits = 64;
+
+// The branch of the hash at the level that starts at shift, as a bit of the bitmap.
+uint32_t Branch(size_t hash, unsigned shift) {
+    return uint32_t{1} << ((static_cast<uint64_t>(hash) >> shift) & ((1u << kBits) - 1));
+}
+
+// Where the entry of the branch is in the packed entries of a node.
+size_t Position(uint32_t bitmap, uint32_t branch) {
+    return __builtin_popcount(bitmap & (branch - 1));
+}
+}  // namespace
+
+const std::shared_ptr<Object> *PersistentTable::Find(const Node *root, const std::string &name) {
+    size_t hash = std::hash<std::string>{}(name);
+    unsigned shift = 0;
+    for (const Node *node = root; node != nullptr; shift += kBits) {
+        if (shift >= kHashBits) {
+            for (const auto &entry : node->entries) {
+                if (entry.name == name) {
+                    return &entry.value;
+                }
+            }
+            return nullptr;
+        }
+        uint32_t branch = Branch(hash, shift);
+        if ((node->bitmap & branch) == 0) {
+            return nullptr;
+        }
+        const Entry &entry = node->entries[Position(node->bitmap, branch)];
+        if (entry.child == nullptr) {
+            return entry.hash == hash && entry.name == name ? &entry.value : nullptr;
+        }
+        node = entry.child.get();
+    }
+    return nullptr;
+}
+
+void PersistentTable::Set(const std::string &name, std::shared_ptr<Object> value) {
+    if (Set(&root_, name, std::move(value))) {
+        ++size_;
+    }
+}
+
+// The snapshot keeps the nodes it reads alive even if a writer replaces the root meanwhile.
+bool PersistentTable::FindShared(const std::string &name, std::shared_ptr<Object> *value) const {
+    auto root = std::atomic_load(&root_);
+    auto found = Find(root.get(), name);
+    if (found == nullptr) {
+        return false;
+    }
+    *value = *found;
+    return true;
+}
+
+// The root is referred to twice, by the table and by the copy here, so it is copied, and then
+// so is every node below it on the path, each referred to by the original and the copy.
+void PersistentTable::SetShared(const std::string &name, std::shared_ptr<Object> value) {
+    auto root = std::atomic_load(&root_);
+    if (Set(&root, name, std::move(value))) {
+        ++size_;
+    }
+    std::atomic_store(&root_, std::move(root));
+}
+
+bool PersistentTable::Set(std::shared_ptr<Node> *root, const std::string &name,
+                          std::shared_ptr<Object> value) {
+    size_t hash = std::hash<std::string>{}(name);
+    std::shared_ptr<Node> *link = root;
+    for (unsigned shift = 0;; shift += kBits) {
+        if (*link == nullptr) {
+            *link = std::make_shared<Node>();
+        } else if (link->use_count() > 1) {
+            // Another table has this node too, so this one gets a copy of its own.
+            *link = std::make_shared<Node>(**link);
+        }
+        Node &node = **link;
+        if (shift >= kHashBits) {
+            for (auto &entry : node.entries) {
+                if (entry.name == name) {
+                    entry.value = std::move(value);
+                    return false;
+                }
+            }
+            node.entries.push_back({hash, name, std::move(value), nullptr});
+            return true;
+        }
+        uint32_t branch = Branch(hash, shift);
+        size_t position = Position(node.bitmap, branch);
+        if ((node.bitmap & branch) == 0) {
+            node.bitmap |= branch;
+            node.entries.insert(node.entries.begin() + position,
+                                {hash, name, std::move(value), nullptr});
+            return true;
+        }
+        Entry &entry = node.entries[position];
+        if (entry.child == nullptr) {
+            if (entry.hash == hash && entry.name == name) {
+                entry.value = std::move(value);
+                return false;
+            }
+            // Two names on one branch: the variable there moves down into a node of its own,
+            // and the loop goes on to put the new one next to it.
+            auto child = std::make_shared<Node>();
+            unsigned next = shift + kBits;
+            if (next < kHashBits) {
+                child->bitmap = Branch(entry.hash, next);
+            }
+            child->entries.push_back(std::move(entry));
+            entry = {0, {}, nullptr, std::move(child)};
+        }
+        link = &entry.child;
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Object;
+
+// A map of names to values kept as a hash array mapped trie: every node is an array of up to
+// 32 branches picked by five bits of the hash of the name. A copy of the table shares all its
+// nodes with the original and costs as much as copying a pointer; a change copies only the
+// nodes on the path to its name that are shared, and changes the others in place, so neither
+// copy ever sees the changes of the other.
+class PersistentTable {
+public:
+    // The value of the name, or null if the table does not have it.
+    const std::shared_ptr<Object> *Find(const std::string &name) const {
+        return Find(root_.get(), name);
+    }
+    void Set(const std::string &name, std::shared_ptr<Object> value);
+    // For a table that other threads look names up in while it changes: the root is read and
+    // replaced atomically, and a change copies every node on its path, since readers may be on
+    // the old ones. Changes still have to be made one at a time.
+    bool FindShared(const std::string &name, std::shared_ptr<Object> *value) const;
+    void SetShared(const std::string &name, std::shared_ptr<Object> value);
+    size_t Size() const {
+        return size_;
+    }
+    void Clear() {
+        root_ = nullptr;
+        size_ = 0;
+    }
+    // Calls visit(name, value) for every variable, in no particular order.
+    template <class Visit>
+    void ForEach(const Visit &visit) const {
+        if (root_ != nullptr) {
+            ForEach(*root_, visit);
+        }
+    }
+
+private:
+    struct Node;
+    // A variable, or a branch to a node further down when child is set.
+    struct Entry {
+        size_t hash;
+        std::string name;
+        std::shared_ptr<Object> value;
+        std::shared_ptr<Node> child;
+    };
+    // Below the last bits of the hash, a node keeps the names that collide in a plain list
+    // and its bitmap is not used.
+    struct Node {
+        uint32_t bitmap = 0;
+        std::vector<Entry> entries;
+    };
+
+    static const std::shared_ptr<Object> *Find(const Node *root, const std::string &name);
+    // Returns whether the name is new.
+    static bool Set(std::shared_ptr<Node> *root, const std::string &name,
+                    std::shared_ptr<Object> value);
+
+    template <class Visit>
+    static void ForEach(const Node &node, const Visit &visit) {
+        for (const auto &entry : node.entries) {
+            if (entry.child != nullptr) {
+                ForEach(*entry.child, visit);
+            } else {
+                visit(entry.name, entry.value);
+            }
+        }
+    }
+
+    std::shared_ptr<Node> root_;
+    size_t size_ = 0;
+};
@@ -0,0 +1,619 @@
+#include "image.h"
+#include "io.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <unordered_map>
+
+namespace {
+const char kMagic[8] = {'S', 'C', 'M', 'I', 'M', 'G', '\0', '\1'};
+
+// What an object is, in its header. Numbers, symbols, booleans and builtins are whole in
+// their headers; the rest have their fields in a body of their own.
+enum Tag : uint8_t {
+    NUMBER,
+    SYMBOL,
+    BOOL,
+    BUILTIN,
+    SPAWN_FUTURE,
+    CELL,
+    LAMBDA,
+    PROCEDURE,
+    LOOP,
+    RECUR,
+    TAIL_CONS,
+    MACRO,
+    PIPELINE
+};
+
+enum Kind : uint8_t { OBJECT, BOX };
+
+constexpr size_t kStageCount = 5;
+
+void Put(std::string *out, uint32_t value) {
+    out->append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void PutByte(std::string *out, uint8_t value) {
+    out->push_back(static_cast<char>(value));
+}
+
+void PutString(std::string *out, const std::string &value) {
+    Put(out, value.size());
+    out->append(value);
+}
+
+// Numbers every object, box and layout it is given the first time it sees them. Headers and
+// layouts are written at once; bodies are written by Finish, which goes on until the bodies
+// of the objects they refer to are written too, so no object graph is walked by recursion.
+class ImageWriter {
+public:
+    void AddGlobal(const std::string &name, const std::shared_ptr<Object> &value) {
+        PutString(&globals_, name);
+        PutObject(&globals_, value.get());
+        ++global_count_;
+    }
+
+    std::string Finish() {
+        for (size_t i = 0; i < pending_.size(); ++i) {
+            if (pending_[i].box != nullptr) {
+                WriteBox(pending_[i].box);
+            } else {
+                WriteBody(pending_[i].object);
+            }
+        }
+        std::string image(kMagic, sizeof(kMagic));
+        Put(&image, layout_ids_.size());
+        image += layouts_;
+        Put(&image, box_ids_.size());
+        Put(&image, object_ids_.size());
+        image += headers_;
+        Put(&image, global_count_);
+        image += globals_;
+        Put(&image, pending_.size());
+        image += bodies_;
+        return image;
+    }
+
+private:
+    struct Pending {
+        Object *object;
+        Box *box;
+    };
+
+    // 0 is null; any other object is its number plus one.
+    void PutObject(std::string *out, Object *obj) {
+        if (obj == nullptr) {
+            Put(out, 0);
+            return;
+        }
+        auto [it, is_new] = object_ids_.emplace(obj, object_ids_.size());
+        if (is_new) {
+            WriteHeader(obj);
+        }
+        Put(out, it->second + 1);
+    }
+
+    void PutBox(std::string *out, Box *box) {
+        auto [it, is_new] = box_ids_.emplace(box, box_ids_.size());
+        if (is_new) {
+            pending_.push_back({nullptr, box});
+        }
+        Put(out, it->second);
+    }
+
+    void PutLayout(std::string *out, const Layout *layout) {
+        auto [it, is_new] = layout_ids_.emplace(layout, layout_ids_.size());
+        if (is_new) {
+            Put(&layouts_, layout->names.size());
+            for (const auto &name : layout->names) {
+                PutString(&layouts_, name);
+            }
+            Put(&layouts_, layout->param_count);
+            PutByte(&layouts_, layout->has_rest);
+            Put(&layouts_, layout->capture_start);
+        }
+        Put(out, it->second);
+    }
+
+    void WriteHeader(Object *obj) {
+        switch (obj->type_) {
+            case 0:
+                PutByte(&headers_, NUMBER);
+                Put(&headers_, static_cast<uint32_t>(static_cast<Number *>(obj)->GetValue()));
+                return;
+            case 1:
+                PutByte(&headers_, SYMBOL);
+                PutString(&headers_, static_cast<Symbol *>(obj)->GetName());
+                return;
+            case 3:
+                PutByte(&headers_, BOOL);
+                PutByte(&headers_, static_cast<Bool *>(obj)->Get());
+                return;
+            case 4:
+            case 7:
+            case 16:
+                if (auto name = BuiltinName(obj)) {
+                    PutByte(&headers_, BUILTIN);
+                    PutString(&headers_, *name);
+                    return;
+                }
+                if (dynamic_cast<SpawnFuture *>(obj) != nullptr) {
+                    PutByte(&headers_, SPAWN_FUTURE);
+                    return;
+                }
+                throw RuntimeError{};
+            case 2:
+                PutByte(&headers_, CELL);
+                break;
+            case 8:
+                PutByte(&headers_, LAMBDA);
+                break;
+            case 5:
+                PutByte(&headers_, PROCEDURE);
+                break;
+            case 9:
+                PutByte(&headers_, LOOP);
+                break;
+            case 10:
+                PutByte(&headers_, RECUR);
+                break;
+            case 13:
+                PutByte(&headers_, TAIL_CONS);
+                break;
+            case 11:
+                PutByte(&headers_, MACRO);
+                break;
+            case 12:
+                PutByte(&headers_, PIPELINE);
+                break;
+            default:
+                // Continuations, futures, channels and isolates belong to the running program.
+                throw RuntimeError{};
+        }
+        pending_.push_back({obj, nullptr});
+    }
+
+    void WriteBox(Box *box) {
+        PutByte(&bodies_, BOX);
+        Put(&bodies_, box_ids_[box]);
+        PutObject(&bodies_, box->value.get());
+        PutByte(&bodies_, box->is_bound);
+    }
+
+    void WriteBody(Object *obj) {
+        std::string *out = &bodies_;
+        PutByte(out, OBJECT);
+        Put(out, object_ids_[obj]);
+        switch (obj->type_) {
+            case 2: {
+                auto cell = static_cast<Cell *>(obj);
+                PutObject(out, cell->GetFirst().get());
+                PutObject(out, cell->GetSecond().get());
+                return;
+            }
+            case 8: {
+                auto lambda = static_cast<Lambda *>(obj);
+                PutString(out, lambda->name);
+                PutObject(out, lambda->params.get());
+                PutObject(out, lambda->body.get());
+                PutLayout(out, lambda->own.get());
+                Put(out, lambda->free.size());
+                for (const auto &name : lambda->free) {
+                    PutString(out, name);
+                }
+                return;
+            }
+            case 5: {
+                auto procedure = static_cast<RefFunction *>(obj);
+                PutObject(out, procedure->lambda.get());
+                PutLayout(out, procedure->layout.get());
+                Put(out, procedure->captured.size());
+                for (const auto &box : procedure->captured) {
+                    PutBox(out, box.get());
+                }
+                return;
+            }
+            case 9: {
+                auto loop = static_cast<Loop *>(obj);
+                PutObject(out, loop->lambda.get());
+                PutObject(out, loop->inits.get());
+                PutByte(out, loop->is_do);
+                PutObject(out, loop->test.get());
+                PutObject(out, loop->result.get());
+                Put(out, loop->steps.size());
+                for (const auto &[slot, step] : loop->steps) {
+                    Put(out, slot);
+                    PutObject(out, step.get());
+                }
+                return;
+            }
+            case 10:
+                PutObject(out, static_cast<Recur *>(obj)->loop);
+                return;
+            case 13:
+                PutObject(out, static_cast<TailCons *>(obj)->name.get());
+                return;
+            case 11: {
+                auto macro = static_cast<Macro *>(obj);
+                PutString(out, macro->ellipsis);
+                Put(out, macro->literals.size());
+                for (const auto &literal : macro->literals) {
+                    PutString(out, literal);
+                }
+                Put(out, macro->rules.size());
+                for (const auto &[pattern, tmpl] : macro->rules) {
+                    PutObject(out, pattern.get());
+                    PutObject(out, tmpl.get());
+                }
+                return;
+            }
+            case 12: {
+                auto pipeline = static_cast<Pipeline *>(obj);
+                Put(out, pipeline->stages.size());
+                for (size_t i = 0; i < pipeline->stages.size(); ++i) {
+                    PutByte(out, static_cast<uint8_t>(pipeline->stages[i]));
+                    PutObject(out, pipeline->names[i].get());
+                }
+                PutObject(out, pipeline->args.get());
+                return;
+            }
+        }
+    }
+
+    std::unordered_map<const Object *, uint32_t> object_ids_;
+    std::unordered_map<const Box *, uint32_t> box_ids_;
+    std::unordered_map<const Layout *, uint32_t> layout_ids_;
+    std::vector<Pending> pending_;
+    std::string layouts_;
+    std::string headers_;
+    std::string globals_;
+    std::string bodies_;
+    uint32_t global_count_ = 0;
+};
+
+// Reads an image straight from the mapping of its file. Every count and number is checked
+// against what is left of the file and what has been read so far, so a damaged image is a
+// runtime error and not a crash.
+class ImageReader {
+public:
+    ImageReader(std::streambuf *in, std::shared_ptr<Scope> scope)
+        : in_(in), scope_(std::move(scope)) {
+    }
+
+    void Load() {
+        char magic[sizeof(kMagic)];
+        Read(magic, sizeof(magic));
+        if (!std::equal(magic, magic + sizeof(magic), kMagic)) {
+            throw RuntimeError{};
+        }
+        layouts_.resize(GetCount());
+        for (auto &layout : layouts_) {
+            layout = GetLayoutRecord();
+        }
+        boxes_.resize(GetCount());
+        for (auto &box : boxes_) {
+            box = std::make_shared<Box>(Box{nullptr, false});
+        }
+        objects_.resize(GetCount());
+        for (auto &obj : objects_) {
+            obj = GetHeader();
+        }
+        is_filled_.assign(objects_.size() + boxes_.size(), false);
+        std::vector<std::pair<std::string, std::shared_ptr<Object>>> globals(GetCount());
+        for (auto &[name, value] : globals) {
+            name = GetString();
+            value = GetObject();
+        }
+        for (uint32_t count = GetCount(); count > 0; --count) {
+            GetBody();
+        }
+        for (size_t i = 0; i < objects_.size(); ++i) {
+            if (HasBody(objects_[i]) && !is_filled_[i]) {
+                throw RuntimeError{};
+            }
+        }
+        for (size_t i = 0; i < boxes_.size(); ++i) {
+            if (!is_filled_[objects_.size() + i]) {
+                throw RuntimeError{};
+            }
+        }
+        for (const auto &loop : loops_) {
+            for (const auto &step : loop->steps) {
+                if (step.first >= loop->lambda->own->names.size()) {
+                    throw RuntimeError{};
+                }
+            }
+        }
+        for (auto &[name, value] : globals) {
+            scope_->Init(name, std::move(value));
+        }
+    }
+
+private:
+    static bool HasBody(const std::shared_ptr<Object> &obj) {
+        return obj != nullptr && obj->type_ != 0 && obj->type_ != 1 && obj->type_ != 3 &&
+               obj->type_ != 4 && obj->type_ != 7 && obj->type_ != 16;
+    }
+
+    void Read(void *data, size_t size) {
+        if (in_->sgetn(static_cast<char *>(data), size) != static_cast<std::streamsize>(size)) {
+            throw RuntimeError{};
+        }
+    }
+
+    uint32_t Get() {
+        uint32_t value;
+        Read(&value, sizeof(value));
+        return value;
+    }
+
+    uint8_t GetByte() {
+        uint8_t value;
+        Read(&value, sizeof(value));
+        return value;
+    }
+
+    // Anything that is counted takes at least a byte of the file.
+    uint32_t GetCount() {
+        uint32_t count = Get();
+        if (count > static_cast<size_t>(in_->in_avail())) {
+            throw RuntimeError{};
+        }
+        return count;
+    }
+
+    std::string GetString() {
+        std::string value(GetCount(), '\0');
+        Read(value.data(), value.size());
+        return value;
+    }
+
+    std::shared_ptr<Object> GetObject() {
+        uint32_t id = Get();
+        if (id > objects_.size()) {
+            throw RuntimeError{};
+        }
+        return id == 0 ? nullptr : objects_[id - 1];
+    }
+
+    std::shared_ptr<Lambda> GetLambda() {
+        auto obj = GetObject();
+        if (!IsLambda(obj)) {
+            throw RuntimeError{};
+        }
+        return AsLambda(obj);
+    }
+
+    std::shared_ptr<Object> GetSymbol() {
+        auto obj = GetObject();
+        if (!IsSymbol(obj)) {
+            throw RuntimeError{};
+        }
+        return obj;
+    }
+
+    std::shared_ptr<Box> GetBox() {
+        uint32_t id = Get();
+        if (id >= boxes_.size()) {
+            throw RuntimeError{};
+        }
+        return boxes_[id];
+    }
+
+    std::shared_ptr<const Layout> GetLayout() {
+        uint32_t id = Get();
+        if (id >= layouts_.size()) {
+            throw RuntimeError{};
+        }
+        return layouts_[id];
+    }
+
+    std::shared_ptr<const Layout> GetLayoutRecord() {
+        auto layout = std::make_shared<Layout>();
+        layout->names.resize(GetCount());
+        for (auto &name : layout->names) {
+            name = GetString();
+        }
+        layout->param_count = Get();
+        layout->has_rest = GetByte() != 0;
+        layout->capture_start = Get();
+        if (layout->param_count + layout->has_rest > layout->names.size() ||
+            layout->capture_start > layout->names.size()) {
+            throw RuntimeError{};
+        }
+        return layout;
+    }
+
+    // The whole object for the tags that have no body, and an empty one to be filled in for
+    // the rest, since objects may refer to each other in a cycle.
+    std::shared_ptr<Object> GetHeader() {
+        switch (GetByte()) {
+            case NUMBER:
+                return std::make_shared<Number>(static_cast<int>(Get()));
+            case SYMBOL:
+                return std::make_shared<Symbol>(GetString());
+            case BOOL:
+                return std::make_shared<Bool>(GetByte() != 0);
+            case BUILTIN:
+                if (auto builtin = Builtin(GetString())) {
+                    return builtin;
+                }
+                throw RuntimeError{};
+            case SPAWN_FUTURE:
+                return std::make_shared<SpawnFuture>();
+            case CELL:
+                return std::make_shared<Cell>(nullptr, nullptr);
+            case LAMBDA:
+                return std::make_shared<Lambda>("", nullptr, nullptr);
+            case PROCEDURE:
+                return std::make_shared<RefFunction>();
+            case LOOP:
+                return std::make_shared<Loop>(nullptr, nullptr);
+            case RECUR:
+                return std::make_shared<Recur>(nullptr);
+            case TAIL_CONS:
+                return std::make_shared<TailCons>(nullptr);
+            case MACRO:
+                return std::make_shared<Macro>();
+            case PIPELINE:
+                return std::make_shared<Pipeline>();
+        }
+        throw RuntimeError{};
+    }
+
+    void GetBody() {
+        uint8_t kind = GetByte();
+        uint32_t id = Get();
+        if (kind == BOX) {
+            if (id >= boxes_.size() || is_filled_[objects_.size() + id]) {
+                throw RuntimeError{};
+            }
+            is_filled_[objects_.size() + id] = true;
+            boxes_[id]->value = GetObject();
+            boxes_[id]->is_bound = GetByte() != 0;
+            return;
+        }
+        if (kind != OBJECT || id >= objects_.size() || !HasBody(objects_[id]) ||
+            is_filled_[id]) {
+            throw RuntimeError{};
+        }
+        is_filled_[id] = true;
+        const auto &obj = objects_[id];
+        switch (obj->type_) {
+            case 2: {
+                auto cell = AsCell(obj);
+                cell->SetFirst(GetObject());
+                cell->SetSecond(GetObject());
+                return;
+            }
+            case 8: {
+                auto lambda = AsLambda(obj);
+                lambda->name = GetString();
+                lambda->params = GetObject();
+                lambda->body = GetObject();
+                lambda->own = GetLayout();
+                lambda->free.resize(GetCount());
+                for (auto &name : lambda->free) {
+                    name = GetString();
+                }
+                return;
+            }
+            case 5: {
+                auto procedure = AsRefFunction(obj);
+                procedure->lambda = GetLambda();
+                procedure->layout = GetLayout();
+                procedure->captured.resize(GetCount());
+                for (auto &box : procedure->captured) {
+                    box = GetBox();
+                }
+                if (procedure->layout->capture_start + procedure->captured.size() >
+                    procedure->layout->names.size()) {
+                    throw RuntimeError{};
+                }
+                procedure->global = scope_;
+                return;
+            }
+            case 9: {
+                auto loop = AsLoop(obj);
+                loop->lambda = GetLambda();
+                loop->inits = GetObject();
+                loop->is_do = GetByte() != 0;
+                loop->test = GetObject();
+                loop->result = GetObject();
+                loop->steps.resize(GetCount());
+                for (auto &[slot, step] : loop->steps) {
+                    slot = Get();
+                    step = GetObject();
+                }
+                loops_.push_back(loop.get());
+                return;
+            }
+            case 10: {
+                auto loop = GetObject();
+                if (!IsLoop(loop)) {
+                    throw RuntimeError{};
+                }
+                AsRecur(obj)->loop = static_cast<Loop *>(loop.get());
+                return;
+            }
+            case 13:
+                AsTailCons(obj)->name = GetSymbol();
+                return;
+            case 11: {
+                auto macro = AsMacro(obj);
+                macro->ellipsis = GetString();
+                macro->literals.resize(GetCount());
+                for (auto &literal : macro->literals) {
+                    literal = GetString();
+                }
+                macro->rules.resize(GetCount());
+                for (auto &[pattern, tmpl] : macro->rules) {
+                    pattern = GetObject();
+                    tmpl = GetObject();
+                }
+                return;
+            }
+            case 12: {
+                auto pipeline = AsPipeline(obj);
+                uint32_t count = GetCount();
+                for (uint32_t i = 0; i < count; ++i) {
+                    uint8_t stage = GetByte();
+                    if (stage >= kStageCount) {
+                        throw RuntimeError{};
+                    }
+                    pipeline->stages.push_back(static_cast<Pipeline::Stage>(stage));
+                    pipeline->names.push_back(GetSymbol());
+                }
+                pipeline->args = GetObject();
+                return;
+            }
+        }
+    }
+
+    std::streambuf *in_;
+    std::shared_ptr<Scope> scope_;
+    std::vector<std::shared_ptr<const Layout>> layouts_;
+    std::vector<std::shared_ptr<Box>> boxes_;
+    std::vector<std::shared_ptr<Object>> objects_;
+    // Objects first and then boxes, so that nothing gets two bodies or none.
+    std::vector<bool> is_filled_;
+    std::vector<Loop *> loops_;
+};
+}  // namespace
+
+// The image is written next to the file and renamed over it, so a process that has the old
+// image mapped never sees it change under it.
+void SaveImage(const std::string &path, Scope *scope) {
+    ImageWriter writer;
+    std::set<std::string> saved;
+    for (; scope != nullptr; scope = scope->father.get()) {
+        if (scope->layout != nullptr) {
+            continue;
+        }
+        scope->table.ForEach([&](const std::string &name, const std::shared_ptr<Object> &value) {
+            if (saved.insert(name).second && value != Builtin(name)) {
+                writer.AddGlobal(name, value);
+            }
+        });
+    }
+    std::string image = writer.Finish();
+    std::string temporary = path + ".tmp";
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    out.write(image.data(), image.size());
+    out.close();
+    if (!out || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        throw RuntimeError{};
+    }
+}
+
+void LoadImage(const std::string &path, const std::shared_ptr<Scope> &scope) {
+    MappedFile file(path);
+    if (!file.IsOpen()) {
+        throw RuntimeError{};
+    }
+    ImageReader(&file, scope).Load();
+}
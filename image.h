@@ -0,0 +1,17 @@
+#pragma once
+
+#include "object.h"
+
+// A heap image is the global environment written out as a graph: every object, box and
+// layout gets a number and refers to the others by number instead of by address, so the
+// image loads at any address. Code is saved as it is after evaluation, with the analyses
+// that took the place of forms, so nothing of it is read or analyzed again on loading.
+// Builtins are saved by name; continuations, futures, channels and isolates cannot be saved.
+
+// Writes the variables of the global scopes above scope, except for the builtins that still
+// have their own names, to the file at path.
+void SaveImage(const std::string &path, Scope *scope);
+
+// Defines the variables of the image at path in the global scope. A missing file or one that
+// is not an image is a runtime error.
+void LoadImage(const std::string &path, const std::shared_ptr<Scope> &scope);
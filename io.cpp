@@ -0,0 +1,98 @@
+#include "io.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &path) : data_(nullptr), size_(0), is_open_(false) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+        size_ = info.st_size;
+        is_open_ = true;
+        if (size_ > 0) {
+            void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                size_ = 0;
+                is_open_ = false;
+            } else {
+                data_ = static_cast<char *>(data);
+                madvise(data_, size_, MADV_SEQUENTIAL);
+            }
+        }
+    }
+    close(fd);
+    setg(data_, data_, data_ + size_);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+}
+
+OutputBuffer::OutputBuffer(int fd, size_t capacity)
+    : fd_(fd), is_terminal_(isatty(fd) == 1), buffer_(capacity) {
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+OutputBuffer::~OutputBuffer() {
+    Flush();
+}
+
+void OutputBuffer::Flush() {
+    WriteAll(pbase(), pptr() - pbase());
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+OutputBuffer::int_type OutputBuffer::overflow(int_type ch) {
+    Flush();
+    if (ch != traits_type::eof()) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+        if (is_terminal_ && ch == '\n') {
+            Flush();
+        }
+    }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize OutputBuffer::xsputn(const char *data, std::streamsize size) {
+    if (size > epptr() - pptr()) {
+        Flush();
+        if (static_cast<size_t>(size) >= buffer_.size()) {
+            WriteAll(data, size);
+            return size;
+        }
+    }
+    std::memcpy(pptr(), data, size);
+    pbump(static_cast<int>(size));
+    if (is_terminal_ && std::memchr(data, '\n', size) != nullptr) {
+        Flush();
+    }
+    return size;
+}
+
+int OutputBuffer::sync() {
+    Flush();
+    return 0;
+}
+
+void OutputBuffer::WriteAll(const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd_, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return;
+        }
+        data += written;
+        size -= written;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// Read-only stream over a whole file mapped into memory, so the tokenizer reads a script
+// without copying it through a stdio buffer.
+class MappedFile : public std::streambuf {
+public:
+    explicit MappedFile(const std::string &path);
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+    bool IsOpen() {
+        return is_open_;
+    }
+
+private:
+    char *data_;
+    size_t size_;
+    bool is_open_;
+};
+
+// Writes straight to a file descriptor through one large buffer. Nothing reaches the
+// descriptor until the buffer is full or Flush() is called, except on a terminal, where every
+// finished line is written at once so that a result shows up before the next form runs.
+class OutputBuffer : public std::streambuf {
+public:
+    explicit OutputBuffer(int fd, size_t capacity = 1 << 20);
+    OutputBuffer(const OutputBuffer &) = delete;
+    OutputBuffer &operator=(const OutputBuffer &) = delete;
+    ~OutputBuffer();
+    void Flush();
+
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char *data, std::streamsize size) override;
+    int sync() override;
+
+private:
+    void WriteAll(const char *data, size_t size);
+    int fd_;
+    bool is_terminal_;
+    std::vector<char> buffer_;
+};
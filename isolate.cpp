@@ -0,0 +1,294 @@
+#include "isolate.h"
+#include "scheme.h"
+
+namespace {
+constexpr size_t kDefaultCapacity = 1024;
+// How long a wait for an isolate sleeps before it looks at green threads that wait for shared
+// channels again.
+constexpr auto kPollInterval = std::chrono::milliseconds(1);
+
+// Every isolate thread, so that they can be joined before the program ends.
+class Registry {
+public:
+    static Registry &Get() {
+        static Registry registry;
+        return registry;
+    }
+    ~Registry() {
+        Stop();
+    }
+    // Joins the threads of the isolates that have finished on the way.
+    void Add(std::shared_ptr<Isolate::State> state, std::thread thread) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < entries_.size();) {
+            if (IsFinished(*entries_[i].state)) {
+                entries_[i].thread.join();
+                entries_[i] = std::move(entries_.back());
+                entries_.pop_back();
+            } else {
+                ++i;
+            }
+        }
+        if (is_stopping_) {
+            state->is_cancelled.store(true, std::memory_order_relaxed);
+        }
+        entries_.push_back({std::move(state), std::move(thread)});
+    }
+    void Stop() {
+        std::vector<Entry> entries;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            is_stopping_ = true;
+            entries.swap(entries_);
+        }
+        while (!entries.empty()) {
+            for (auto &entry : entries) {
+                entry.state->is_cancelled.store(true, std::memory_order_relaxed);
+            }
+            for (auto &entry : entries) {
+                entry.thread.join();
+            }
+            // Isolates that were started while these stopped.
+            std::lock_guard<std::mutex> lock(mutex_);
+            entries.clear();
+            entries.swap(entries_);
+            is_stopping_ = !entries.empty();
+        }
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<Isolate::State> state;
+        std::thread thread;
+    };
+    static bool IsFinished(Isolate::State &state) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        return state.is_finished;
+    }
+    std::mutex mutex_;
+    std::vector<Entry> entries_;
+    bool is_stopping_ = false;
+};
+
+std::shared_ptr<Object> CopyAtom(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr || IsSharedChannel(obj)) {
+        return obj;
+    }
+    if (IsNumber(obj)) {
+        return std::make_shared<Number>(AsNumber(obj)->GetValue());
+    }
+    if (IsBool(obj)) {
+        return std::make_shared<Bool>(AsBool(obj)->Get());
+    }
+    if (IsSymbol(obj)) {
+        return std::make_shared<Symbol>(AsSymbol(obj)->GetName());
+    }
+    throw RuntimeError{};
+}
+}  // namespace
+
+// Pairs are copied with a worklist, so long and deep lists do not recurse.
+std::shared_ptr<Object> CopyMessage(const std::shared_ptr<Object> &message) {
+    if (!IsCell(message)) {
+        return CopyAtom(message);
+    }
+    auto root = std::make_shared<Cell>(nullptr, nullptr);
+    std::vector<std::pair<Cell *, Cell *>> pending{{AsCell(message).get(), root.get()}};
+    while (!pending.empty()) {
+        auto [from, to] = pending.back();
+        pending.pop_back();
+        for (bool is_first : {true, false}) {
+            const auto &part = is_first ? from->GetFirst() : from->GetSecond();
+            std::shared_ptr<Object> copy;
+            if (IsCell(part)) {
+                auto cell = std::make_shared<Cell>(nullptr, nullptr);
+                pending.emplace_back(AsCell(part).get(), cell.get());
+                copy = std::move(cell);
+            } else {
+                copy = CopyAtom(part);
+            }
+            if (is_first) {
+                to->SetFirst(std::move(copy));
+            } else {
+                to->SetSecond(std::move(copy));
+            }
+        }
+    }
+    return root;
+}
+
+SharedChannel::SharedChannel(size_t capacity) : Object(18) {
+    size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+    slots_.reset(new Slot[size]);
+    for (size_t i = 0; i < size; ++i) {
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    mask_ = size - 1;
+}
+
+// A slot is free for the sender at position p when its sequence is p, and holds a value for
+// the receiver at position p when its sequence is p + 1.
+bool SharedChannel::TryPush(std::shared_ptr<Object> *value) {
+    size_t position = push_position_.load(std::memory_order_relaxed);
+    while (true) {
+        Slot &slot = slots_[position & mask_];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        auto lag = static_cast<std::ptrdiff_t>(sequence - position);
+        if (lag == 0) {
+            if (push_position_.compare_exchange_weak(position, position + 1,
+                                                     std::memory_order_relaxed)) {
+                slot.value = std::move(*value);
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (lag < 0) {
+            return false;
+        } else {
+            position = push_position_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool SharedChannel::TryPop(std::shared_ptr<Object> *value) {
+    size_t position = pop_position_.load(std::memory_order_relaxed);
+    while (true) {
+        Slot &slot = slots_[position & mask_];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        auto lag = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+        if (lag == 0) {
+            if (pop_position_.compare_exchange_weak(position, position + 1,
+                                                    std::memory_order_relaxed)) {
+                *value = std::move(slot.value);
+                slot.sequence.store(position + mask_ + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (lag < 0) {
+            return false;
+        } else {
+            position = pop_position_.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool IsSharedChannel(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 18;
+}
+
+std::shared_ptr<SharedChannel> AsSharedChannel(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<SharedChannel>(obj);
+}
+
+// The program and the arguments are copied here, on the thread that owns them; the value is
+// copied on the thread of the isolate, before its objects go away.
+Isolate::Isolate(const std::shared_ptr<Object> &program,
+                 const std::vector<std::shared_ptr<Object>> &args)
+    : Object(17), state_(std::make_shared<State>()) {
+    ListBuilder call;
+    call.Add(CopyMessage(program));
+    for (const auto &arg : args) {
+        call.Add(std::make_shared<Cell>(std::make_shared<Symbol>("quote"),
+                                        std::make_shared<Cell>(CopyMessage(arg), nullptr)));
+    }
+    std::thread thread([state = state_, call = call.Finish()] {
+        std::shared_ptr<Object> value;
+        Outcome outcome = VALUE;
+        try {
+            Compilation compilation;
+            Scheduler::Current().SetCancelFlag(&state->is_cancelled);
+            value = CopyMessage(
+                Scheduler::Current().Run(&compilation.evaluator, call, compilation.scope));
+        } catch (const SyntaxError &) {
+            outcome = SYNTAX_ERROR;
+        } catch (const NameError &) {
+            outcome = NAME_ERROR;
+        } catch (...) {
+            outcome = RUNTIME_ERROR;
+        }
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->value = std::move(value);
+            state->outcome = outcome;
+            state->is_finished = true;
+        }
+        state->finished.notify_all();
+    });
+    Registry::Get().Add(state_, std::move(thread));
+}
+
+// The green threads of the waiting thread run meanwhile. When none is ready the wait blocks,
+// and only green threads waiting for shared channels, which the isolate may fill, make it
+// look again from time to time.
+std::shared_ptr<Object> Isolate::Wait() {
+    auto &scheduler = Scheduler::Current();
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    while (!state_->is_finished) {
+        lock.unlock();
+        bool has_run = scheduler.RunRound();
+        lock.lock();
+        if (has_run || state_->is_finished) {
+            continue;
+        }
+        if (scheduler.IsPolling()) {
+            state_->finished.wait_for(lock, kPollInterval);
+        } else {
+            state_->finished.wait(lock);
+        }
+    }
+    switch (state_->outcome) {
+        case SYNTAX_ERROR:
+            throw SyntaxError{};
+        case NAME_ERROR:
+            throw NameError{};
+        case RUNTIME_ERROR:
+            throw RuntimeError{};
+        default:
+            return state_->value;
+    }
+}
+
+void StopIsolates() {
+    Registry::Get().Stop();
+}
+
+bool IsIsolate(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 17;
+}
+
+std::shared_ptr<Isolate> AsIsolate(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<Isolate>(obj);
+}
+
+std::shared_ptr<Object> MakeSharedChannel::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (args.empty()) {
+        return std::make_shared<SharedChannel>(kDefaultCapacity);
+    }
+    if (args.size() != 1 || !IsNumber(args[0]) || AsNumber(args[0])->GetValue() <= 0) {
+        throw RuntimeError{};
+    }
+    return std::make_shared<SharedChannel>(AsNumber(args[0])->GetValue());
+}
+
+std::shared_ptr<Object> StartIsolate::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (args.empty()) {
+        throw RuntimeError{};
+    }
+    return std::make_shared<Isolate>(args[0],
+                                     std::vector<std::shared_ptr<Object>>(args.begin() + 1,
+                                                                          args.end()));
+}
+
+std::shared_ptr<Object> WaitIsolate::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (args.size() != 1 || !IsIsolate(args[0])) {
+        throw RuntimeError{};
+    }
+    return AsIsolate(args[0])->Wait();
+}
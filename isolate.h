@@ -0,0 +1,102 @@
+#pragma once
+
+#include "green.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Messages between isolates are copied on the way: numbers, booleans, symbols and lists get
+// new objects that only the receiver refers to, shared channels are passed as they are, and
+// anything else, such as a procedure, cannot be sent.
+std::shared_ptr<Object> CopyMessage(const std::shared_ptr<Object> &message);
+
+// A bounded lock-free queue for any number of senders and receivers on any threads: every
+// cell of the ring has a sequence number that says whose turn it is, so a sender or receiver
+// claims a cell with one compare-and-swap of its position and hands it over with one store.
+// channel-send and channel-receive take these too and wait while the ring is full or empty.
+class SharedChannel : public Object {
+public:
+    explicit SharedChannel(size_t capacity);
+    bool TryPush(std::shared_ptr<Object> *value);
+    bool TryPop(std::shared_ptr<Object> *value);
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        std::shared_ptr<Object> value;
+    };
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    // Apart, so that senders and receivers do not fight over one cache line.
+    alignas(64) std::atomic<size_t> push_position_{0};
+    alignas(64) std::atomic<size_t> pop_position_{0};
+};
+
+bool IsSharedChannel(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<SharedChannel> AsSharedChannel(const std::shared_ptr<Object> &obj);
+
+// An interpreter of its own on an OS thread of its own, with its own global scope and its
+// own objects: nothing but shared channels is reachable from two isolates, so the object
+// model needs no locks. The program, a datum, is evaluated in the fresh global scope and the
+// procedure it gives is called with the arguments. An isolate nobody waits for goes on by
+// itself until StopIsolates.
+class Isolate : public Object {
+public:
+    Isolate(const std::shared_ptr<Object> &program,
+            const std::vector<std::shared_ptr<Object>> &args);
+    // The value of the call, or the error it ended with.
+    std::shared_ptr<Object> Wait();
+
+    enum Outcome { VALUE, SYNTAX_ERROR, NAME_ERROR, RUNTIME_ERROR };
+    struct State {
+        std::mutex mutex;
+        std::condition_variable finished;
+        bool is_finished = false;
+        std::atomic<bool> is_cancelled{false};
+        std::shared_ptr<Object> value;
+        Outcome outcome = VALUE;
+    };
+
+private:
+    std::shared_ptr<State> state_;
+};
+
+// Cancels the isolates that still run, which stop with a runtime error at their next slice or
+// wait for a shared channel, and joins all their threads. Isolates started meanwhile are
+// cancelled at once.
+void StopIsolates();
+
+// Stops the isolates when it goes, so that none outlives the scope of main it lives in.
+class IsolateGuard {
+public:
+    IsolateGuard() = default;
+    IsolateGuard(const IsolateGuard &) = delete;
+    IsolateGuard &operator=(const IsolateGuard &) = delete;
+    ~IsolateGuard() {
+        StopIsolates();
+    }
+};
+
+bool IsIsolate(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<Isolate> AsIsolate(const std::shared_ptr<Object> &obj);
+
+// (make-shared-channel) or (make-shared-channel capacity)
+class MakeSharedChannel : public Function {
+public:
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+};
+
+// (isolate program arg ...)
+class StartIsolate : public Function {
+public:
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+};
+
+// (isolate-wait isolate)
+class WaitIsolate : public Function {
+public:
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+};
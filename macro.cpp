@@ -0,0 +1,275 @@
+#include "object.h"
+#include <map>
+
+namespace {
+// What a pattern variable matched: a form, or a sequence of matches for every ellipsis the
+// variable is under.
+struct Match {
+    std::shared_ptr<Object> form;
+    std::vector<Match> items;
+    bool is_sequence = false;
+};
+
+using Bindings = std::map<std::string, Match>;
+
+bool IsEllipsis(const Macro &macro, const std::shared_ptr<Object> &obj) {
+    return IsSymbol(obj) && AsSymbol(obj)->GetName() == macro.ellipsis;
+}
+
+bool IsLiteral(const Macro &macro, const std::string &name) {
+    for (const auto &literal : macro.literals) {
+        if (literal == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t Length(std::shared_ptr<Object> list) {
+    size_t length = 0;
+    for (; IsCell(list); list = AsCell(list)->GetSecond()) {
+        ++length;
+    }
+    return length;
+}
+
+void PatternVariables(const Macro &macro, const std::shared_ptr<Object> &pattern,
+                      std::vector<std::string> *names) {
+    if (IsSymbol(pattern)) {
+        const auto &name = AsSymbol(pattern)->GetName();
+        if (name != "_" && name != macro.ellipsis && !IsLiteral(macro, name)) {
+            names->push_back(name);
+        }
+        return;
+    }
+    if (!IsCell(pattern)) {
+        return;
+    }
+    for (auto rest = pattern; rest != nullptr; rest = AsCell(rest)->GetSecond()) {
+        if (!IsCell(rest)) {
+            PatternVariables(macro, rest, names);
+            return;
+        }
+        PatternVariables(macro, AsCell(rest)->GetFirst(), names);
+    }
+}
+
+bool MatchPattern(const Macro &macro, const std::shared_ptr<Object> &pattern,
+                  std::shared_ptr<Object> form, Bindings *bindings) {
+    if (IsSymbol(pattern)) {
+        const auto &name = AsSymbol(pattern)->GetName();
+        if (IsLiteral(macro, name)) {
+            return IsSymbol(form) && AsSymbol(form)->GetName() == name;
+        }
+        if (name != "_") {
+            (*bindings)[name].form = std::move(form);
+        }
+        return true;
+    }
+    if (IsNumber(pattern)) {
+        return IsNumber(form) && AsNumber(form)->GetValue() == AsNumber(pattern)->GetValue();
+    }
+    if (IsBool(pattern)) {
+        return IsBool(form) && AsBool(form)->Get() == AsBool(pattern)->Get();
+    }
+    if (!IsCell(pattern)) {
+        return pattern == nullptr && form == nullptr;
+    }
+    auto rest = pattern;
+    while (IsCell(rest)) {
+        const auto &element = AsCell(rest)->GetFirst();
+        const auto &next = AsCell(rest)->GetSecond();
+        if (IsCell(next) && IsEllipsis(macro, AsCell(next)->GetFirst())) {
+            // element ... matches as many forms as the patterns after it leave over.
+            rest = AsCell(next)->GetSecond();
+            size_t after = Length(rest);
+            size_t available = Length(form);
+            if (available < after) {
+                return false;
+            }
+            std::vector<std::string> names;
+            PatternVariables(macro, element, &names);
+            for (const auto &name : names) {
+                (*bindings)[name].is_sequence = true;
+            }
+            for (size_t i = after; i < available; ++i) {
+                Bindings item;
+                if (!MatchPattern(macro, element, AsCell(form)->GetFirst(), &item)) {
+                    return false;
+                }
+                for (const auto &name : names) {
+                    (*bindings)[name].items.push_back(std::move(item[name]));
+                }
+                form = AsCell(form)->GetSecond();
+            }
+            continue;
+        }
+        if (!IsCell(form) || !MatchPattern(macro, element, AsCell(form)->GetFirst(), bindings)) {
+            return false;
+        }
+        rest = next;
+        form = AsCell(form)->GetSecond();
+    }
+    return MatchPattern(macro, rest, std::move(form), bindings);
+}
+
+// The sequence variables of bindings that occur in the template.
+void SequenceVariables(const std::shared_ptr<Object> &tmpl, const Bindings &bindings,
+                       std::vector<std::string> *names) {
+    if (IsSymbol(tmpl)) {
+        auto it = bindings.find(AsSymbol(tmpl)->GetName());
+        if (it != bindings.end() && it->second.is_sequence) {
+            names->push_back(it->first);
+        }
+        return;
+    }
+    if (!IsCell(tmpl)) {
+        return;
+    }
+    for (auto rest = tmpl; rest != nullptr; rest = AsCell(rest)->GetSecond()) {
+        if (!IsCell(rest)) {
+            SequenceVariables(rest, bindings, names);
+            return;
+        }
+        SequenceVariables(AsCell(rest)->GetFirst(), bindings, names);
+    }
+}
+
+// Instantiates a template. The result is fresh list structure around the matched forms, which
+// are shared with the macro use. In an escaped template, (... template), ellipses are ordinary
+// symbols.
+std::shared_ptr<Object> ExpandTemplate(const Macro &macro, const std::shared_ptr<Object> &tmpl,
+                                       const Bindings &bindings, bool is_escaped = false) {
+    if (IsSymbol(tmpl)) {
+        auto it = bindings.find(AsSymbol(tmpl)->GetName());
+        if (it == bindings.end()) {
+            return tmpl;
+        }
+        if (it->second.is_sequence) {
+            throw SyntaxError{};
+        }
+        return it->second.form;
+    }
+    if (!IsCell(tmpl)) {
+        return tmpl;
+    }
+    if (!is_escaped && IsEllipsis(macro, AsCell(tmpl)->GetFirst()) &&
+        IsCell(AsCell(tmpl)->GetSecond())) {
+        return ExpandTemplate(macro, AsCell(AsCell(tmpl)->GetSecond())->GetFirst(), bindings,
+                              true);
+    }
+    std::shared_ptr<Object> result;
+    Cell *tail = nullptr;
+    auto append = [&result, &tail](std::shared_ptr<Object> item) {
+        auto cell = std::make_shared<Cell>(std::move(item), nullptr);
+        if (tail == nullptr) {
+            result = cell;
+        } else {
+            tail->SetSecond(cell);
+        }
+        tail = cell.get();
+    };
+    auto rest = tmpl;
+    while (IsCell(rest)) {
+        const auto &element = AsCell(rest)->GetFirst();
+        const auto &next = AsCell(rest)->GetSecond();
+        if (is_escaped || !IsCell(next) || !IsEllipsis(macro, AsCell(next)->GetFirst())) {
+            append(ExpandTemplate(macro, element, bindings, is_escaped));
+            rest = next;
+            continue;
+        }
+        std::vector<std::string> names;
+        SequenceVariables(element, bindings, &names);
+        if (names.empty()) {
+            throw SyntaxError{};
+        }
+        size_t count = bindings.at(names[0]).items.size();
+        for (const auto &name : names) {
+            if (bindings.at(name).items.size() != count) {
+                throw SyntaxError{};
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            Bindings item = bindings;
+            for (const auto &name : names) {
+                item[name] = bindings.at(name).items[i];
+            }
+            append(ExpandTemplate(macro, element, item));
+        }
+        rest = AsCell(next)->GetSecond();
+    }
+    if (rest != nullptr) {
+        auto last = ExpandTemplate(macro, rest, bindings, is_escaped);
+        if (tail == nullptr) {
+            return last;
+        }
+        tail->SetSecond(std::move(last));
+    }
+    return result;
+}
+}  // namespace
+
+// (syntax-rules (literal...) (pattern template)...), or with a custom ellipsis
+// (syntax-rules ellipsis (literal...) (pattern template)...).
+std::shared_ptr<Macro> MakeMacro(const std::shared_ptr<Object> &spec) {
+    if (!IsCell(spec) || !IsSymbol(AsCell(spec)->GetFirst()) ||
+        AsSymbol(AsCell(spec)->GetFirst())->GetName() != "syntax-rules") {
+        throw SyntaxError{};
+    }
+    auto macro = std::make_shared<Macro>();
+    auto rest = AsCell(spec)->GetSecond();
+    if (IsCell(rest) && IsSymbol(AsCell(rest)->GetFirst())) {
+        macro->ellipsis = AsSymbol(AsCell(rest)->GetFirst())->GetName();
+        rest = AsCell(rest)->GetSecond();
+    }
+    if (!IsCell(rest)) {
+        throw SyntaxError{};
+    }
+    auto literals = AsCell(rest)->GetFirst();
+    for (; IsCell(literals); literals = AsCell(literals)->GetSecond()) {
+        if (!IsSymbol(AsCell(literals)->GetFirst())) {
+            throw SyntaxError{};
+        }
+        macro->literals.push_back(AsSymbol(AsCell(literals)->GetFirst())->GetName());
+    }
+    if (literals != nullptr) {
+        throw SyntaxError{};
+    }
+    for (auto rules = AsCell(rest)->GetSecond(); rules != nullptr;
+         rules = AsCell(rules)->GetSecond()) {
+        if (!IsCell(rules)) {
+            throw SyntaxError{};
+        }
+        auto rule = AsCell(rules)->GetFirst();
+        if (!IsCell(rule) || !IsCell(AsCell(rule)->GetFirst()) ||
+            !IsCell(AsCell(rule)->GetSecond()) ||
+            AsCell(AsCell(rule)->GetSecond())->GetSecond() != nullptr) {
+            throw SyntaxError{};
+        }
+        macro->rules.emplace_back(AsCell(rule)->GetFirst(),
+                                  AsCell(AsCell(rule)->GetSecond())->GetFirst());
+    }
+    return macro;
+}
+
+// The keyword position of the pattern is not matched, so the macro can be bound to any name.
+std::shared_ptr<Object> Macro::Expand(Cell *form) const {
+    for (const auto &rule : rules) {
+        Bindings bindings;
+        if (MatchPattern(*this, AsCell(rule.first)->GetSecond(), form->GetSecond(), &bindings)) {
+            return ExpandTemplate(*this, rule.second, bindings);
+        }
+    }
+    throw SyntaxError{};
+}
+
+bool IsMacro(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 11;
+}
+
+std::shared_ptr<Macro> AsMacro(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<Macro>(obj);
+}
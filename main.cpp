@@ -1,14 +1,95 @@
 #include "scheme.h"
+#include "io.h"
+#include "isolate.h"
+#include "pool.h"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cstdlib>
 
-int main() {
+// scheme-repl [-q] [-j threads] [--image file] script.scm [more.scm...]: evaluates every form of
+// every script and writes the results through one large buffer; -q drops the results of the
+// scripts that follow it and keeps only their side effects, -j sets how many threads pmap and
+// its kin use, and --image defines the variables of a heap image made by save-image before the
+// scripts that follow it.
+int RunScripts(int argc, char **argv) {
+    // An option without its value is a mistake, not the name of a script; nothing runs then.
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-j" || arg == "--threads" || arg == "--image") {
+            if (++i == argc) {
+                std::cerr << "usage: scheme-repl [-q] [-j threads] [--image file] script.scm "
+                             "[more.scm...]\n";
+                return 1;
+            }
+        }
+    }
+    std::ios::sync_with_stdio(false);
+    bool quiet = false;
+    OutputBuffer buffer(1);
+    std::ostream out(&buffer);
+    Compilation proc;
+    for (int i = 1; i < argc; ++i) {
+        std::string path = argv[i];
+        if (path == "-q" || path == "--quiet") {
+            quiet = true;
+            continue;
+        }
+        if (path == "-j" || path == "--threads") {
+            WorkStealingPool::SetThreadCount(std::max(1, std::atoi(argv[++i])));
+            continue;
+        }
+        if (path == "--image") {
+            std::string image = argv[++i];
+            try {
+                LoadImage(image, proc.scope);
+            } catch (const RuntimeError &) {
+                buffer.Flush();
+                std::cerr << image << ": cannot load image\n";
+                return 1;
+            }
+            continue;
+        }
+        MappedFile file(path);
+        if (!file.IsOpen()) {
+            buffer.Flush();
+            std::cerr << path << ": cannot open file\n";
+            return 1;
+        }
+        std::istream in(&file);
+        try {
+            proc.Build(&in, quiet ? nullptr : &out);
+        } catch (const SyntaxError &) {
+            buffer.Flush();
+            std::cerr << path << ": syntax error\n";
+            return 1;
+        } catch (const RuntimeError &) {
+            buffer.Flush();
+            std::cerr << path << ": runtime error\n";
+            return 1;
+        } catch (const NameError &) {
+            buffer.Flush();
+            std::cerr << path << ": name error\n";
+            return 1;
+        } catch (...) {
+            // Anything else, such as running out of memory, still ends the batch cleanly.
+            buffer.Flush();
+            std::cerr << path << ": runtime error\n";
+            return 1;
+        }
+    }
+    buffer.Flush();
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    IsolateGuard isolates;
+    if (argc > 1) {
+        return RunScripts(argc, argv);
+    }
 
-//    std::freopen("input.txt","r", stdin);
     Compilation proc;
     std::string line;
-//    std::ifstream in1;
-//    in1.open("input.txt");
     std::string type;
     getline(std::cin, type);
     if (type == "monocode") {
@@ -16,49 +97,10 @@ int main() {
             std::cout << proc.Build(line) << "\n";
         }
     } else if (type == "splitcode") {
-        int balance = 0;
-        std::string all_line;
-        while (getline(std::cin, line)) {
-            bool is_quotes = true;
-            for (char x: line) {
-                if(x != '\'') {
-                    is_quotes = false;
-                }
-                if (x == '(') {
-                    balance++;
-                } else if (x == ')') {
-                    balance--;
-                }
-                all_line += x;
-            }
-            if (balance == 0 && !is_quotes) {
-                std::cout << proc.Build(all_line) << "\n";
-                all_line  = "";
-            }
-        }
+        proc.Build(&std::cin, &std::cout);
     } else if (type == "file") {
-        std::freopen("input.txt","r", stdin);
-        int balance = 0;
-        std::string all_line;
-        while (getline(std::cin, line)) {
-            bool is_quotes = true;
-            for (char x: line) {
-                if(x != '\'') {
-                    is_quotes = false;
-                }
-                if (x == '(') {
-                    balance++;
-                } else if (x == ')') {
-                    balance--;
-                }
-                all_line += x;
-            }
-            if (balance == 0 && !is_quotes) {
-                std::cout << proc.Build(all_line) << "\n";
-                all_line  = "";
-            }
-        }
+        std::ifstream in("input.txt");
+        proc.Build(&in, &std::cout);
     }
     return 0;
 }
-
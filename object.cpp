@@ -1,4 +1,8 @@
 #include "object.h"
+#include "evaluator.h"
+#include "green.h"
+#include "isolate.h"
+#include <unordered_map>
 
 bool IsNumber(const std::shared_ptr<Object> &obj) {
     if (obj == nullptr) {
@@ -7,8 +11,7 @@ bool IsNumber(const std::shared_ptr<Object> &obj) {
     return obj->type_ == 0;
 }
 std::shared_ptr<Number> AsNumber(const std::shared_ptr<Object> &obj) {
-    Number *number = dynamic_cast<Number *>(obj.get());
-    return std::make_shared<Number>(*number);
+    return std::static_pointer_cast<Number>(obj);
 }
 
 bool IsCell(const std::shared_ptr<Object> &obj) {
@@ -18,8 +21,7 @@ bool IsCell(const std::shared_ptr<Object> &obj) {
     return obj->type_ == 2;
 }
 std::shared_ptr<Cell> AsCell(const std::shared_ptr<Object> &obj) {
-    Cell *cell = dynamic_cast<Cell *>(obj.get());
-    return std::make_shared<Cell>(*cell);
+    return std::static_pointer_cast<Cell>(obj);
 }
 
 bool IsSymbol(const std::shared_ptr<Object> &obj) {
@@ -30,50 +32,109 @@ bool IsSymbol(const std::shared_ptr<Object> &obj) {
 }
 
 std::shared_ptr<Symbol> AsSymbol(const std::shared_ptr<Object> &obj) {
-    Symbol *symbol = dynamic_cast<Symbol *>(obj.get());
-    return std::make_shared<Symbol>(*symbol);
+    return std::static_pointer_cast<Symbol>(obj);
 }
 
+namespace {
+// A list or a quote form whose reading has started but not finished yet.
+struct PendingDatum {
+    bool is_quote;
+    // The head symbol of a quote form, or the first cell of a list.
+    std::shared_ptr<Object> head;
+    Cell *tail;
+    bool after_dot;
+    bool has_tail;
+};
+}  // namespace
+
+// Reads a datum with an explicit stack of unfinished lists, appending every element to the
+// tail of its list, so neither long nor deeply nested data recurses.
 std::shared_ptr<Object> ReadVertex(Tokenizer *tokenizer) {
-    if (tokenizer->GetToken() == Token{BracketToken::OPEN}) {
+    std::vector<PendingDatum> pending;
+    while (true) {
+        if (tokenizer->IsEnd()) {
+            throw SyntaxError{};
+        }
+        Token token = tokenizer->GetToken();
         tokenizer->Next();
-        auto result = ReadList(tokenizer);
-        if (result != nullptr) {
-            if (!IsCell(result)) {
+        std::shared_ptr<Object> value;
+        bool is_complete = false;
+        if (!pending.empty() && !pending.back().is_quote) {
+            auto &list = pending.back();
+            if (token == Token{BracketToken::CLOSE}) {
+                if (list.after_dot && !list.has_tail) {
+                    throw SyntaxError{};
+                }
+                value = list.head;
+                if (value != nullptr && AsCell(value)->GetFirst() == nullptr) {
+                    throw SyntaxError{};
+                }
+                pending.pop_back();
+                is_complete = true;
+            } else if (list.has_tail) {
                 throw SyntaxError{};
+            } else if (token == Token{DotToken{}}) {
+                if (list.head == nullptr || list.after_dot) {
+                    throw SyntaxError{};
+                }
+                list.after_dot = true;
+                continue;
+            }
+        }
+        if (!is_complete) {
+            if (token == Token{BracketToken::OPEN}) {
+                pending.push_back({false, nullptr, nullptr, false, false});
+                continue;
+            }
+            if (auto quote_token_ref = std::get_if<QuoteToken>(&token)) {
+                pending.push_back({true, std::make_shared<Symbol>(quote_token_ref->name),
+                                   nullptr, false, false});
+                continue;
             }
-            auto cell = AsCell(result);
-            if (cell->GetFirst() == nullptr) {
+            if (auto symbol_token_ref = std::get_if<SymbolToken>(&token)) {
+                value = std::make_shared<Symbol>(symbol_token_ref->name);
+            } else if (auto constant_token_ref = std::get_if<ConstantToken>(&token)) {
+                value = std::make_shared<Number>(constant_token_ref->value);
+            } else {
                 throw SyntaxError{};
             }
         }
-        return result;
-    }
-    if (tokenizer->GetToken() == Token{QuoteToken{}}) {
-        tokenizer->Next();
-        Cell result(std::make_shared<Symbol>(Symbol("quote")),
-                    std::make_shared<Cell>(ReadVertex(tokenizer), nullptr));
-        return std::make_shared<Cell>(result);
-    }
-    Token token = tokenizer->GetToken();
-    tokenizer->Next();
-    if (auto symbol_token_ref = std::get_if<SymbolToken>(&token)) {
-        return std::make_shared<Symbol>(symbol_token_ref->name);
+        while (!pending.empty() && pending.back().is_quote) {
+            value = std::make_shared<Cell>(std::move(pending.back().head),
+                                           std::make_shared<Cell>(value, nullptr));
+            pending.pop_back();
+        }
+        if (pending.empty()) {
+            return value;
+        }
+        auto &list = pending.back();
+        if (list.after_dot) {
+            list.tail->SetSecond(value);
+            list.has_tail = true;
+        } else {
+            auto cell = std::make_shared<Cell>(value, nullptr);
+            if (list.head == nullptr) {
+                list.head = cell;
+            } else {
+                list.tail->SetSecond(cell);
+            }
+            list.tail = cell.get();
+        }
     }
-    if (auto constant_token_ref = std::get_if<ConstantToken>(&token)) {
-        return std::make_shared<Number>(constant_token_ref->value);
+}
+
+std::shared_ptr<Object> ReadNext(Tokenizer *tokenizer) {
+    if (tokenizer->GetToken() == Token{BracketToken::CLOSE}) {
+        throw SyntaxError{};
     }
-    return nullptr;
+    return ReadVertex(tokenizer);
 }
 
 std::shared_ptr<Object> Read(Tokenizer *tokenizer) {
     if (tokenizer->IsEnd()) {
         return nullptr;
     }
-    if (tokenizer->GetToken() == Token{BracketToken::CLOSE}) {
-        throw SyntaxError{};
-    }
-    auto ret = ReadVertex(tokenizer);
+    auto ret = ReadNext(tokenizer);
     if (!tokenizer->IsEnd()) {
         throw SyntaxError{};
     }
@@ -83,28 +144,6 @@ std::shared_ptr<Object> Read(Tokenizer *tokenizer) {
     return ret;
 }
 
-std::shared_ptr<Object> ReadList(Tokenizer *tokenizer) {
-    if (tokenizer->IsEnd()) {
-        throw SyntaxError{};
-    }
-    if (tokenizer->GetToken() == Token{BracketToken::CLOSE}) {
-        tokenizer->Next();
-        return nullptr;
-    }
-    if (tokenizer->GetToken() == Token{DotToken{}}) {
-        tokenizer->Next();
-        auto second = ReadVertex(tokenizer);
-        if (tokenizer->IsEnd() || !(tokenizer->GetToken() == Token{BracketToken::CLOSE})) {
-            throw SyntaxError{};
-        }
-        tokenizer->Next();
-        return second;
-    }
-    auto left = ReadVertex(tokenizer);
-    auto right = ReadList(tokenizer);
-    return std::make_shared<Cell>(left, right);
-}
-
 bool IsBool(const std::shared_ptr<Object> &obj) {
     if (obj == nullptr) {
         return false;
@@ -113,156 +152,265 @@ bool IsBool(const std::shared_ptr<Object> &obj) {
 }
 
 std::shared_ptr<Bool> AsBool(const std::shared_ptr<Object> &obj) {
-    Bool *det = dynamic_cast<Bool *>(obj.get());
-    return std::make_shared<Bool>(*det);
+    return std::static_pointer_cast<Bool>(obj);
+}
+
+// Compares with a worklist of pairs, so long and deeply nested lists take constant C++ stack.
+bool IsEqual(const std::shared_ptr<Object> &lhs, const std::shared_ptr<Object> &rhs) {
+    std::vector<std::pair<Object *, Object *>> pending{{lhs.get(), rhs.get()}};
+    while (!pending.empty()) {
+        auto [left, right] = pending.back();
+        pending.pop_back();
+        if (left == right) {
+            continue;
+        }
+        if (left == nullptr || right == nullptr || left->type_ != right->type_) {
+            return false;
+        }
+        if (left->type_ == 0) {
+            auto value = static_cast<Number *>(left)->GetValue();
+            if (value != static_cast<Number *>(right)->GetValue()) {
+                return false;
+            }
+        } else if (left->type_ == 1) {
+            const auto &name = static_cast<Symbol *>(left)->GetName();
+            if (name != static_cast<Symbol *>(right)->GetName()) {
+                return false;
+            }
+        } else if (left->type_ == 3) {
+            if (static_cast<Bool *>(left)->Get() != static_cast<Bool *>(right)->Get()) {
+                return false;
+            }
+        } else if (left->type_ == 2) {
+            auto left_cell = static_cast<Cell *>(left);
+            auto right_cell = static_cast<Cell *>(right);
+            pending.emplace_back(left_cell->GetSecond().get(), right_cell->GetSecond().get());
+            pending.emplace_back(left_cell->GetFirst().get(), right_cell->GetFirst().get());
+        } else {
+            // Procedures and other objects are only equal to themselves.
+            return false;
+        }
+    }
+    return true;
 }
 
 bool IsFunction(const std::shared_ptr<Object> &obj) {
     if (obj == nullptr) {
         return false;
     }
-    return obj->type_ == 4 || obj->type_ == 5;
+    return (obj->type_ >= 4 && obj->type_ <= 7) || obj->type_ == 16;
 }
-bool IsConsistFunction(const std::shared_ptr<Object> &obj) {
+
+bool IsCallCC(const std::shared_ptr<Object> &obj) {
     if (obj == nullptr) {
         return false;
     }
-    return obj->type_ == 5;
-}
-
-std::shared_ptr<Function> AsFunction(const std::shared_ptr<Object> &obj) {
-    Function *func = dynamic_cast<Function *>(obj.get());
-    return std::make_shared<Function>(*func);
+    return obj->type_ == 7;
 }
 
-std::shared_ptr<Object> Cell::Eval(Scope *scope, std::vector<Scope *> &scopes) {
-    auto func = first_->Eval(scope, scopes);
-    if (!IsFunction(func)) {
+std::shared_ptr<Object> CallCC::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (args.size() != 1) {
         throw RuntimeError{};
     }
-    if (!IsConsistFunction(func)) {
-        std::vector<std::shared_ptr<Object>> args;
-        auto next = second_;
-        while (next != nullptr && IsCell(next)) {
-            auto cell = AsCell(next);
-            auto arg = cell->first_->Eval(scope, scopes);
-            args.push_back(arg);
-            next = cell->second_;
-        }
-        return func->Apply(args);
-    } else {
-        return func->Apply(second_, scope, scopes);
+    Evaluator evaluator;
+    return evaluator.RunCallCC(args[0]);
+}
+bool IsRefFunction(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
     }
+    return obj->type_ == 5;
 }
 
-std::shared_ptr<Object> Symbol::Eval(Scope *scope, std::vector<Scope *> &) {
-    if (name_ == "#t") {
-        return std::make_shared<Bool>(true);
-    }
-    if (name_ == "#f") {
-        return std::make_shared<Bool>(false);
-    }
-    if (name_ == "quote") {
-        return std::make_shared<Quote>();
-    }
-    if (name_ == "list") {
-        return std::make_shared<List>();
-    }
-    if (name_ == "list-ref") {
-        return std::make_shared<ListRef>();
-    }
-    if (name_ == "list-tail") {
-        return std::make_shared<ListTail>();
-    }
-    if (name_ == "number?") {
-        return std::make_shared<IsNumberFunction>();
-    }
-    if (name_ == "boolean?") {
-        return std::make_shared<IsBoolFunction>();
-    }
-    if (name_ == "symbol?") {
-        return std::make_shared<IsSymbolFunction>();
-    }
-    if (name_ == "pair?") {
-        return std::make_shared<IsPairFunction>();
-    }
-    if (name_ == "list?") {
-        return std::make_shared<IsListFunction>();
-    }
-    if (name_ == "null?") {
-        return std::make_shared<IsNullFunction>();
-    }
-    if (name_ == "not") {
-        return std::make_shared<Not>();
-    }
-    if (name_ == "and") {
-        return std::make_shared<And>();
-    }
-    if (name_ == "or") {
-        return std::make_shared<Or>();
-    }
-    if (name_ == "+") {
-        return std::make_shared<Sum>();
-    }
-    if (name_ == "-") {
-        return std::make_shared<Minus>();
-    }
-    if (name_ == "*") {
-        return std::make_shared<Prod>();
-    }
-    if (name_ == "/") {
-        return std::make_shared<Div>();
-    }
-    if (name_ == "min") {
-        return std::make_shared<Min>();
-    }
-    if (name_ == "max") {
-        return std::make_shared<Max>();
-    }
-    if (name_ == "abs") {
-        return std::make_shared<Abs>();
-    }
-    if (name_ == "<") {
-        return std::make_shared<Less>();
-    }
-    if (name_ == ">") {
-        return std::make_shared<More>();
-    }
-    if (name_ == "<=") {
-        return std::make_shared<LessEq>();
+std::shared_ptr<RefFunction> AsRefFunction(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<RefFunction>(obj);
+}
+
+RefFunction::RefFunction(std::shared_ptr<Lambda> lambda, const std::shared_ptr<Scope> &scope)
+    : Object(5), lambda(std::move(lambda)) {
+    auto shape = this->lambda->Shape(*scope);
+    layout = shape->layout;
+    captured.reserve(shape->captures.size());
+    for (const auto &source : shape->captures) {
+        Scope *frame = scope.get();
+        for (size_t i = 0; i < source.depth; ++i) {
+            frame = frame->father.get();
+        }
+        captured.push_back(frame->Capture(source.index));
     }
-    if (name_ == ">=") {
-        return std::make_shared<MoreEq>();
+    // Frames chain straight to a global scope, and a global scope may chain to a prelude, so
+    // the global scope of the procedure is the first scope without a layout.
+    Scope *root = scope.get();
+    while (root->layout != nullptr) {
+        root = root->father.get();
     }
-    if (name_ == "=") {
-        return std::make_shared<Equal>();
+    global = root->shared_from_this();
+}
+
+void BindParameters(Scope *frame, const std::shared_ptr<Object> *args, size_t count) {
+    size_t param_count = frame->layout->param_count;
+    bool has_rest = frame->layout->has_rest;
+    if (count < param_count || (!has_rest && count != param_count)) {
+        throw RuntimeError{};
     }
-    if (name_ == "cons") {
-        return std::make_shared<Cons>();
+    for (size_t i = 0; i < param_count; ++i) {
+        frame->slots[i].value = args[i];
+        frame->slots[i].is_bound = true;
     }
-    if (name_ == "car") {
-        return std::make_shared<Car>();
+    if (has_rest) {
+        std::shared_ptr<Object> rest;
+        for (size_t i = count; i > param_count; --i) {
+            rest = std::make_shared<Cell>(args[i - 1], rest);
+        }
+        frame->slots[param_count].value = std::move(rest);
+        frame->slots[param_count].is_bound = true;
     }
-    if (name_ == "cdr") {
-        return std::make_shared<Cdr>();
+}
+
+std::shared_ptr<Scope> BindArguments(std::shared_ptr<const Layout> layout,
+                                     std::shared_ptr<Scope> father,
+                                     const std::shared_ptr<Object> *args, size_t count) {
+    auto frame = std::make_shared<Scope>(std::move(layout), std::move(father));
+    BindParameters(frame.get(), args, count);
+    return frame;
+}
+
+std::shared_ptr<Scope> RefFunction::MakeFrame(const std::shared_ptr<Object> *args, size_t count) {
+    auto frame = BindArguments(layout, ResolveGlobal(global), args, count);
+    for (size_t i = 0; i < captured.size(); ++i) {
+        frame->slots[layout->capture_start + i].box = captured[i];
     }
-    if (name_ == "set-car!") {
-        return std::make_shared<SetCar>();
+    return frame;
+}
+
+std::shared_ptr<Object> RefFunction::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    Evaluator evaluator;
+    return evaluator.RunBody(GetBody(), MakeFrame(args.data(), args.size()));
+}
+
+// Cells that die together with this one are unlinked before they are released: the cdr chain
+// is walked in a loop and cars that are lists wait on a worklist, so dropping a long or deeply
+// nested structure takes constant C++ stack. Shared cells are left to their other owners.
+Cell::~Cell() {
+    std::vector<std::shared_ptr<Object>> nested;
+    std::shared_ptr<Object> rest;
+    auto unlink = [&nested, &rest](Cell *cell) {
+        if (IsCell(cell->first_) && cell->first_.use_count() == 1) {
+            nested.push_back(std::move(cell->first_));
+        }
+        if (IsCell(cell->second_) && cell->second_.use_count() == 1) {
+            rest = std::move(cell->second_);
+        }
+    };
+    unlink(this);
+    while (true) {
+        while (rest != nullptr) {
+            auto cell = std::move(rest);
+            unlink(static_cast<Cell *>(cell.get()));
+        }
+        if (nested.empty()) {
+            return;
+        }
+        rest = std::move(nested.back());
+        nested.pop_back();
     }
-    if (name_ == "set-cdr!") {
-        return std::make_shared<SetCdr>();
+}
+
+namespace {
+// One object per builtin procedure: they have no state, so every scope and thread shares them.
+const std::unordered_map<std::string, std::shared_ptr<Object>> &Builtins() {
+    static const std::unordered_map<std::string, std::shared_ptr<Object>> builtins{
+        {"list", std::make_shared<List>()},
+        {"list-ref", std::make_shared<ListRef>()},
+        {"list-tail", std::make_shared<ListTail>()},
+        {"number?", std::make_shared<IsNumberFunction>()},
+        {"boolean?", std::make_shared<IsBoolFunction>()},
+        {"symbol?", std::make_shared<IsSymbolFunction>()},
+        {"pair?", std::make_shared<IsPairFunction>()},
+        {"list?", std::make_shared<IsListFunction>()},
+        {"null?", std::make_shared<IsNullFunction>()},
+        {"not", std::make_shared<Not>()},
+        {"+", std::make_shared<Sum>()},
+        {"-", std::make_shared<Minus>()},
+        {"*", std::make_shared<Prod>()},
+        {"/", std::make_shared<Div>()},
+        {"min", std::make_shared<Min>()},
+        {"max", std::make_shared<Max>()},
+        {"abs", std::make_shared<Abs>()},
+        {"<", std::make_shared<Less>()},
+        {">", std::make_shared<More>()},
+        {"<=", std::make_shared<LessEq>()},
+        {">=", std::make_shared<MoreEq>()},
+        {"=", std::make_shared<Equal>()},
+        {"call/cc", std::make_shared<CallCC>()},
+        {"call-with-current-continuation", std::make_shared<CallCC>()},
+        {"cons", std::make_shared<Cons>()},
+        {"car", std::make_shared<Car>()},
+        {"cdr", std::make_shared<Cdr>()},
+        {"length", std::make_shared<Length>()},
+        {"append", std::make_shared<Append>()},
+        {"reverse", std::make_shared<Reverse>()},
+        {"map", std::make_shared<Map>()},
+        {"for-each", std::make_shared<ForEach>()},
+        {"filter", std::make_shared<Filter>()},
+        {"fold", std::make_shared<Fold>()},
+        {"member", std::make_shared<Member>()},
+        {"assoc", std::make_shared<Assoc>()},
+        {"equal?", std::make_shared<IsEqualFunction>()},
+        {"sort", std::make_shared<Sort>(false, false)},
+        {"sort!", std::make_shared<Sort>(true, false)},
+        {"list-sort", std::make_shared<Sort>(false, true)},
+        {"pmap", std::make_shared<ParallelMap>(ParallelMap::Kind::MAP)},
+        {"pfor-each", std::make_shared<ParallelMap>(ParallelMap::Kind::FOR_EACH)},
+        {"preduce", std::make_shared<ParallelMap>(ParallelMap::Kind::REDUCE)},
+        {"touch", std::make_shared<Touch>()},
+        {"spawn", std::make_shared<Spawn>()},
+        {"yield", std::make_shared<Yield>()},
+        {"make-channel", std::make_shared<MakeChannel>()},
+        {"channel-send", std::make_shared<ChannelOperation>(true)},
+        {"channel-receive", std::make_shared<ChannelOperation>(false)},
+        {"make-shared-channel", std::make_shared<MakeSharedChannel>()},
+        {"isolate", std::make_shared<StartIsolate>()},
+        {"isolate-wait", std::make_shared<WaitIsolate>()},
+    };
+    return builtins;
+}
+}  // namespace
+
+std::shared_ptr<Object> Builtin(const std::string &name) {
+    auto it = Builtins().find(name);
+    return it == Builtins().end() ? nullptr : it->second;
+}
+
+const std::string *BuiltinName(const Object *obj) {
+    for (const auto &[name, builtin] : Builtins()) {
+        if (builtin.get() == obj) {
+            return &name;
+        }
     }
-    if (name_ == "define") {
-        return std::make_shared<Define>();
+    return nullptr;
+}
+
+void InstallBuiltins(Scope *scope) {
+    for (const auto &[name, builtin] : Builtins()) {
+        scope->Init(name, builtin);
     }
-    if (name_ == "set!") {
-        return std::make_shared<Set>();
+}
+
+std::shared_ptr<Object> Symbol::Eval(Scope *scope) {
+    if (name_ == "#t") {
+        return std::make_shared<Bool>(true);
     }
-    if (name_ == "if") {
-        return std::make_shared<If>();
+    if (name_ == "#f") {
+        return std::make_shared<Bool>(false);
     }
-    if (name_ == "lambda") {
-        return std::make_shared<Lambda>();
+    size_t old_hint = slot_hint_.load(std::memory_order_relaxed);
+    size_t hint = old_hint;
+    auto value = scope->Get(name_, &hint);
+    // Stored only when it moves, so that threads that run the same code keep the cache line
+    // of the symbol shared instead of writing it on every lookup.
+    if (hint != old_hint) {
+        slot_hint_.store(hint, std::memory_order_relaxed);
     }
-    return scope->Get(name_);
+    return value;
 }
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <exception>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include "tokenizer.h"
 #include "scope.h"
@@ -16,13 +19,6 @@ public:
     virtual std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &) {
         return nullptr;
     }
-    virtual std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &, Scope *,
-                                          std::vector<Scope *> &) {
-        return nullptr;
-    }
-    virtual std::shared_ptr<Object> Eval(Scope *, std::vector<Scope *> &) {
-        return nullptr;
-    }
 };
 
 class Number : public Object {
@@ -32,9 +28,6 @@ public:
     int GetValue() {
         return value_;
     }
-    virtual std::shared_ptr<Object> Eval(Scope *, std::vector<Scope *> &) final {
-        return std::make_shared<Number>(value_);
-    }
 
 private:
     int value_;
@@ -44,13 +37,18 @@ class Symbol : public Object {
 public:
     explicit Symbol(std::string name) : Object(1), name_(name) {
     }
-    std::string GetName() {
+    const std::string &GetName() {
         return name_;
     }
-    virtual std::shared_ptr<Object> Eval(Scope *, std::vector<Scope *> &);
+    // Looks the symbol up in the scope chain. The builtins are bound in the global scope, so a
+    // definition of the same name replaces them.
+    std::shared_ptr<Object> Eval(Scope *scope);
 
 private:
     std::string name_;
+    // The frame slot this occurrence of the symbol was found in last time. Threads that run
+    // the same code may race on it, and any value they leave is a valid hint.
+    std::atomic<size_t> slot_hint_{0};
 };
 
 class Cell : public Object {
@@ -58,13 +56,20 @@ public:
     explicit Cell(std::shared_ptr<Object> first, std::shared_ptr<Object> second)
         : Object(2), first_(first), second_(second) {
     }
-    std::shared_ptr<Object> GetFirst() {
+    Cell(const Cell &) = default;
+    ~Cell();
+    const std::shared_ptr<Object> &GetFirst() {
         return first_;
     }
-    std::shared_ptr<Object> GetSecond() {
+    const std::shared_ptr<Object> &GetSecond() {
         return second_;
     }
-    virtual std::shared_ptr<Object> Eval(Scope *scope, std::vector<Scope *> &);
+    void SetFirst(std::shared_ptr<Object> first) {
+        first_ = std::move(first);
+    }
+    void SetSecond(std::shared_ptr<Object> second) {
+        second_ = std::move(second);
+    }
 
 private:
     std::shared_ptr<Object> first_;
@@ -78,9 +83,6 @@ public:
     bool Get() {
         return det_;
     }
-    virtual std::shared_ptr<Object> Eval(Scope *, std::vector<Scope *> &) final {
-        return std::make_shared<Bool>(det_);
-    }
 
 private:
     bool det_;
@@ -98,99 +100,271 @@ bool IsSymbol(const std::shared_ptr<Object> &obj);
 
 std::shared_ptr<Symbol> AsSymbol(const std::shared_ptr<Object> &obj);
 
-std::shared_ptr<Object> ReadList(Tokenizer *tokenizer);
-
 std::shared_ptr<Object> Read(Tokenizer *tokenizer);
 
+// Reads one top-level datum and leaves the tokenizer on the token after it.
+std::shared_ptr<Object> ReadNext(Tokenizer *tokenizer);
+
 std::shared_ptr<Object> ReadVertex(Tokenizer *tokenizer);
 
 bool IsBool(const std::shared_ptr<Object> &obj);
 
 std::shared_ptr<Bool> AsBool(const std::shared_ptr<Object> &obj);
 
+// Where a closure takes a captured variable from: a slot of the frame depth fathers up from
+// the scope the closure is made in.
+struct CaptureSource {
+    size_t depth;
+    size_t index;
+};
+
+// A lambda form after free variable analysis. It takes the place of the lambda symbol of the
+// form (or of the define symbol of (define (name . params) body...)) the first time the form is
+// evaluated, so the analysis is done once per form and not once per closure.
+class Lambda : public Object {
+public:
+    Lambda(std::string name, std::shared_ptr<Object> params, std::shared_ptr<Object> body);
+    struct ClosureShape {
+        // The layouts of the frames of the scope the shape was computed for.
+        std::vector<std::shared_ptr<const Layout>> enclosing;
+        std::shared_ptr<const Layout> layout;
+        std::vector<CaptureSource> captures;
+    };
+    // The layout of the frames of closures made in scope and the slots they capture.
+    std::shared_ptr<const ClosureShape> Shape(const Scope &scope);
+    // The frame of a call of a lambda form in operator position, ((lambda params body...)
+    // args...). Such a procedure never escapes, so there is no closure to make: the frame
+    // chains to the scope of the call and nothing is captured.
+    std::shared_ptr<Scope> MakeFrame(const std::shared_ptr<Scope> &scope,
+                                     const std::shared_ptr<Object> *args, size_t count);
+    // Empty unless the form is a definition.
+    std::string name;
+    std::shared_ptr<Object> params;
+    std::shared_ptr<Object> body;
+    // The parameters and the internal definitions.
+    std::shared_ptr<const Layout> own;
+    // The variables the body refers to but does not bind.
+    std::vector<std::string> free;
+
+private:
+    // Guards shape_ while code runs on several threads.
+    std::mutex shape_mutex_;
+    std::shared_ptr<const ClosureShape> shape_;
+};
+
+bool IsLambda(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<Lambda> AsLambda(const std::shared_ptr<Object> &obj);
+
+// A procedure made by lambda. It is a flat closure: instead of the whole scope chain it was
+// made in, it keeps the boxes of the variables of the enclosing frame its body refers to, and
+// every call binds the parameters in a fresh frame next to them.
 class RefFunction : public Object {
 public:
-    RefFunction(std::shared_ptr<Object> description, Scope *father, std::vector<Scope *> &scopes)
-        : Object(5), description(description) {
-        scope = new Scope(father);
-        scopes.push_back(scope);
+    RefFunction(std::shared_ptr<Lambda> lambda, const std::shared_ptr<Scope> &scope);
+    // An empty procedure, for a heap image to fill in.
+    RefFunction() : Object(5) {
+    }
+    std::shared_ptr<Scope> MakeFrame(const std::shared_ptr<Object> *args, size_t count);
+    const std::shared_ptr<Object> &GetBody() {
+        return lambda->body;
+    }
+    // Calls the procedure from C++ code with already evaluated arguments.
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+    std::shared_ptr<Lambda> lambda;
+    std::shared_ptr<const Layout> layout;
+    std::vector<std::shared_ptr<Box>> captured;
+    std::shared_ptr<Scope> global;
+};
+
+// A do loop, or a named let whose name is only called in tail position of its body. The loop
+// runs in one frame that is rebound in place on every iteration, instead of calling a
+// procedure once per iteration.
+class Loop : public Object {
+public:
+    Loop(std::shared_ptr<Lambda> lambda, std::shared_ptr<Object> inits)
+        : Object(9), lambda(std::move(lambda)), inits(std::move(inits)) {
+    }
+    // The variables and the body, which for a do are its commands.
+    std::shared_ptr<Lambda> lambda;
+    std::shared_ptr<Object> inits;
+    bool is_do = false;
+    std::shared_ptr<Object> test;
+    std::shared_ptr<Object> result;
+    // The slots the steps of a do rebind, with their expressions.
+    std::vector<std::pair<size_t, std::shared_ptr<Object>>> steps;
+};
+
+bool IsLoop(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<Loop> AsLoop(const std::shared_ptr<Object> &obj);
+
+// A tail call of a named let loop, in place of the name at the head of the call. The loop
+// owns the code the call is in, so a plain pointer back is enough.
+class Recur : public Object {
+public:
+    explicit Recur(Loop *loop) : Object(10), loop(loop) {
     }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *,
-                                  std::vector<Scope *> &scopes) final {
-        if (!IsCell(description)) {
-            throw SyntaxError{};
-        }
-        auto cell = AsCell(description);
-        auto variables = cell->GetFirst();
-        auto next = cell->GetSecond();
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        cell = AsCell(next);
-        auto condition = cell->GetFirst();
-        auto cur_var = variables;
-        auto cur_value = args;
-        while (IsCell(cur_var)) {
-            auto cell_var = AsCell(cur_var);
-            auto var = cell_var->GetFirst();
-            cur_var = cell_var->GetSecond();
-            auto cell_val = AsCell(cur_value);
-            auto value = cell_val->GetFirst()->Eval(scope, scopes);
-            cur_value = cell_val->GetSecond();
-            if (!IsSymbol(var)) {
-                throw RuntimeError{};
-            }
-            scope->Init(AsSymbol(var)->GetName(), value);
-        }
-        auto result = condition->Eval(scope, scopes);
-        auto cur = cell->GetSecond();
-        while (IsCell(cur)) {
-            cell = AsCell(cur);
-            condition = cell->GetFirst();
-            result = condition->Eval(scope, scopes);
-            cur = cell->GetSecond();
-        }
-        return result;
+    Loop *loop;
+};
+
+bool IsRecur(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<Recur> AsRecur(const std::shared_ptr<Object> &obj);
+
+// Stands in for cons in (cons x (f ...)) in tail position of the procedure f. The evaluator
+// makes the pair before the call and lets the call fill in its cdr, so building a list by
+// recursion of this kind takes constant stack. It remembers the symbol it displaced, to make
+// an ordinary call when cons has been redefined.
+class TailCons : public Object {
+public:
+    explicit TailCons(std::shared_ptr<Object> name) : Object(13), name(std::move(name)) {
     }
-    std::shared_ptr<Object> description;
-    Scope *scope;
+    std::shared_ptr<Object> name;
 };
 
-class Function : public Object {
+bool IsTailCons(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<TailCons> AsTailCons(const std::shared_ptr<Object> &obj);
+
+// Marks the (cons x (name ...)) forms in tail position of body.
+void MarkTailConses(const std::shared_ptr<Object> &body, const std::string &name);
+
+// A syntax-rules transformer. A macro use is expanded the first time it is evaluated, or when
+// the procedure it is in is analyzed if the macro is known by then, and the expansion takes
+// the place of the use, so it is never expanded again. The expansion is not hygienic: symbols
+// of the template mean whatever they mean where the macro is used.
+class Macro : public Object {
 public:
-    Function() : Object(4) {
+    Macro() : Object(11) {
     }
+    std::shared_ptr<Object> Expand(Cell *form) const;
+    std::string ellipsis = "...";
+    std::vector<std::string> literals;
+    // Patterns and templates.
+    std::vector<std::pair<std::shared_ptr<Object>, std::shared_ptr<Object>>> rules;
 };
 
-class ConsistFunction : public Object {
+bool IsMacro(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<Macro> AsMacro(const std::shared_ptr<Object> &obj);
+
+// A chain of list builtins such as (fold kons knil (map f (filter p list))), run in one pass
+// over list without making the intermediate lists. The analysis takes the place of the head
+// of the outermost call and the arguments become the procedures of the stages, outermost
+// first, and then the list. Whenever a stage name no longer means its builtin, the call is
+// made as written instead.
+class Pipeline : public Object {
 public:
-    ConsistFunction() : Object(5) {
+    enum struct Stage { MAP, FILTER, FOLD, FOR_EACH, LENGTH };
+
+    Pipeline() : Object(12) {
     }
+    std::vector<Stage> stages;
+    // The symbols that name the stages.
+    std::vector<std::shared_ptr<Object>> names;
+    // The arguments of the outermost call as written.
+    std::shared_ptr<Object> args;
 };
 
-bool IsFunction(const std::shared_ptr<Object> &obj);
+bool IsPipeline(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<Pipeline> AsPipeline(const std::shared_ptr<Object> &obj);
+
+// Rewrites a call of the builtin op in place into a pipeline when its list argument is a call
+// of map or filter, and returns whether it did.
+bool FusePipeline(Cell *form, const std::shared_ptr<Object> &op);
+
+// Whether every stage name still means its builtin in scope.
+bool IsPipelineIntact(const Pipeline &pipeline, Scope *scope);
+
+// How many procedure and initial value arguments come before the list of a stage.
+size_t StageArity(Pipeline::Stage stage);
+
+// Makes a macro of a (syntax-rules ...) form.
+std::shared_ptr<Macro> MakeMacro(const std::shared_ptr<Object> &spec);
+
+// The code that builds the data of a quasiquote template, given the template: the parts with
+// unquotes in them are made with cons and append, and the constant parts are quoted, so the
+// result shares them with the template.
+std::shared_ptr<Object> CompileQuasiquote(const std::shared_ptr<Object> &tmpl);
+
+// A copy of the list structure of code, for one thread to rewrite while others may be running
+// the original. Quoted data and the analyses that took the place of forms are shared.
+std::shared_ptr<Object> CopyCode(const std::shared_ptr<Object> &code);
+
+// Makes the form evaluate as code from now on, by taking over its cells. Code that is not a
+// list is wrapped in a begin form.
+void ReplaceForm(Cell *form, std::shared_ptr<Object> code);
+
+// Whether the evaluator treats forms with this head as a special form rather than a call,
+// whatever the name is bound to.
+bool IsSpecialForm(const std::string &name);
+
+// Splits ((var init)...) into the variables and the init expressions. With steps given, a
+// binding may also be (var init step), as in do, and a missing step is null.
+void ParseBindings(std::shared_ptr<Object> bindings, std::vector<std::shared_ptr<Object>> *names,
+                   std::vector<std::shared_ptr<Object>> *inits,
+                   std::vector<std::shared_ptr<Object>> *steps = nullptr);
+
+// (do ((var init step)...) (test expr...) command...), given the part after do.
+std::shared_ptr<Loop> AnalyzeDo(const std::shared_ptr<Object> &args);
+
+// (let name ((var init)...) body...), given the part after let, or null if the name is used
+// other than in tail calls and a procedure has to be made after all.
+std::shared_ptr<Loop> AnalyzeNamedLet(const std::shared_ptr<Object> &args);
+
+// Binds the arguments to the parameters of the layout of frame, in their slots.
+void BindParameters(Scope *frame, const std::shared_ptr<Object> *args, size_t count);
 
-class Quote : public ConsistFunction {
+// A fresh frame with the arguments bound to the parameters of layout.
+std::shared_ptr<Scope> BindArguments(std::shared_ptr<const Layout> layout,
+                                     std::shared_ptr<Scope> father,
+                                     const std::shared_ptr<Object> *args, size_t count);
+
+bool IsRefFunction(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<RefFunction> AsRefFunction(const std::shared_ptr<Object> &obj);
+
+class Function : public Object {
 public:
-    Quote() : ConsistFunction() {
+    Function() : Object(4) {
     }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *,
-                                  std::vector<Scope *> &) final {
-        if (!IsCell(args)) {
-            throw RuntimeError{};
-        }
-        auto cell = AsCell(args);
-        return cell->GetFirst();
+};
+
+bool IsFunction(const std::shared_ptr<Object> &obj);
+
+// The builtin procedure of the name, or null. There is one object per builtin, so a binding
+// still holds the builtin exactly when it is this object.
+std::shared_ptr<Object> Builtin(const std::string &name);
+
+// A name of the builtin procedure obj, or null if it is not one.
+const std::string *BuiltinName(const Object *obj);
+
+// Binds every builtin in the global scope.
+void InstallBuiltins(Scope *scope);
+
+// call-with-current-continuation. The evaluator applies it itself, since the continuation is
+// made of its own frames.
+class CallCC : public Object {
+public:
+    CallCC() : Object(7) {
     }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
 };
 
-class List : public ConsistFunction {
+bool IsCallCC(const std::shared_ptr<Object> &obj);
+
+class List : public Function {
 public:
-    List() : ConsistFunction() {
+    List() : Function() {
     }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *,
-                                  std::vector<Scope *> &) final {
-        return args;
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        std::shared_ptr<Object> result;
+        for (size_t i = args.size(); i > 0; --i) {
+            result = std::make_shared<Cell>(args[i - 1], result);
+        }
+        return result;
     }
 };
 
@@ -292,60 +466,6 @@ public:
     }
 };
 
-class And : public ConsistFunction {
-public:
-    And() : ConsistFunction() {
-    }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *scope,
-                                  std::vector<Scope *> &scopes) final {
-        auto next = args;
-        if (next == nullptr) {
-            return std::make_shared<Bool>(true);
-        }
-        auto cell = AsCell(next);
-        auto arg = cell->GetFirst()->Eval(scope, scopes);
-        if (IsBool(arg)) {
-            if (!AsBool(arg)->Get()) {
-                return std::make_shared<Bool>(false);
-            }
-        }
-        while (next != nullptr && IsCell(next)) {
-            cell = AsCell(next);
-            arg = cell->GetFirst()->Eval(scope, scopes);
-            if (IsBool(arg)) {
-                if (!AsBool(arg)->Get()) {
-                    return std::make_shared<Bool>(false);
-                }
-            }
-            next = cell->GetSecond();
-        }
-        return arg;
-    }
-};
-
-class Or : public ConsistFunction {
-public:
-    Or() : ConsistFunction() {
-    }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *scope,
-                                  std::vector<Scope *> &scopes) final {
-        auto next = args;
-        while (next != nullptr && IsCell(next)) {
-            auto cell = AsCell(next);
-            auto arg = cell->GetFirst()->Eval(scope, scopes);
-            if (IsBool(arg)) {
-                if (AsBool(arg)->Get()) {
-                    return std::make_shared<Bool>(true);
-                }
-            } else {
-                return arg;
-            }
-            next = cell->GetSecond();
-        }
-        return std::make_shared<Bool>(false);
-    }
-};
-
 class Sum : public Function {
 public:
     Sum() : Function() {
@@ -567,76 +687,6 @@ public:
     }
 };
 
-class Define : public ConsistFunction {
-public:
-    Define() : ConsistFunction() {
-    }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *scope,
-                                  std::vector<Scope *> &scopes) final {
-        auto next = args;
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        auto cell = AsCell(next);
-        auto first = cell->GetFirst();
-        if (IsCell(first)) {
-            next = cell->GetSecond();
-            cell = AsCell(first);
-            auto cur = cell->GetFirst();
-            auto name = AsSymbol(cur)->GetName();
-            auto var = cell->GetSecond();
-            auto description = AsCell(next);
-            auto result_cell = std::make_shared<Cell>(var, description);
-            auto result = std::make_shared<RefFunction>(result_cell, scope, scopes);
-            scope->Init(name, result);
-            return nullptr;
-        }
-        if (!IsSymbol(first)) {
-            throw SyntaxError{};
-        }
-        next = cell->GetSecond();
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        cell = AsCell(next);
-        if (cell->GetSecond() != nullptr) {
-            throw SyntaxError{};
-        }
-        auto second = cell->GetFirst()->Eval(scope, scopes);
-        scope->Init(AsSymbol(first)->GetName(), second);
-        return nullptr;
-    }
-};
-
-class Set : public ConsistFunction {
-public:
-    Set() : ConsistFunction() {
-    }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *scope,
-                                  std::vector<Scope *> &scopes) final {
-        auto next = args;
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        auto cell = AsCell(next);
-        auto first = cell->GetFirst();
-        if (!IsSymbol(first)) {
-            throw SyntaxError{};
-        }
-        next = cell->GetSecond();
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        cell = AsCell(next);
-        if (cell->GetSecond() != nullptr) {
-            throw SyntaxError{};
-        }
-        auto second = cell->GetFirst()->Eval(scope, scopes);
-        scope->Set(AsSymbol(first)->GetName(), second);
-        return nullptr;
-    }
-};
-
 class Cons : public Function {
 public:
     Cons() : Function() {
@@ -654,7 +704,7 @@ public:
     Car() : Function() {
     }
     std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
-        if (args.size() != 1 && IsCell(args[0])) {
+        if (args.size() != 1 || !IsCell(args[0])) {
             throw RuntimeError{};
         }
         auto cell = AsCell(args[0]);
@@ -667,7 +717,7 @@ public:
     Cdr() : Function() {
     }
     std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
-        if (args.size() != 1 && IsCell(args[0])) {
+        if (args.size() != 1 || !IsCell(args[0])) {
             throw RuntimeError{};
         }
         auto cell = AsCell(args[0]);
@@ -675,98 +725,19 @@ public:
     }
 };
 
-class SetCar : public ConsistFunction {
-public:
-    SetCar() : ConsistFunction() {
-    }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *scope,
-                                  std::vector<Scope *> &scopes) final {
-        auto next = args;
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        auto cell = AsCell(next);
-        auto first = cell->GetFirst();
-        if (!IsSymbol(first)) {
-            throw SyntaxError{};
-        }
-        next = cell->GetSecond();
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        cell = AsCell(next);
-        if (cell->GetSecond() != nullptr) {
-            throw SyntaxError{};
-        }
-        auto second = cell->GetFirst()->Eval(scope, scopes);
-        auto pair = scope->Get(AsSymbol(first)->GetName());
-        if (!IsCell(pair)) {
-            throw SyntaxError{};
-        }
-        auto right = AsCell(pair)->GetSecond();
-        scope->Set(AsSymbol(first)->GetName(), std::make_shared<Cell>(second, right));
-        return nullptr;
-    }
-};
-
-class SetCdr : public ConsistFunction {
+class ListRef : public Function {
 public:
-    SetCdr() : ConsistFunction() {
+    ListRef() : Function() {
     }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *scope,
-                                  std::vector<Scope *> &scopes) final {
-        auto next = args;
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        auto cell = AsCell(next);
-        auto first = cell->GetFirst();
-        if (!IsSymbol(first)) {
-            throw SyntaxError{};
-        }
-        next = cell->GetSecond();
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        cell = AsCell(next);
-        if (cell->GetSecond() != nullptr) {
-            throw SyntaxError{};
-        }
-        auto second = cell->GetFirst()->Eval(scope, scopes);
-        auto pair = scope->Get(AsSymbol(first)->GetName());
-        if (!IsCell(pair)) {
-            throw SyntaxError{};
-        }
-        auto left = AsCell(pair)->GetFirst();
-        scope->Set(AsSymbol(first)->GetName(), std::make_shared<Cell>(left, second));
-        return nullptr;
-    }
-};
-
-class ListRef : public ConsistFunction {
-public:
-    ListRef() : ConsistFunction() {
-    }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *scope,
-                                  std::vector<Scope *> &scopes) final {
-        auto next = args;
-        if (!IsCell(next)) {
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() != 2) {
             throw SyntaxError{};
         }
-        auto cell = AsCell(next);
-        auto first = cell->GetFirst()->Eval(scope, scopes);
+        auto first = args[0];
         if (!IsCell(first)) {
             throw SyntaxError{};
         }
-        next = cell->GetSecond();
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        cell = AsCell(next);
-        if (cell->GetSecond() != nullptr) {
-            throw SyntaxError{};
-        }
-        auto second = cell->GetFirst()->Eval(scope, scopes);
+        auto second = args[1];
         if (!IsNumber(second)) {
             throw SyntaxError{};
         }
@@ -785,30 +756,19 @@ public:
     }
 };
 
-class ListTail : public ConsistFunction {
+class ListTail : public Function {
 public:
-    ListTail() : ConsistFunction() {
+    ListTail() : Function() {
     }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *scope,
-                                  std::vector<Scope *> &scopes) final {
-        auto next = args;
-        if (!IsCell(next)) {
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() != 2) {
             throw SyntaxError{};
         }
-        auto cell = AsCell(next);
-        auto first = cell->GetFirst()->Eval(scope, scopes);
+        auto first = args[0];
         if (!IsCell(first)) {
             throw SyntaxError{};
         }
-        next = cell->GetSecond();
-        if (!IsCell(next)) {
-            throw SyntaxError{};
-        }
-        cell = AsCell(next);
-        if (cell->GetSecond() != nullptr) {
-            throw SyntaxError{};
-        }
-        auto second = cell->GetFirst()->Eval(scope, scopes);
+        auto second = args[1];
         if (!IsNumber(second)) {
             throw SyntaxError{};
         }
@@ -827,63 +787,364 @@ public:
     }
 };
 
-class If : public ConsistFunction {
+// Builds a list front to back by appending to its last cell.
+class ListBuilder {
 public:
-    If() : ConsistFunction() {
+    void Add(std::shared_ptr<Object> item) {
+        auto cell = std::make_shared<Cell>(std::move(item), nullptr);
+        Link(cell);
+        tail_ = cell.get();
     }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *scope,
-                                  std::vector<Scope *> &scopes) final {
-        if (!IsCell(args)) {
-            throw SyntaxError{};
+    // Ends the list with tail, which is shared rather than copied.
+    std::shared_ptr<Object> Finish(std::shared_ptr<Object> tail = nullptr) {
+        Link(std::move(tail));
+        return std::move(head_);
+    }
+
+private:
+    void Link(std::shared_ptr<Object> rest) {
+        if (tail_ == nullptr) {
+            head_ = std::move(rest);
+        } else {
+            tail_->SetSecond(std::move(rest));
         }
-        auto cell = AsCell(args);
-        auto condition = cell->GetFirst()->Eval(scope, scopes);
-        if (!IsBool(condition)) {
-            throw SyntaxError{};
+    }
+    std::shared_ptr<Object> head_;
+    Cell *tail_ = nullptr;
+};
+
+// Calls a procedure of the program from a builtin.
+inline std::shared_ptr<Object> CallProcedure(const std::shared_ptr<Object> &proc,
+                                             const std::vector<std::shared_ptr<Object>> &args) {
+    if (!IsFunction(proc)) {
+        throw RuntimeError{};
+    }
+    return proc->Apply(args);
+}
+
+inline bool IsFalse(const std::shared_ptr<Object> &obj) {
+    return IsBool(obj) && !AsBool(obj)->Get();
+}
+
+// equal?: the same numbers, symbols and booleans, and lists of equal elements.
+bool IsEqual(const std::shared_ptr<Object> &lhs, const std::shared_ptr<Object> &rhs);
+
+class Length : public Function {
+public:
+    Length() : Function() {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() != 1) {
+            throw RuntimeError{};
         }
-        if (!IsCell(cell->GetSecond())) {
-            throw SyntaxError{};
+        int length = 0;
+        auto list = args[0];
+        for (; IsCell(list); list = AsCell(list)->GetSecond()) {
+            ++length;
         }
-        cell = AsCell(cell->GetSecond());
-        auto first = cell->GetFirst();
-        if (cell->GetSecond() == nullptr) {
-            if (AsBool(condition)->Get()) {
-                return first->Eval(scope, scopes);
-            }
+        if (list != nullptr) {
+            throw RuntimeError{};
+        }
+        return std::make_shared<Number>(length);
+    }
+};
+
+// Copies every list but the last, which becomes the tail of the result as it is.
+class Append : public Function {
+public:
+    Append() : Function() {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.empty()) {
             return nullptr;
         }
-        if (!IsCell(cell->GetSecond())) {
-            throw SyntaxError{};
+        ListBuilder result;
+        for (size_t i = 0; i + 1 < args.size(); ++i) {
+            auto list = args[i];
+            for (; IsCell(list); list = AsCell(list)->GetSecond()) {
+                result.Add(AsCell(list)->GetFirst());
+            }
+            if (list != nullptr) {
+                throw RuntimeError{};
+            }
         }
-        cell = AsCell(cell->GetSecond());
-        auto second = cell->GetFirst();
-        if (cell->GetSecond() != nullptr) {
-            throw SyntaxError{};
+        return result.Finish(args.back());
+    }
+};
+
+class Reverse : public Function {
+public:
+    Reverse() : Function() {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() != 1) {
+            throw RuntimeError{};
         }
-        if (AsBool(condition)->Get()) {
-            return first->Eval(scope, scopes);
-        } else {
-            return second->Eval(scope, scopes);
+        std::shared_ptr<Object> result;
+        auto list = args[0];
+        for (; IsCell(list); list = AsCell(list)->GetSecond()) {
+            result = std::make_shared<Cell>(AsCell(list)->GetFirst(), std::move(result));
+        }
+        if (list != nullptr) {
+            throw RuntimeError{};
         }
+        return result;
     }
 };
 
-class Lambda : public ConsistFunction {
+// The elements at the same position in several lists, as arguments for a procedure. Iteration
+// ends with the shortest list.
+class ListCursor {
 public:
-    Lambda() : ConsistFunction() {
+    ListCursor(const std::vector<std::shared_ptr<Object>> &args, size_t first)
+        : lists_(args.begin() + first, args.end()) {
+        if (lists_.empty()) {
+            throw RuntimeError{};
+        }
     }
-    std::shared_ptr<Object> Apply(const std::shared_ptr<Object> &args, Scope *scope,
-                                  std::vector<Scope *> &scopes) final {
-        if (!IsCell(args)) {
-            throw SyntaxError{};
+    // Puts the next elements after the first prefix_size arguments of items.
+    bool Next(std::vector<std::shared_ptr<Object>> *items, size_t prefix_size = 0) {
+        items->resize(prefix_size);
+        for (auto &list : lists_) {
+            if (!IsCell(list)) {
+                return false;
+            }
         }
-        auto sell = AsCell(args);
-        auto next = sell->GetSecond();
-        if (!IsCell(next)) {
-            throw SyntaxError{};
+        for (auto &list : lists_) {
+            items->push_back(AsCell(list)->GetFirst());
+            list = AsCell(list)->GetSecond();
         }
-        auto result = std::make_shared<RefFunction>(args, scope, scopes);
-        result->Eval(scope, scopes);
-        return result;
+        return true;
+    }
+
+private:
+    std::vector<std::shared_ptr<Object>> lists_;
+};
+
+class Map : public Function {
+public:
+    Map() : Function() {
     }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() < 2) {
+            throw RuntimeError{};
+        }
+        ListCursor cursor(args, 1);
+        std::vector<std::shared_ptr<Object>> items;
+        ListBuilder result;
+        while (cursor.Next(&items)) {
+            result.Add(CallProcedure(args[0], items));
+        }
+        return result.Finish();
+    }
+};
+
+class ForEach : public Function {
+public:
+    ForEach() : Function() {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() < 2) {
+            throw RuntimeError{};
+        }
+        ListCursor cursor(args, 1);
+        std::vector<std::shared_ptr<Object>> items;
+        while (cursor.Next(&items)) {
+            CallProcedure(args[0], items);
+        }
+        return nullptr;
+    }
+};
+
+// The run of elements after the last one that is dropped is not copied: the result ends with
+// that tail of the argument.
+class Filter : public Function {
+public:
+    Filter() : Function() {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() != 2) {
+            throw RuntimeError{};
+        }
+        ListBuilder result;
+        std::vector<std::shared_ptr<Object>> items(1);
+        auto kept = args[1];
+        auto list = args[1];
+        for (; IsCell(list); list = AsCell(list)->GetSecond()) {
+            items[0] = AsCell(list)->GetFirst();
+            if (!IsFalse(CallProcedure(args[0], items))) {
+                continue;
+            }
+            for (; kept != list; kept = AsCell(kept)->GetSecond()) {
+                result.Add(AsCell(kept)->GetFirst());
+            }
+            kept = AsCell(list)->GetSecond();
+        }
+        if (list != nullptr) {
+            throw RuntimeError{};
+        }
+        return result.Finish(std::move(kept));
+    }
+};
+
+// (fold kons knil list...) calls (kons element... accumulator) from the left.
+class Fold : public Function {
+public:
+    Fold() : Function() {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() < 3) {
+            throw RuntimeError{};
+        }
+        ListCursor cursor(args, 2);
+        std::vector<std::shared_ptr<Object>> items;
+        auto accumulator = args[1];
+        while (cursor.Next(&items)) {
+            items.push_back(std::move(accumulator));
+            accumulator = CallProcedure(args[0], items);
+        }
+        return accumulator;
+    }
+};
+
+// (member x list [compare]) is the first tail of list that starts with x, or #f.
+class Member : public Function {
+public:
+    Member() : Function() {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() != 2 && args.size() != 3) {
+            throw RuntimeError{};
+        }
+        auto list = args[1];
+        for (; IsCell(list); list = AsCell(list)->GetSecond()) {
+            const auto &item = AsCell(list)->GetFirst();
+            if (args.size() == 2 ? IsEqual(args[0], item)
+                                 : !IsFalse(CallProcedure(args[2], {args[0], item}))) {
+                return list;
+            }
+        }
+        if (list != nullptr) {
+            throw RuntimeError{};
+        }
+        return std::make_shared<Bool>(false);
+    }
+};
+
+// (assoc key alist [compare]) is the first pair of alist whose car is key, or #f.
+class Assoc : public Function {
+public:
+    Assoc() : Function() {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() != 2 && args.size() != 3) {
+            throw RuntimeError{};
+        }
+        auto list = args[1];
+        for (; IsCell(list); list = AsCell(list)->GetSecond()) {
+            const auto &pair = AsCell(list)->GetFirst();
+            if (!IsCell(pair)) {
+                throw RuntimeError{};
+            }
+            const auto &key = AsCell(pair)->GetFirst();
+            if (args.size() == 2 ? IsEqual(args[0], key)
+                                 : !IsFalse(CallProcedure(args[2], {args[0], key}))) {
+                return pair;
+            }
+        }
+        if (list != nullptr) {
+            throw RuntimeError{};
+        }
+        return std::make_shared<Bool>(false);
+    }
+};
+
+class IsEqualFunction : public Function {
+public:
+    IsEqualFunction() : Function() {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final {
+        if (args.size() != 2) {
+            throw RuntimeError{};
+        }
+        return std::make_shared<Bool>(IsEqual(args[0], args[1]));
+    }
+};
+
+// (sort list less?), (sort! list less?) and (list-sort less? list): a stable merge sort of the
+// elements copied into a buffer. sort! puts the sorted elements back into the cells of the
+// list, like set-car! does; a quoted list is a constant of the code, so sorting one in place
+// sorts it for every later evaluation of the quote as well. Lists of numbers ordered by the
+// builtin < or > are compared without calling the procedure and, when long, sorted in chunks
+// on the threads of the work-stealing pool.
+class Sort : public Function {
+public:
+    Sort(bool is_in_place, bool is_procedure_first)
+        : Function(), is_in_place_(is_in_place), is_procedure_first_(is_procedure_first) {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+
+private:
+    bool is_in_place_;
+    bool is_procedure_first_;
+};
+
+// (pmap proc list), (pfor-each proc list) and (preduce proc init list) split the list into
+// chunks and call proc on them on the threads of the work-stealing pool. preduce folds init
+// into the first element and every other chunk from its first element with (proc acc element),
+// then folds the results of the chunks in order. It gives what a fold from the left gives when
+// proc is associative, with acc and element of the same kind, as for + or append. Procedures
+// called in parallel must not assign variables other threads use.
+class ParallelMap : public Function {
+public:
+    enum struct Kind { MAP, FOR_EACH, REDUCE };
+    explicit ParallelMap(Kind kind) : Function(), kind_(kind) {
+    }
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+
+private:
+    Kind kind_;
+};
+
+class SharedCodeScope;
+
+// The value of a thunk that is called on a thread of the pool while the thread that made the
+// future goes on. (future expr ...) is rewritten into a call of SpawnFuture with a thunk of
+// the body, which captures the variables it uses like any other closure.
+class Future : public Object, public std::enable_shared_from_this<Future> {
+public:
+    explicit Future(std::shared_ptr<Object> thunk);
+    ~Future();
+    void Start();
+    // The value of the thunk, or what it threw. A thunk that has not started yet is called on
+    // this thread; one that runs elsewhere is waited for by running other pending tasks.
+    std::shared_ptr<Object> Touch();
+
+private:
+    enum State { PENDING, RUNNING, DONE };
+    void Run();
+
+    std::shared_ptr<Object> thunk_;
+    std::atomic<int> state_{PENDING};
+    std::shared_ptr<Object> value_;
+    std::exception_ptr error_;
+    // Held from Start until the thunk returns.
+    std::unique_ptr<SharedCodeScope> shared_;
+    // The global scope of the program that started it, for the thread that calls the thunk.
+    std::shared_ptr<Scope> running_;
+};
+
+bool IsFuture(const std::shared_ptr<Object> &obj);
+
+std::shared_ptr<Future> AsFuture(const std::shared_ptr<Object> &obj);
+
+class SpawnFuture : public Function {
+public:
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
+};
+
+// (touch x): the value of a future, or x itself if it is not one.
+class Touch : public Function {
+public:
+    std::shared_ptr<Object> Apply(const std::vector<std::shared_ptr<Object>> &args) final;
 };
@@ -0,0 +1,196 @@
+#include "object.h"
+#include "pool.h"
+#include <algorithm>
+
+namespace {
+using Item = std::shared_ptr<Object>;
+
+// Enough chunks for the workers to even out the load between them.
+constexpr size_t kChunksPerThread = 4;
+
+std::vector<Item> Elements(std::shared_ptr<Object> list) {
+    std::vector<Item> items;
+    for (; IsCell(list); list = AsCell(list)->GetSecond()) {
+        items.push_back(AsCell(list)->GetFirst());
+    }
+    if (list != nullptr) {
+        throw RuntimeError{};
+    }
+    return items;
+}
+
+// Runs body(begin, end) over non-empty chunks of [first, count). The tasks run while the code
+// is marked as shared, so forms that are rewritten on use are rewritten once for all of them.
+template <class Body>
+void ForEachChunk(size_t first, size_t count, const Body &body) {
+    if (first == count) {
+        return;
+    }
+    auto &pool = WorkStealingPool::Instance();
+    if (pool.WorkerCount() == 0 || count - first < 2) {
+        body(first, count);
+        return;
+    }
+    size_t chunks = std::min(count - first, (pool.WorkerCount() + 1) * kChunksPerThread);
+    size_t size = (count - first + chunks - 1) / chunks;
+    SharedCodeScope shared;
+    TaskGroup group(&pool);
+    auto running = RunningScope::Current();
+    for (size_t begin = first; begin < count; begin += size) {
+        size_t end = std::min(begin + size, count);
+        group.Run([&body, &running, begin, end] {
+            RunningScope program(running);
+            body(begin, end);
+        });
+    }
+    group.Wait();
+}
+}  // namespace
+
+// The first element is done on this thread before the rest is spread over the pool. Most
+// forms of a procedure are rewritten in place the first time they run, and after that the
+// other threads find them ready and do not have to work on copies.
+std::shared_ptr<Object> ParallelMap::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    size_t arity = kind_ == Kind::REDUCE ? 3 : 2;
+    if (args.size() != arity) {
+        throw RuntimeError{};
+    }
+    const auto &proc = args[0];
+    auto items = Elements(args.back());
+    if (!IsFunction(proc)) {
+        throw RuntimeError{};
+    }
+    if (kind_ == Kind::REDUCE) {
+        if (items.empty()) {
+            return args[1];
+        }
+        // init goes into the first element only and every chunk starts from its own first
+        // element, so the result does not depend on the number of threads.
+        auto result = CallProcedure(proc, {args[1], items[0]});
+        // A partial result may be '() itself, so the chunks mark where they left one.
+        std::vector<Item> partial(items.size());
+        std::vector<char> is_filled(items.size());
+        ForEachChunk(1, items.size(), [&](size_t begin, size_t end) {
+            std::vector<Item> call{items[begin], nullptr};
+            for (size_t i = begin + 1; i < end; ++i) {
+                call[1] = items[i];
+                call[0] = CallProcedure(proc, call);
+            }
+            // Every chunk leaves its result at its first index.
+            partial[begin] = std::move(call[0]);
+            is_filled[begin] = true;
+        });
+        for (size_t i = 1; i < items.size(); ++i) {
+            if (is_filled[i]) {
+                result = CallProcedure(proc, {result, partial[i]});
+            }
+        }
+        return result;
+        return result;
+    }
+    std::vector<Item> results(kind_ == Kind::MAP ? items.size() : 0);
+    auto apply = [&](size_t begin, size_t end) {
+        std::vector<Item> call(1);
+        for (size_t i = begin; i < end; ++i) {
+            call[0] = items[i];
+            auto value = CallProcedure(proc, call);
+            if (kind_ == Kind::MAP) {
+                results[i] = std::move(value);
+            }
+        }
+    };
+    if (!items.empty()) {
+        apply(0, 1);
+        ForEachChunk(1, items.size(), apply);
+    }
+    if (kind_ == Kind::FOR_EACH) {
+        return nullptr;
+    }
+    ListBuilder list;
+    for (auto &result : results) {
+        list.Add(std::move(result));
+    }
+    return list.Finish();
+}
+
+Future::Future(std::shared_ptr<Object> thunk) : Object(14), thunk_(std::move(thunk)) {
+}
+
+Future::~Future() = default;
+
+void Future::Start() {
+    running_ = RunningScope::Current();
+    auto &pool = WorkStealingPool::Instance();
+    if (pool.WorkerCount() == 0) {
+        state_ = RUNNING;
+        Run();
+        return;
+    }
+    shared_ = std::make_unique<SharedCodeScope>();
+    pool.Submit([future = shared_from_this()] {
+        int pending = PENDING;
+        if (future->state_.compare_exchange_strong(pending, RUNNING)) {
+            future->Run();
+        }
+    });
+}
+
+void Future::Run() {
+    RunningScope program(running_);
+    try {
+        value_ = CallProcedure(thunk_, {});
+    } catch (...) {
+        error_ = std::current_exception();
+    }
+    thunk_ = nullptr;
+    running_ = nullptr;
+    shared_ = nullptr;
+    state_.store(DONE, std::memory_order_release);
+}
+
+std::shared_ptr<Object> Future::Touch() {
+    int pending = PENDING;
+    if (state_.compare_exchange_strong(pending, RUNNING)) {
+        Run();
+    }
+    auto &pool = WorkStealingPool::Instance();
+    while (state_.load(std::memory_order_acquire) != DONE) {
+        if (!pool.RunPendingTask()) {
+            std::this_thread::yield();
+        }
+    }
+    if (error_ != nullptr) {
+        std::rethrow_exception(error_);
+    }
+    return value_;
+}
+
+bool IsFuture(const std::shared_ptr<Object> &obj) {
+    if (obj == nullptr) {
+        return false;
+    }
+    return obj->type_ == 14;
+}
+
+std::shared_ptr<Future> AsFuture(const std::shared_ptr<Object> &obj) {
+    return std::static_pointer_cast<Future>(obj);
+}
+
+std::shared_ptr<Object> SpawnFuture::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (args.size() != 1 || !IsFunction(args[0])) {
+        throw RuntimeError{};
+    }
+    auto future = std::make_shared<Future>(args[0]);
+    future->Start();
+    return future;
+}
+
+std::shared_ptr<Object> Touch::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (args.size() != 1) {
+        throw RuntimeError{};
+    }
+    if (!IsFuture(args[0])) {
+        return args[0];
+    }
+    return AsFuture(args[0])->Touch();
+}
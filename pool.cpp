@@ -0,0 +1,164 @@
+#include "pool.h"
+#include <algorithm>
+
+namespace {
+constexpr size_t kNotWorker = static_cast<size_t>(-1);
+
+// Which worker of which pool the current thread is.
+thread_local WorkStealingPool *t_pool = nullptr;
+thread_local size_t t_worker = kNotWorker;
+
+std::atomic<size_t> thread_count{0};
+std::atomic<int> shared_code_scopes{0};
+}  // namespace
+
+WorkStealingPool &WorkStealingPool::Instance() {
+    static WorkStealingPool pool([] {
+        size_t count = thread_count.load();
+        if (count == 0) {
+            count = std::max<size_t>(1, std::thread::hardware_concurrency());
+        }
+        return count - 1;
+    }());
+    return pool;
+}
+
+void WorkStealingPool::SetThreadCount(size_t count) {
+    thread_count = count;
+}
+
+WorkStealingPool::WorkStealingPool(size_t workers) {
+    for (size_t i = 0; i < workers; ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < workers; ++i) {
+        threads_.emplace_back([this, i] { Work(i); });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        is_stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::Submit(std::function<void()> task) {
+    size_t index = t_pool == this ? t_worker : next_++ % workers_.size();
+    {
+        std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+        workers_[index]->tasks.push_back(std::move(task));
+    }
+    {
+        // Taken so that a worker between its last look at the deques and its sleep cannot
+        // miss the wakeup.
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        ++queued_;
+    }
+    wake_.notify_one();
+}
+
+bool WorkStealingPool::RunPendingTask() {
+    std::function<void()> task;
+    if (!TakeTask(t_pool == this ? t_worker : kNotWorker, &task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+// The own deque is used from the back, like a stack, so a worker keeps on with the tasks it
+// has just made; the others are robbed from the front, where the oldest and usually largest
+// tasks are.
+bool WorkStealingPool::TakeTask(size_t index, std::function<void()> *task) {
+    if (queued_ == 0) {
+        return false;
+    }
+    if (index != kNotWorker) {
+        Worker &own = *workers_[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            *task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --queued_;
+            return true;
+        }
+    }
+    size_t start = index == kNotWorker ? 0 : index + 1;
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        Worker &victim = *workers_[(start + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            *task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --queued_;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::Work(size_t index) {
+    t_pool = this;
+    t_worker = index;
+    std::function<void()> task;
+    while (true) {
+        if (TakeTask(index, &task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wake_.wait(lock, [this] { return is_stopping_ || queued_ > 0; });
+        if (is_stopping_ && queued_ == 0) {
+            return;
+        }
+    }
+}
+
+void TaskGroup::Run(std::function<void()> task) {
+    auto run = [this, task = std::move(task)] {
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex_);
+            if (error_ == nullptr) {
+                error_ = std::current_exception();
+            }
+        }
+        --pending_;
+    };
+    ++pending_;
+    if (pool_->WorkerCount() == 0) {
+        run();
+        return;
+    }
+    pool_->Submit(std::move(run));
+}
+
+void TaskGroup::Wait() {
+    while (pending_ > 0) {
+        if (!pool_->RunPendingTask()) {
+            std::this_thread::yield();
+        }
+    }
+    if (error_ != nullptr) {
+        std::rethrow_exception(error_);
+    }
+}
+
+bool IsCodeShared() {
+    return shared_code_scopes.load(std::memory_order_relaxed) > 0;
+}
+
+SharedCodeScope::SharedCodeScope() {
+    ++shared_code_scopes;
+}
+
+SharedCodeScope::~SharedCodeScope() {
+    --shared_code_scopes;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads with a deque of tasks each. A worker runs the newest task of
+// its own deque and, when that is empty, steals the oldest task of another worker. Threads
+// that wait for tasks to finish run pending tasks themselves instead of blocking.
+class WorkStealingPool {
+public:
+    // The pool of the process, with the number of threads set by SetThreadCount, or one per
+    // hardware thread. The thread that uses the pool counts as one of them.
+    static WorkStealingPool &Instance();
+    // Takes effect only before the first use of the pool.
+    static void SetThreadCount(size_t count);
+
+    explicit WorkStealingPool(size_t workers);
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+    ~WorkStealingPool();
+
+    size_t WorkerCount() const {
+        return workers_.size();
+    }
+    // Queues the task on the deque of the calling worker, or of the next worker in turn.
+    void Submit(std::function<void()> task);
+    // Runs one queued task on the calling thread, if there is any.
+    bool RunPendingTask();
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+    void Work(size_t index);
+    bool TakeTask(size_t index, std::function<void()> *task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> next_{0};
+    std::atomic<size_t> queued_{0};
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool is_stopping_ = false;
+};
+
+// Tasks that are waited for together. The first exception a task throws is rethrown by Wait.
+class TaskGroup {
+public:
+    explicit TaskGroup(WorkStealingPool *pool) : pool_(pool) {
+    }
+    void Run(std::function<void()> task);
+    // Helps with pending tasks until all the tasks of the group have finished.
+    void Wait();
+
+private:
+    WorkStealingPool *pool_;
+    std::atomic<size_t> pending_{0};
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+};
+
+// While code may run on several threads at once, the evaluator rewrites each form once, in a
+// copy that all the threads share, instead of the form itself.
+bool IsCodeShared();
+
+// Marks a stretch of time in which code runs on several threads.
+class SharedCodeScope {
+public:
+    SharedCodeScope();
+    SharedCodeScope(const SharedCodeScope &) = delete;
+    SharedCodeScope &operator=(const SharedCodeScope &) = delete;
+    ~SharedCodeScope();
+};
@@ -0,0 +1,120 @@
+#include "object.h"
+
+namespace {
+// The code for a part of a template, or the part itself when it has no unquote at the level
+// being compiled.
+struct Piece {
+    std::shared_ptr<Object> code;
+    bool is_constant;
+};
+
+// (name x)
+bool IsFormOf(const std::shared_ptr<Object> &obj, const char *name) {
+    if (!IsCell(obj)) {
+        return false;
+    }
+    auto form = AsCell(obj);
+    return IsSymbol(form->GetFirst()) && AsSymbol(form->GetFirst())->GetName() == name &&
+           IsCell(form->GetSecond()) && AsCell(form->GetSecond())->GetSecond() == nullptr;
+}
+
+bool IsQuasiquoteForm(const std::shared_ptr<Object> &obj) {
+    return IsFormOf(obj, "quasiquote") || IsFormOf(obj, "unquote") ||
+           IsFormOf(obj, "unquote-splicing");
+}
+
+const std::shared_ptr<Object> &Argument(const std::shared_ptr<Object> &form) {
+    return AsCell(AsCell(form)->GetSecond())->GetFirst();
+}
+
+std::shared_ptr<Object> Quoted(Piece piece) {
+    if (!piece.is_constant || IsNumber(piece.code)) {
+        return std::move(piece.code);
+    }
+    return std::make_shared<Cell>(std::make_shared<Symbol>("quote"),
+                                  std::make_shared<Cell>(std::move(piece.code), nullptr));
+}
+
+std::shared_ptr<Object> Call(std::shared_ptr<Object> op, Piece first, Piece second) {
+    return std::make_shared<Cell>(
+        std::move(op), std::make_shared<Cell>(Quoted(std::move(first)),
+                                              std::make_shared<Cell>(Quoted(std::move(second)),
+                                                                     nullptr)));
+}
+
+Piece Compile(const std::shared_ptr<Object> &tmpl, size_t depth);
+
+// The elements are compiled back to front, so a constant tail is kept as it is in the
+// template and only the cells in front of the last unquote are made anew.
+Piece CompileList(const std::shared_ptr<Object> &list, size_t depth) {
+    std::vector<std::shared_ptr<Cell>> cells;
+    std::shared_ptr<Object> rest = list;
+    do {
+        cells.push_back(AsCell(rest));
+        rest = AsCell(rest)->GetSecond();
+        // (a . ,b) reads as (a unquote b).
+    } while (IsCell(rest) && !IsQuasiquoteForm(rest));
+    Piece result = Compile(rest, depth);
+    for (size_t i = cells.size(); i > 0; --i) {
+        const auto &cell = cells[i - 1];
+        const auto &element = cell->GetFirst();
+        if (depth == 1 && IsFormOf(element, "unquote-splicing")) {
+            Piece spliced{Argument(element), false};
+            if (result.is_constant && result.code == nullptr) {
+                result = std::move(spliced);
+            } else {
+                result = {Call(Builtin("append"), std::move(spliced), std::move(result)),
+                          false};
+            }
+            continue;
+        }
+        Piece first = Compile(element, depth);
+        if (first.is_constant && result.is_constant) {
+            result = {cell, true};
+        } else {
+            result = {Call(Builtin("cons"), std::move(first), std::move(result)), false};
+        }
+    }
+    return result;
+}
+
+// Only unquotes at the level of the outermost quasiquote are evaluated; nested quasiquotes
+// and the unquotes in them are data, with whatever they unquote at the outer level filled in.
+Piece Compile(const std::shared_ptr<Object> &tmpl, size_t depth) {
+    if (!IsCell(tmpl)) {
+        return {tmpl, true};
+    }
+    if (IsFormOf(tmpl, "unquote")) {
+        if (depth == 1) {
+            return {Argument(tmpl), false};
+        }
+        return CompileList(tmpl, depth - 1);
+    }
+    if (IsFormOf(tmpl, "unquote-splicing")) {
+        if (depth == 1) {
+            // Outside of a list there is nothing to splice into.
+            throw SyntaxError{};
+        }
+        return CompileList(tmpl, depth - 1);
+    }
+    if (IsFormOf(tmpl, "quasiquote")) {
+        return CompileList(tmpl, depth + 1);
+    }
+    return CompileList(tmpl, depth);
+}
+}  // namespace
+
+std::shared_ptr<Object> CompileQuasiquote(const std::shared_ptr<Object> &tmpl) {
+    return Quoted(Compile(tmpl, 1));
+}
+
+void ReplaceForm(Cell *form, std::shared_ptr<Object> code) {
+    if (IsCell(code)) {
+        auto cell = AsCell(code);
+        form->SetFirst(cell->GetFirst());
+        form->SetSecond(cell->GetSecond());
+    } else {
+        form->SetFirst(std::make_shared<Symbol>("begin"));
+        form->SetSecond(std::make_shared<Cell>(std::move(code), nullptr));
+    }
+}
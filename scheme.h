@@ -4,25 +4,72 @@
 #include <sstream>
 #include <vector>
 #include "assemble.h"
+#include "evaluator.h"
+#include "green.h"
+#include "image.h"
 
 class Compilation {
 public:
-    Compilation() : scopes() {
-        scope = new Scope();
-        scopes.push_back(scope);
+    // With a prelude, the global scope is a fork of it: it starts with the definitions of the
+    // prelude, builtins included, and assigns its own copies of them, so that no program
+    // changes what the others see.
+    explicit Compilation(const std::shared_ptr<Scope> &prelude = nullptr)
+        : scope(prelude == nullptr ? std::make_shared<Scope>() : prelude->Fork()) {
+        if (prelude == nullptr) {
+            InstallBuiltins(scope.get());
+        }
     }
     std::string Build(const std::string &right) {
+        std::string result;
+        Build(right, &result);
+        return result;
+    }
+    // Appends the printed result to out instead of returning a fresh string.
+    void Build(const std::string &right, std::string *out) {
+        RunningScope program(scope);
         std::stringstream ss{right};
         Tokenizer token{&ss};
         std::shared_ptr<Object> root = Read(&token);
-        std::shared_ptr<Object> result = root->Eval(scope, scopes);
-        return Assemble(result);
+        std::shared_ptr<Object> result = Scheduler::Current().Run(&evaluator, root, scope);
+        Assemble(result, out);
     }
-    ~Compilation() {
-        for (auto sc : scopes) {
-            delete sc;
+    // Evaluates the top-level datums of the stream one by one as soon as each of them is
+    // complete and prints every result on its own line, unless out is null.
+    void Build(std::istream *in, std::ostream *out) {
+        RunningScope program(scope);
+        Tokenizer token{in};
+        std::string printed;
+        while (!token.IsEnd()) {
+            std::shared_ptr<Object> root = ReadNext(&token);
+            if (root == nullptr) {
+                throw RuntimeError{};
+            }
+            std::shared_ptr<Object> result = Scheduler::Current().Run(&evaluator, root, scope);
+            if (out != nullptr) {
+                printed.clear();
+                Assemble(result, &printed);
+                printed.push_back('\n');
+                out->write(printed.data(), printed.size());
+            }
         }
     }
-    Scope *scope;
-    std::vector<Scope *> scopes;
+    // A copy of the program that costs the same however much it has defined: the fork starts
+    // with the global variables of this one and from then on defines and assigns its own,
+    // procedures shared with this one included. Variables captured by closures and the
+    // objects themselves are still shared.
+    std::unique_ptr<Compilation> Fork() {
+        return std::unique_ptr<Compilation>(new Compilation(scope->Fork(), ForkTag{}));
+    }
+    // Procedures defined at the top level refer back to the global scope, so the cycle is
+    // broken here.
+    ~Compilation() {
+        scope->table.Clear();
+    }
+    std::shared_ptr<Scope> scope;
+    Evaluator evaluator;
+
+private:
+    struct ForkTag {};
+    Compilation(std::shared_ptr<Scope> fork, ForkTag) : scope(std::move(fork)) {
+    }
 };
\ No newline at end of file
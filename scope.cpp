@@ -1,29 +1,300 @@
 #include "scope.h"
+#include "object.h"
+#include "pool.h"
+#include <algorithm>
+#include <mutex>
+
+namespace {
+thread_local const std::shared_ptr<Scope> *running_scope = nullptr;
+
+std::shared_ptr<Object> *Value(Slot *slot) {
+    if (slot->box != nullptr) {
+        return slot->box->is_bound ? &slot->box->value : nullptr;
+    }
+    return slot->is_bound ? &slot->value : nullptr;
+}
+
+// Global variables may be defined and assigned while other threads look them up, so while
+// code runs on several threads the readers of a table take its root atomically and the
+// writers take turns on the lock of the table.
+bool FindGlobal(const Scope &scope, const std::string &name, std::shared_ptr<Object> *value) {
+    if (IsCodeShared()) {
+        return scope.table.FindShared(name, value);
+    }
+    auto found = scope.table.Find(name);
+    if (found == nullptr) {
+        return false;
+    }
+    *value = *found;
+    return true;
+}
+}  // namespace
 
 Scope::Scope() : table(), father(nullptr) {
 }
 
-Scope::Scope(Scope *father) : table(), father(father) {
+Scope::Scope(std::shared_ptr<const Layout> layout, std::shared_ptr<Scope> father)
+    : table(), father(std::move(father)), layout(std::move(layout)) {
+    slots.resize(this->layout->names.size());
 }
 
-std::shared_ptr<Object> Scope::Get(std::string name) {
-    if (table.find(name) != table.end()) {
-        return table[name];
-    } else {
-        if (father == nullptr) {
-            throw NameError{};
+// A procedure defined inside a frame that calls itself holds the box of its own variable, and
+// the box holds the procedure, so neither is ever released by counting references alone. When
+// a frame goes, its boxes, the procedures in them, the boxes those capture and so on are
+// weighed as one group: whatever is referred to from outside the group is live and so is
+// everything it reaches, and the values of the other boxes, which nothing can reach any more,
+// are dropped to break their cycles. A group too large to weigh cheaply is left alone.
+Scope::~Scope() {
+    static constexpr size_t kMaxGroup = 64;
+    struct Node {
+        const void *object;
+        long count;
+        long internal;
+        bool is_live;
+    };
+    std::vector<Node> boxes;
+    std::vector<Node> procedures;
+    std::vector<Box *> box_values;
+    std::vector<const RefFunction *> procedure_values;
+    auto find = [](const std::vector<Node> &nodes, const void *object) {
+        size_t i = 0;
+        while (i < nodes.size() && nodes[i].object != object) {
+            ++i;
+        }
+        return i;
+    };
+    // Counts one reference from inside the group to the box.
+    auto refer_box = [&](const std::shared_ptr<Box> &box) {
+        size_t i = find(boxes, box.get());
+        if (i == boxes.size()) {
+            boxes.push_back({box.get(), box.use_count(), 0, false});
+            box_values.push_back(box.get());
+        }
+        ++boxes[i].internal;
+    };
+    for (const auto &slot : slots) {
+        if (slot.box != nullptr) {
+            refer_box(slot.box);
+        }
+    }
+    for (size_t box = 0, procedure = 0; box < boxes.size() || procedure < procedures.size();) {
+        if (boxes.size() + procedures.size() > kMaxGroup) {
+            return;
+        }
+        if (box < boxes.size()) {
+            const auto &value = box_values[box++]->value;
+            if (!IsRefFunction(value)) {
+                continue;
+            }
+            size_t i = find(procedures, value.get());
+            if (i == procedures.size()) {
+                procedures.push_back({value.get(), value.use_count(), 0, false});
+                procedure_values.push_back(static_cast<const RefFunction *>(value.get()));
+            }
+            ++procedures[i].internal;
+        } else {
+            for (const auto &captured : procedure_values[procedure++]->captured) {
+                refer_box(captured);
+            }
+        }
+    }
+    if (procedures.empty()) {
+        return;
+    }
+
+    std::vector<size_t> live_boxes;
+    std::vector<size_t> live_procedures;
+    auto mark = [](std::vector<Node> *nodes, size_t i, std::vector<size_t> *live) {
+        if (i < nodes->size() && !(*nodes)[i].is_live) {
+            (*nodes)[i].is_live = true;
+            live->push_back(i);
+        }
+    };
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        if (boxes[i].count > boxes[i].internal) {
+            mark(&boxes, i, &live_boxes);
+        }
+    }
+    for (size_t i = 0; i < procedures.size(); ++i) {
+        if (procedures[i].count > procedures[i].internal) {
+            mark(&procedures, i, &live_procedures);
+        }
+    }
+    while (!live_boxes.empty() || !live_procedures.empty()) {
+        if (!live_boxes.empty()) {
+            const auto &value = box_values[live_boxes.back()]->value;
+            live_boxes.pop_back();
+            mark(&procedures, find(procedures, value.get()), &live_procedures);
         } else {
-            return father->Get(name);
+            const auto *procedure = procedure_values[live_procedures.back()];
+            live_procedures.pop_back();
+            for (const auto &captured : procedure->captured) {
+                mark(&boxes, find(boxes, captured.get()), &live_boxes);
+            }
         }
     }
+
+    // Released only once nothing here is looked at any more.
+    std::vector<std::shared_ptr<Object>> garbage;
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        if (!boxes[i].is_live && box_values[i]->value != nullptr) {
+            garbage.push_back(std::move(box_values[i]->value));
+            box_values[i]->is_bound = false;
+        }
+    }
+}
+
+size_t Scope::Find(const std::string &name, size_t *hint) const {
+    if (layout == nullptr) {
+        return kNoSlot;
+    }
+    const auto &names = layout->names;
+    if (hint != nullptr && *hint < names.size() && names[*hint] == name) {
+        return *hint;
+    }
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (names[i] == name) {
+            if (hint != nullptr) {
+                *hint = i;
+            }
+            return i;
+        }
+    }
+    return kNoSlot;
 }
 
-void Scope::Set(std::string name, std::shared_ptr<Object> val) {
-    if (table.find(name) != table.end()) {
-        table[name] = val;
-    } else if (father == nullptr) {
+// A local variable that is not defined yet is looked up further, like a name the frame does
+// not have at all.
+std::shared_ptr<Object> Scope::Get(const std::string &name, size_t *hint) {
+    std::shared_ptr<Object> value;
+    if (!Lookup(name, &value, hint)) {
         throw NameError{};
+    }
+    return value;
+}
+
+bool Scope::Lookup(const std::string &name, std::shared_ptr<Object> *value, size_t *hint) {
+    for (Scope *scope = this; scope != nullptr; scope = scope->father.get()) {
+        if (scope->layout == nullptr) {
+            if (FindGlobal(*scope, name, value)) {
+                return true;
+            }
+            continue;
+        }
+        size_t index = scope->Find(name, hint);
+        if (index != kNoSlot) {
+            if (auto found = Value(&scope->slots[index])) {
+                *value = *found;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void Scope::Init(const std::string &name, std::shared_ptr<Object> val) {
+    if (layout == nullptr) {
+        if (IsCodeShared()) {
+            std::lock_guard<std::mutex> lock(table_mutex);
+            table.SetShared(name, std::move(val));
+        } else {
+            table.Set(name, std::move(val));
+        }
+        return;
+    }
+    size_t index = Find(name);
+    if (index == kNoSlot) {
+        // A definition the analysis did not see, such as one inside an if: the frame gets a
+        // layout of its own with one more slot.
+        auto extended = std::make_shared<Layout>(*layout);
+        extended->names.push_back(name);
+        layout = std::move(extended);
+        index = slots.size();
+        slots.emplace_back();
+    }
+    Slot &slot = slots[index];
+    if (slot.box != nullptr) {
+        slot.box->value = std::move(val);
+        slot.box->is_bound = true;
+    } else {
+        slot.value = std::move(val);
+        slot.is_bound = true;
+    }
+}
+
+void Scope::Set(const std::string &name, std::shared_ptr<Object> val) {
+    for (Scope *scope = this; scope != nullptr; scope = scope->father.get()) {
+        if (scope->layout == nullptr) {
+            if (!IsCodeShared()) {
+                if (scope->table.Find(name) != nullptr) {
+                    scope->table.Set(name, std::move(val));
+                    return;
+                }
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(scope->table_mutex);
+            if (scope->table.Find(name) != nullptr) {
+                scope->table.SetShared(name, std::move(val));
+                return;
+            }
+            continue;
+        }
+        size_t index = scope->Find(name);
+        if (index != kNoSlot) {
+            if (auto value = Value(&scope->slots[index])) {
+                *value = std::move(val);
+                return;
+            }
+        }
+    }
+    throw NameError{};
+}
+
+std::shared_ptr<Box> Scope::Capture(size_t index) {
+    Slot &slot = slots[index];
+    if (slot.box == nullptr) {
+        slot.box = std::make_shared<Box>(Box{std::move(slot.value), slot.is_bound});
+        slot.value = nullptr;
+    }
+    return slot.box;
+}
+
+std::shared_ptr<Scope> Scope::Fork() {
+    auto fork = std::make_shared<Scope>();
+    if (IsCodeShared()) {
+        std::lock_guard<std::mutex> lock(table_mutex);
+        fork->table = table;
     } else {
-        father->Set(name, val);
+        fork->table = table;
+    }
+    fork->father = father;
+    fork->origin = shared_from_this();
+    return fork;
+}
+
+RunningScope::RunningScope(std::shared_ptr<Scope> scope)
+    : scope_(std::move(scope)), previous_(running_scope) {
+    running_scope = &scope_;
+}
+
+RunningScope::~RunningScope() {
+    running_scope = previous_;
+}
+
+std::shared_ptr<Scope> RunningScope::Current() {
+    return running_scope == nullptr ? nullptr : *running_scope;
+}
+
+const std::shared_ptr<Scope> &ResolveGlobal(const std::shared_ptr<Scope> &global) {
+    if (running_scope == nullptr || *running_scope == nullptr ||
+        running_scope->get() == global.get()) {
+        return global;
+    }
+    for (Scope *scope = (*running_scope)->origin.get(); scope != nullptr;
+         scope = scope->origin.get()) {
+        if (scope == global.get()) {
+            return *running_scope;
+        }
     }
+    return global;
 }
@@ -1,20 +1,85 @@
 #pragma once
 
 #include <memory>
-#include <map>
+#include <mutex>
+#include <string>
 #include <vector>
 #include "exeption.h"
+#include "hamt.h"
 
 class Object;
 
-struct Scope {
+// The variables of a procedure frame: the parameters, the internal definitions and the
+// variables captured from the enclosing frame, in this order. All the frames of one closure
+// share it.
+struct Layout {
+    std::vector<std::string> names;
+    size_t param_count = 0;
+    bool has_rest = false;
+    size_t capture_start = 0;
+};
+
+// A variable captured by a closure. The frame that defined it and every closure that captured
+// it share the box, so set! is seen by all of them.
+struct Box {
+    std::shared_ptr<Object> value;
+    bool is_bound;
+};
+
+// A variable lives in its slot until a closure captures it and then moves to a box.
+struct Slot {
+    std::shared_ptr<Object> value;
+    std::shared_ptr<Box> box;
+    bool is_bound = false;
+};
+
+// The global scope keeps its variables in a table. A procedure frame keeps them in slots and
+// its father is the global scope: whatever it needs from the enclosing frames was captured
+// into the slots, so a closure keeps alive only the variables it refers to.
+struct Scope : public std::enable_shared_from_this<Scope> {
+    static constexpr size_t kNoSlot = static_cast<size_t>(-1);
+
     Scope();
-    Scope(Scope *father);
-    std::shared_ptr<Object> Get(std::string name);
-    void Init(std::string name, std::shared_ptr<Object> val) {
-        table[name] = val;
-    }
-    void Set(std::string name, std::shared_ptr<Object> val);
-    std::map<std::string, std::shared_ptr<Object>> table;
-    Scope *father;
+    Scope(std::shared_ptr<const Layout> layout, std::shared_ptr<Scope> father);
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+    ~Scope();
+    // The hint is the slot the name was found in last time; it is tried first in every frame.
+    std::shared_ptr<Object> Get(const std::string &name, size_t *hint = nullptr);
+    // Like Get, but returns whether the name is bound instead of throwing.
+    bool Lookup(const std::string &name, std::shared_ptr<Object> *value, size_t *hint = nullptr);
+    void Init(const std::string &name, std::shared_ptr<Object> val);
+    void Set(const std::string &name, std::shared_ptr<Object> val);
+    size_t Find(const std::string &name, size_t *hint = nullptr) const;
+    std::shared_ptr<Box> Capture(size_t index);
+    // A global scope with the variables of this one, which from then on changes apart from it.
+    std::shared_ptr<Scope> Fork();
+    PersistentTable table;
+    // Taken by whoever changes the table while code runs on several threads.
+    std::mutex table_mutex;
+    std::shared_ptr<Scope> father;
+    std::shared_ptr<const Layout> layout;
+    std::vector<Slot> slots;
+    // The global scope this one is a fork of, if it is one.
+    std::shared_ptr<Scope> origin;
 };
+
+// Makes scope the global scope of the program that runs on this thread while it lives.
+class RunningScope {
+public:
+    explicit RunningScope(std::shared_ptr<Scope> scope);
+    RunningScope(const RunningScope &) = delete;
+    RunningScope &operator=(const RunningScope &) = delete;
+    ~RunningScope();
+    // The running global scope, or null, for tasks to take along to other threads.
+    static std::shared_ptr<Scope> Current();
+
+private:
+    std::shared_ptr<Scope> scope_;
+    const std::shared_ptr<Scope> *previous_;
+};
+
+// The global scope a procedure made in global runs in: the running one when it is a fork of
+// global, so that a fork runs the procedures it shares with its origin on its own variables,
+// and global itself otherwise.
+const std::shared_ptr<Scope> &ResolveGlobal(const std::shared_ptr<Scope> &global);
@@ -0,0 +1,305 @@
+#include "serve.h"
+#include "scheme.h"
+#include "pool.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+bool MakeNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+struct Request {
+    std::string line;
+    Clock::time_point arrival;
+};
+
+class Session {
+public:
+    Session(int fd, int epoll_fd, const std::shared_ptr<Scope> &prelude)
+        : fd_(fd), epoll_fd_(epoll_fd), compilation_(prelude) {
+    }
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+    ~Session() {
+        close(fd_);
+    }
+
+    // Called by the reading thread with what came from the socket; the complete lines are
+    // queued. At the end of the input the last line counts even without its newline.
+    // Returns whether the session has to be scheduled.
+    bool Receive(const char *data, size_t size, bool is_end) {
+        auto now = Clock::now();
+        input_.append(data, size);
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t start = 0;
+        for (size_t end; (end = input_.find('\n', start)) != std::string::npos; start = end + 1) {
+            Queue(input_.substr(start, end - start), now);
+        }
+        input_.erase(0, start);
+        if (is_end) {
+            Queue(std::move(input_), now);
+            input_.clear();
+            is_closing_ = true;
+        }
+        if (requests_.empty() || is_busy_) {
+            return false;
+        }
+        is_busy_ = true;
+        return true;
+    }
+
+    // Evaluates the queued requests until there are none left.
+    void Serve() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!requests_.empty()) {
+            auto request = std::move(requests_.front());
+            requests_.pop_front();
+            lock.unlock();
+            std::string response = Evaluate(request);
+            lock.lock();
+            output_ += response;
+            Flush();
+        }
+        is_busy_ = false;
+        if (is_closing_) {
+            Watch(true);
+        }
+    }
+
+    // Called by the reading thread when the socket can take more. Returns whether the client
+    // has stopped sending and got all its answers, so that the session can go.
+    bool OnWritable() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Flush();
+        return is_closing_ && !is_busy_ && output_.empty();
+    }
+
+    // Only the reading thread changes it.
+    bool IsClosing() const {
+        return is_closing_;
+    }
+
+private:
+    void Queue(std::string line, Clock::time_point arrival) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.find_first_not_of(" \t") != std::string::npos) {
+            requests_.push_back({std::move(line), arrival});
+        }
+    }
+
+    std::string Evaluate(const Request &request) {
+        std::string value;
+        const char *error = nullptr;
+        try {
+            compilation_.Build(request.line, &value);
+        } catch (const SyntaxError &) {
+            error = "syntax";
+        } catch (const NameError &) {
+            error = "name";
+        } catch (const RuntimeError &) {
+            error = "runtime";
+        } catch (...) {
+            // Whatever else a request throws ends only the request, never the server.
+            error = "runtime";
+        }
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                                            request.arrival);
+        std::string response = error == nullptr ? "ok " : "error ";
+        response += std::to_string(micros.count());
+        response += ' ';
+        response += error == nullptr ? value : error;
+        response += '\n';
+        return response;
+    }
+
+    // Writes as much as the socket takes and asks for a wakeup for the rest.
+    void Flush() {
+        while (!output_.empty()) {
+            ssize_t written = send(fd_, output_.data(), output_.size(), MSG_NOSIGNAL);
+            if (written > 0) {
+                output_.erase(0, written);
+                continue;
+            }
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                Watch(true);
+                return;
+            }
+            // The client is gone.
+            output_.clear();
+        }
+        Watch(false);
+    }
+
+    // A client that has stopped sending is watched only for writing, one wakeup at a time, so
+    // that the reading thread writes out its last answers whenever the client takes them and
+    // then lets the session go; no thread ever waits for a client that does not read.
+    void Watch(bool is_writing) {
+        epoll_event event{};
+        event.data.fd = fd_;
+        if (is_closing_) {
+            if (is_busy_ && !is_writing) {
+                // Serve asks once it has answered everything.
+                return;
+            }
+            event.events = EPOLLOUT | EPOLLONESHOT;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd_, &event);
+            return;
+        }
+        if (is_writing == is_watching_writes_) {
+            return;
+        }
+        event.events = EPOLLIN;
+        if (is_writing) {
+            event.events |= EPOLLOUT;
+        }
+        epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd_, &event);
+        is_watching_writes_ = is_writing;
+    }
+
+    int fd_;
+    int epoll_fd_;
+    // Only the thread that serves the session uses it.
+    Compilation compilation_;
+    // Only the reading thread uses it.
+    std::string input_;
+    std::mutex mutex_;
+    std::deque<Request> requests_;
+    std::string output_;
+    bool is_busy_ = false;
+    bool is_closing_ = false;
+    bool is_watching_writes_ = false;
+};
+}  // namespace
+
+int Listen(const std::string &path) {
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0 || !MakeNonBlocking(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void Serve(int listen_fd, size_t threads, const std::shared_ptr<Scope> &prelude, bool is_worker,
+           const std::atomic<bool> &is_stopping) {
+    int epoll_fd = epoll_create1(0);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    if (is_worker) {
+        event.events |= EPOLLEXCLUSIVE;
+    }
+    event.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+    // The sessions that are still being served use the epoll set until the pool is gone.
+    {
+        WorkStealingPool pool(threads);
+        auto schedule = [&pool](const std::shared_ptr<Session> &session) {
+            if (pool.WorkerCount() == 0) {
+                session->Serve();
+            } else {
+                pool.Submit([session] { session->Serve(); });
+            }
+        };
+        std::unordered_map<int, std::shared_ptr<Session>> sessions;
+        auto drop = [&](int fd) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+            sessions.erase(fd);
+        };
+        std::vector<epoll_event> events(64);
+        std::vector<char> buffer(1 << 16);
+        while (!is_stopping) {
+            int count = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            for (int i = 0; i < count; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listen_fd) {
+                    int client;
+                    while ((client = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+                        epoll_event client_event{};
+                        client_event.events = EPOLLIN;
+                        client_event.data.fd = client;
+                        sessions[client] = std::make_shared<Session>(client, epoll_fd, prelude);
+                        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &client_event);
+                    }
+                    continue;
+                }
+                auto it = sessions.find(fd);
+                if (it == sessions.end()) {
+                    continue;
+                }
+                auto session = it->second;
+                if (session->IsClosing()) {
+                    if (session->OnWritable()) {
+                        drop(fd);
+                    }
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    session->OnWritable();
+                }
+                if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    continue;
+                }
+                bool is_end = false;
+                while (true) {
+                    ssize_t size = read(fd, buffer.data(), buffer.size());
+                    if (size > 0) {
+                        if (session->Receive(buffer.data(), size, false)) {
+                            schedule(session);
+                        }
+                        continue;
+                    }
+                    if (size < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    is_end = size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                    break;
+                }
+                if (is_end) {
+                    if (session->Receive(nullptr, 0, true)) {
+                        schedule(session);
+                    }
+                    if (session->OnWritable()) {
+                        drop(fd);
+                    }
+                }
+            }
+        }
+    }
+    close(epoll_fd);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "scope.h"
+#include <atomic>
+
+// Requests of any number of clients that connect to a Unix socket. Every line a client sends
+// is a datum to evaluate in the session of that client, which has a Compilation of its own for
+// as long as the connection lasts, and is answered with one line that gives the time from
+// reading the request to answering it:
+//   ok <microseconds> <value>
+//   error <microseconds> syntax|name|runtime
+// One thread reads all the sockets with epoll; the requests are evaluated on a fixed pool of
+// threads, those of one session one after another in the order they came. Every session sees
+// the definitions of the prelude, if there is one, and defines and assigns its own copies of
+// them.
+
+// A non-blocking socket listening at path, or -1.
+int Listen(const std::string &path);
+
+// Serves the clients that connect to listen_fd until is_stopping is set and the reading thread
+// wakes up, for a signal or a connection. Sessions are served on the reading thread itself when
+// there are no threads for them. Only one of several workers that serve the same socket is woken
+// up for a connection.
+void Serve(int listen_fd, size_t threads, const std::shared_ptr<Scope> &prelude, bool is_worker,
+           const std::atomic<bool> &is_stopping);
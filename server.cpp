@@ -0,0 +1,153 @@
+#include "scheme.h"
+#include "isolate.h"
+#include "pool.h"
+#include "serve.h"
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// scheme-server socket-path [-t threads] [--prelude file.scm [--workers n]]: serves the
+// requests of the clients that connect to a Unix socket, as Serve describes, on that many
+// threads.
+//
+// The definitions of a prelude are loaded once and the global scope of every session is a
+// fork of the prelude scope. With --workers the server forks that many processes after loading
+// it, which share its pages copy-on-write and take turns accepting connections; each serves
+// its sessions on its one thread.
+
+namespace {
+std::atomic<bool> is_stopping{false};
+
+void Stop(int) {
+    is_stopping = true;
+}
+
+// The prelude is loaded on a thread of its own, which makes glibc put its objects in an arena
+// of that thread. The workers allocate on their main threads, from the main arena, so they
+// never fill the holes between prelude objects and their pages stay shared; what a worker
+// still copies are the pages whose reference counts it changes by using the objects there.
+std::unique_ptr<Compilation> LoadPrelude(const std::string &path) {
+    std::unique_ptr<Compilation> prelude;
+    const char *error = nullptr;
+    std::thread loader([&] {
+        std::ifstream in(path);
+        if (!in) {
+            error = "cannot open file";
+            return;
+        }
+        try {
+            auto compilation = std::make_unique<Compilation>();
+            compilation->Build(&in, nullptr);
+            prelude = std::move(compilation);
+        } catch (const SyntaxError &) {
+            error = "syntax error";
+        } catch (const NameError &) {
+            error = "name error";
+        } catch (...) {
+            error = "runtime error";
+        }
+    });
+    loader.join();
+    if (error != nullptr) {
+        std::cerr << path << ": " << error << "\n";
+    }
+    return prelude;
+}
+
+pid_t StartWorker(int listen_fd, const std::shared_ptr<Scope> &prelude) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        Serve(listen_fd, 0, prelude, true, is_stopping);
+        _exit(0);
+    }
+    return pid;
+}
+
+// Starts the workers again when they die, until the server is stopped.
+void Supervise(int listen_fd, const std::shared_ptr<Scope> &prelude, size_t count) {
+    std::vector<pid_t> workers;
+    for (size_t i = 0; i < count; ++i) {
+        workers.push_back(StartWorker(listen_fd, prelude));
+    }
+    while (!is_stopping) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (auto &worker : workers) {
+            if (worker == pid && !is_stopping) {
+                worker = StartWorker(listen_fd, prelude);
+            }
+        }
+    }
+    for (pid_t worker : workers) {
+        kill(worker, SIGTERM);
+    }
+    while (wait(nullptr) > 0 || errno == EINTR) {
+    }
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+    IsolateGuard isolates;
+    std::string path;
+    std::string prelude_path;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t workers = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "-t" || arg == "--threads") && i + 1 < argc) {
+            threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--prelude" && i + 1 < argc) {
+            prelude_path = argv[++i];
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workers = std::max(0, std::atoi(argv[++i]));
+        } else {
+            path = arg;
+        }
+    }
+    if (path.empty() || (workers > 0 && prelude_path.empty())) {
+        std::cerr << "usage: scheme-server socket-path [-t threads] "
+                     "[--prelude file.scm [--workers n]]\n";
+        return 1;
+    }
+    std::unique_ptr<Compilation> prelude;
+    if (!prelude_path.empty() && (prelude = LoadPrelude(prelude_path)) == nullptr) {
+        return 1;
+    }
+    auto prelude_scope = prelude != nullptr ? prelude->scope : nullptr;
+    int listen_fd = Listen(path);
+    if (listen_fd < 0) {
+        std::cerr << path << ": cannot listen: " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    // Without SA_RESTART, so that a signal interrupts the wait for the workers too.
+    struct sigaction stop{};
+    stop.sa_handler = Stop;
+    sigaction(SIGINT, &stop, nullptr);
+    sigaction(SIGTERM, &stop, nullptr);
+    std::signal(SIGPIPE, SIG_IGN);
+    if (workers > 0) {
+        Supervise(listen_fd, prelude_scope, workers);
+    } else {
+        // Sessions on several threads run the code of the prelude at the same time, so its
+        // forms are rewritten once for all of them.
+        std::unique_ptr<SharedCodeScope> shared;
+        if (prelude != nullptr && threads > 1) {
+            shared = std::make_unique<SharedCodeScope>();
+        }
+        Serve(listen_fd, threads, prelude_scope, false, is_stopping);
+    }
+    close(listen_fd);
+    unlink(path.c_str());
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include "object.h"
+#include "pool.h"
+#include <algorithm>
+
+namespace {
+using Item = std::shared_ptr<Object>;
+
+// Lists at least this long are sorted on several threads when no procedure is called.
+constexpr size_t kParallelThreshold = 1 << 15;
+
+template <class Less>
+void Merge(Item *first, Item *middle, Item *last, Item *out, const Less &less) {
+    Item *left = first;
+    Item *right = middle;
+    while (left != middle && right != last) {
+        // Ties take the left element, which keeps the sort stable.
+        if (less(*right, *left)) {
+            *out++ = std::move(*right++);
+        } else {
+            *out++ = std::move(*left++);
+        }
+    }
+    out = std::move(left, middle, out);
+    std::move(right, last, out);
+}
+
+// Bottom-up merge sort of items whose runs of run_length elements are sorted already.
+template <class Less>
+void MergeRuns(Item *items, size_t count, size_t run_length, const Less &less) {
+    std::vector<Item> buffer(count);
+    Item *from = items;
+    Item *to = buffer.data();
+    for (size_t width = run_length; width < count; width *= 2) {
+        for (size_t low = 0; low < count; low += 2 * width) {
+            size_t middle = std::min(low + width, count);
+            size_t high = std::min(low + 2 * width, count);
+            Merge(from + low, from + middle, from + high, to + low, less);
+        }
+        std::swap(from, to);
+    }
+    if (from != items) {
+        std::move(from, from + count, items);
+    }
+}
+
+// The chunks are sorted on the threads of the work-stealing pool, so -j bounds them too.
+template <class Less>
+void ParallelSort(std::vector<Item> *items, const Less &less) {
+    size_t count = items->size();
+    auto &pool = WorkStealingPool::Instance();
+    size_t threads = pool.WorkerCount() + 1;
+    if (count < kParallelThreshold || threads == 1) {
+        MergeRuns(items->data(), count, 1, less);
+        return;
+    }
+    size_t chunk = (count + threads - 1) / threads;
+    TaskGroup group(&pool);
+    for (size_t begin = 0; begin < count; begin += chunk) {
+        size_t size = std::min(chunk, count - begin);
+        group.Run([items, begin, size, &less] {
+            MergeRuns(items->data() + begin, size, 1, less);
+        });
+    }
+    group.Wait();
+    MergeRuns(items->data(), count, chunk, less);
+}
+
+bool IsNumberList(const std::vector<Item> &items) {
+    for (const auto &item : items) {
+        if (!IsNumber(item)) {
+            return false;
+        }
+    }
+    return true;
+}
+}  // namespace
+
+std::shared_ptr<Object> Sort::Apply(const std::vector<std::shared_ptr<Object>> &args) {
+    if (args.size() != 2) {
+        throw RuntimeError{};
+    }
+    const auto &list = args[is_procedure_first_ ? 1 : 0];
+    const auto &less = args[is_procedure_first_ ? 0 : 1];
+    if (!IsFunction(less)) {
+        throw RuntimeError{};
+    }
+    std::vector<Item> items;
+    auto rest = list;
+    for (; IsCell(rest); rest = AsCell(rest)->GetSecond()) {
+        items.push_back(AsCell(rest)->GetFirst());
+    }
+    if (rest != nullptr) {
+        throw RuntimeError{};
+    }
+    bool is_less = dynamic_cast<Less *>(less.get()) != nullptr;
+    bool is_more = dynamic_cast<More *>(less.get()) != nullptr;
+    if ((is_less || is_more) && IsNumberList(items)) {
+        auto value = [](const Item &item) { return static_cast<Number *>(item.get())->GetValue(); };
+        if (is_less) {
+            ParallelSort(&items, [&value](const Item &a, const Item &b) {
+                return value(a) < value(b);
+            });
+        } else {
+            ParallelSort(&items, [&value](const Item &a, const Item &b) {
+                return value(a) > value(b);
+            });
+        }
+    } else {
+        // The procedure is called on this thread only, since evaluation is not thread-safe.
+        std::vector<Item> pair(2);
+        MergeRuns(items.data(), items.size(), 1, [&less, &pair](const Item &a, const Item &b) {
+            pair[0] = a;
+            pair[1] = b;
+            return !IsFalse(CallProcedure(less, pair));
+        });
+    }
+    if (is_in_place_) {
+        auto cell = list;
+        for (auto &item : items) {
+            AsCell(cell)->SetFirst(std::move(item));
+            cell = AsCell(cell)->GetSecond();
+        }
+        return list;
+    }
+    ListBuilder result;
+    for (auto &item : items) {
+        result.Add(std::move(item));
+    }
+    return result.Finish();
+}
@@ -12,6 +12,13 @@ struct SchemeTest {
         REQUIRE(my_result == result);
     }
 
+    void ExpectStreamEq(std::string program, std::string output) {
+        std::stringstream in{program};
+        std::stringstream out;
+        compilation.Build(&in, &out);
+        REQUIRE(out.str() == output);
+    }
+
     void ExpectNoError(std::string expression) {
         compilation.Build(expression);
     }
@@ -1,4 +1,7 @@
 #include <test/scheme_test.h>
+#include "isolate.h"
+#include <iostream>
+#include <sstream>
 
 TEST_CASE_METHOD(SchemeTest, "IfReturnValue") {
     ExpectEq("(if #t 0)", "0");
@@ -21,3 +24,220 @@ TEST_CASE_METHOD(SchemeTest, "IfSyntax") {
     ExpectSyntaxError("(if)");
     ExpectSyntaxError("(if 1 2 3 4)");
 }
+
+TEST_CASE_METHOD(SchemeTest, "CallCCEscape") {
+    ExpectEq("(call/cc (lambda (k) (+ 1 (k 42))))", "42");
+    ExpectEq("(+ 1 (call/cc (lambda (k) 1)))", "2");
+    ExpectEq("(+ 1 (call-with-current-continuation (lambda (k) (* 2 (k 5)))))", "6");
+
+    ExpectNoError(
+        "(define (find-first pred lst)"
+        "  (call/cc (lambda (return)"
+        "    (define (walk l)"
+        "      (if (null? l) #f (if (pred (car l)) (return (car l)) (walk (cdr l)))))"
+        "    (walk lst))))");
+    ExpectEq("(find-first (lambda (x) (> x 2)) '(1 2 3 4))", "3");
+    ExpectEq("(find-first (lambda (x) (> x 5)) '(1 2 3 4))", "#f");
+
+    ExpectRuntimeError("(call/cc)");
+    ExpectRuntimeError("(call/cc 1)");
+    ExpectRuntimeError("(call/cc (lambda (k) (k 1 2)))");
+}
+
+TEST_CASE_METHOD(SchemeTest, "CallCCReentry") {
+    ExpectNoError("(define r #f)");
+    ExpectEq("(+ 100 (call/cc (lambda (k) (set! r k) 1)))", "101");
+    ExpectEq("(r 5)", "105");
+    ExpectEq("(r 7)", "107");
+
+    ExpectNoError("(define n 0)");
+    ExpectNoError(
+        "(define (loop)"
+        "  (define k (call/cc (lambda (c) c)))"
+        "  (set! n (+ n 1))"
+        "  (if (< n 4) (k k) n))");
+    ExpectEq("(loop)", "4");
+}
+
+TEST_CASE_METHOD(SchemeTest, "Begin") {
+    ExpectEq("(begin 1 2 3)", "3");
+    ExpectNoError("(begin (define x 1) (define y (+ x 1)))");
+    ExpectEq("y", "2");
+    ExpectNoError("(define (f) (begin (define z 5)) (+ z 1))");
+    ExpectEq("(f)", "6");
+    ExpectSyntaxError("(begin)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "Cond") {
+    ExpectNoError("(define (sign x) (cond ((< x 0) -1) ((= x 0) 0) (else 1)))");
+    ExpectEq("(sign -5)", "-1");
+    ExpectEq("(sign 0)", "0");
+    ExpectEq("(sign 7)", "1");
+
+    ExpectEq("(cond (#f 1))", "()");
+    ExpectEq("(cond (5))", "5");
+    ExpectEq("(cond ((car '(1 2)) => (lambda (x) (+ x 10))))", "11");
+    ExpectEq("(cond (1 2 3))", "3");
+
+    ExpectSyntaxError("(cond (else 1) (#t 2))");
+    ExpectSyntaxError("(cond 1)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "WhenUnless") {
+    ExpectEq("(when (= 1 1) 2 3)", "3");
+    ExpectEq("(when (= 1 2) 2 3)", "()");
+    ExpectEq("(unless (= 1 2) 4)", "4");
+    ExpectEq("(unless (= 1 1) 4)", "()");
+    ExpectSyntaxError("(when #t)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "NamedLet") {
+    ExpectEq("(let loop ((i 0) (acc 0)) (if (= i 100000) acc (loop (+ i 1) (+ acc 2))))",
+             "200000");
+    ExpectEq(
+        "(let loop ((i 5) (acc '()))"
+        "  (cond ((= i 0) acc)"
+        "        (else (let ((j (- i 1))) (loop j (cons i acc))))))",
+        "(1 2 3 4 5)");
+
+    // Not a tail call: the loop is a procedure.
+    ExpectEq("(let f ((n 5)) (if (= n 0) 1 (* n (f (- n 1)))))", "120");
+    ExpectEq("(let f ((n 3)) (if (= n 0) f 0))", "0");
+
+    // Every iteration has its own variables.
+    ExpectNoError("(define saved '())");
+    ExpectNoError(
+        "(let loop ((i 0))"
+        "  (when (< i 3) (set! saved (cons (lambda () i) saved)) (loop (+ i 1))))");
+    ExpectEq("(list ((car saved)) ((car (cdr saved))) ((car (cdr (cdr saved)))))", "(2 1 0)");
+
+    ExpectRuntimeError("(let loop ((i 0)) (if (= i 0) (loop 1 2) i))");
+    ExpectSyntaxError("(let loop ((i)) i)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "DoLoop") {
+    ExpectEq("(do ((i 0 (+ i 1)) (acc 0 (+ acc i))) ((= i 10000) acc))", "49995000");
+    ExpectEq("(do ((i 0 (+ i 1)) (acc '() (cons i acc))) ((= i 3) acc))", "(2 1 0)");
+
+    ExpectNoError("(define n 0)");
+    ExpectEq("(do ((i 0 (+ i 1))) ((= i 4)) (set! n (+ n i)))", "()");
+    ExpectEq("n", "6");
+    ExpectEq("(do ((x 7)) (#t x))", "7");
+
+    ExpectSyntaxError("(do ((i 0 1 2)) (#t))");
+    ExpectSyntaxError("(do ((i 0)) 5)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "GreenThreads") {
+    ExpectNoError("(define ch (make-channel))");
+    ExpectNoError("(define log '())");
+    ExpectNoError(
+        "(define (worker name n) (lambda () (do ((i 0 (+ i 1))) ((= i n)) "
+        "(set! log (cons (list name i) log)) (yield))))");
+    // Threads run once the form that spawned them is done, taking turns at every yield.
+    ExpectNoError("(begin (spawn (worker 'a 2)) (spawn (worker 'b 2)))");
+    ExpectEq("log", "((b 1) (a 1) (b 0) (a 0))");
+
+    // A receiver waits for its value; the main program runs the others while it waits.
+    ExpectNoError("(spawn (lambda () (channel-send ch (* 2 (channel-receive ch)))))");
+    ExpectNoError("(channel-send ch 21)");
+    ExpectEq("(channel-receive ch)", "42");
+    ExpectRuntimeError("(channel-receive ch)");
+    ExpectRuntimeError("(channel-send 1 2)");
+
+    // A pipeline of actors that pass a token around a ring.
+    ExpectNoError(
+        "(define (ring size laps) (let* ((first (make-channel)) (last "
+        "(do ((i 1 (+ i 1)) (in first (let ((out (make-channel))) "
+        "(spawn (let ((from in)) (lambda () (do ((k 0 (+ k 1))) ((= k laps)) "
+        "(channel-send out (+ 1 (channel-receive from))))))) out))) "
+        "((= i size) in)))) "
+        "(do ((k 0 (+ k 1)) (token 0 (channel-receive last))) ((= k laps) token) "
+        "(channel-send first token))))");
+    ExpectEq("(ring 1000 3)", "2997");
+
+    // Threads that never yield are stopped at the end of their slices.
+    ExpectNoError("(define done '())");
+    ExpectNoError(
+        "(define (spin name n) (lambda () (let loop ((i 0)) (if (< i n) (loop (+ i 1)) "
+        "(set! done (cons name done))))))");
+    ExpectNoError("(begin (spawn (spin 'long 100000)) (spawn (spin 'short 10)))");
+    ExpectEq("done", "(long short)");
+
+    // An error ends only its own thread and is reported.
+    std::ostringstream errors;
+    auto *cerr_buffer = std::cerr.rdbuf(errors.rdbuf());
+    ExpectNoError("(spawn (lambda () (car '())))");
+    std::cerr.rdbuf(cerr_buffer);
+    REQUIRE(errors.str() == "green thread: runtime error\n");
+    ExpectNoError("(spawn (lambda () (channel-send ch 'alive)))");
+    ExpectEq("(channel-receive ch)", "alive");
+
+    // The continuation of a parked thread is not part of the main program.
+    ExpectNoError("(define k #f)");
+    ExpectNoError(
+        "(spawn (lambda () (call/cc (lambda (c) (set! k c) (channel-receive ch)))))");
+    ExpectRuntimeError("(k 1)");
+    ExpectNoError("(channel-send ch 'done)");
+
+    // A thread whose last call waits for a channel finishes once it gets its value.
+    errors.str("");
+    cerr_buffer = std::cerr.rdbuf(errors.rdbuf());
+    ExpectNoError("(define got '())");
+    ExpectNoError("(spawn (lambda () (set! got (cons 'first got)) (channel-receive ch)))");
+    ExpectNoError("(channel-send ch 'a)");
+    ExpectNoError("(yield)");
+    ExpectNoError("(define shared (make-shared-channel))");
+    ExpectNoError("(spawn (lambda () (channel-receive shared)))");
+    ExpectNoError("(spawn (lambda () (set! got (cons (channel-receive shared) got))))");
+    ExpectNoError("(channel-send shared 'kept)");
+    ExpectNoError("(yield)");
+    ExpectNoError("(channel-send shared 'second)");
+    ExpectNoError("(yield)");
+    std::cerr.rdbuf(cerr_buffer);
+    REQUIRE(errors.str().empty());
+    ExpectEq("(length got)", "2");
+}
+
+TEST_CASE_METHOD(SchemeTest, "Isolates") {
+    ExpectEq("(isolate-wait (isolate '(lambda (x y) (list x (+ y 1))) 'a 41))", "(a 42)");
+    // The isolate has globals of its own.
+    ExpectNoError("(define secret 1)");
+    ExpectNameError("(isolate-wait (isolate '(lambda () secret)))");
+    ExpectNoError("(isolate-wait (isolate '(lambda () (define secret 2))))");
+    ExpectEq("secret", "1");
+    ExpectRuntimeError("(isolate-wait (isolate '(lambda () (car '()))))");
+    ExpectRuntimeError("(isolate '(lambda (f) (f)) car)");
+
+    // Isolates that never end are cancelled when the program stops them.
+    ExpectNoError("(define forever (isolate '(lambda () (let loop () (loop)))))");
+    ExpectNoError(
+        "(define blocked (isolate '(lambda (c) (channel-receive c)) (make-shared-channel)))");
+    StopIsolates();
+    ExpectRuntimeError("(isolate-wait forever)");
+    ExpectRuntimeError("(isolate-wait blocked)");
+    ExpectEq("(isolate-wait (isolate '(lambda () 'later)))", "later");
+
+    // A pipeline of isolates joined by shared channels.
+    ExpectNoError("(define in (make-shared-channel 4))");
+    ExpectNoError("(define out (make-shared-channel 4))");
+    ExpectNoError(
+        "(define stage '(lambda (in out) (let loop () (let ((x (channel-receive in))) "
+        "(channel-send out (if (number? x) (* x x) x)) (if (number? x) (loop) 'done)))))");
+    ExpectNoError("(define worker (isolate stage in out))");
+    ExpectNoError(
+        "(define (feed n) (do ((i 0 (+ i 1))) ((= i n) (channel-send in 'end)) "
+        "(channel-send in i)))");
+    ExpectNoError("(spawn (lambda () (feed 100)))");
+    ExpectNoError(
+        "(define (drain acc) (let ((x (channel-receive out))) "
+        "(if (number? x) (drain (+ acc x)) acc)))");
+    ExpectEq("(drain 0)", "328350");
+    ExpectEq("(isolate-wait worker)", "done");
+
+    ExpectNoError("(define box (make-shared-channel))");
+    ExpectNoError("(define sent '(1 (2 #t) . x))");
+    ExpectNoError("(channel-send box sent)");
+    ExpectEq("(equal? (channel-receive box) sent)", "#t");
+    ExpectRuntimeError("(channel-send box car)");
+}
@@ -1,6 +1,134 @@
 #include <test/scheme_test.h>
+#include <cstdio>
+#include <fstream>
 
 TEST_CASE_METHOD(SchemeTest, "Quote") {
     ExpectEq("(quote (1 2))", "(1 2)");
     ExpectEq("'(1 2)", "(1 2)");
 }
+
+TEST_CASE_METHOD(SchemeTest, "Quasiquote") {
+    ExpectNoError("(define x 5)");
+    ExpectNoError("(define xs '(1 2))");
+    ExpectEq("`(a b)", "(a b)");
+    ExpectEq("`(a ,x)", "(a 5)");
+    ExpectEq("(quasiquote (a (unquote (+ x 1))))", "(a 6)");
+    ExpectEq("`(0 ,@xs 3)", "(0 1 2 3)");
+    ExpectEq("`(,@xs)", "(1 2)");
+    ExpectEq("`(a . ,x)", "(a . 5)");
+    ExpectEq("`((a ,x) (b c))", "((a 5) (b c))");
+    ExpectEq("`(1 `(2 ,(3 ,x)))", "(1 (quasiquote (2 (unquote (3 5)))))");
+    ExpectEq("`,x", "5");
+
+    ExpectNoError("(define (f y) `(y ,y (z ,@(list y y))))");
+    ExpectEq("(f 1)", "(y 1 (z 1 1))");
+    ExpectEq("(f 2)", "(y 2 (z 2 2))");
+    ExpectNoError("(define (tail y) `(,y c d))");
+    ExpectEq("(tail 1)", "(1 c d)");
+    ExpectEq("(tail 2)", "(2 c d)");
+
+    ExpectSyntaxError("`,@xs");
+    ExpectSyntaxError(",x");
+}
+
+TEST_CASE_METHOD(SchemeTest, "StreamOfDatums") {
+    ExpectStreamEq("(define x 5) (+ x\n 1)\n'(1 ; comment\n 2)\n", "()\n6\n(1 2)\n");
+    ExpectStreamEq("'a 'b\n\n'c", "a\nb\nc\n");
+}
+
+TEST_CASE_METHOD(SchemeTest, "Prelude") {
+    ExpectNoError("(define (h) 5)");
+    Compilation session(compilation.scope);
+    session.Build("(define (f) 1)");
+    session.Build("(define (g) (+ (h) (f)))");
+    REQUIRE(session.Build("(g)") == "6");
+    REQUIRE_THROWS_AS(compilation.Build("(g)"), NameError);
+}
+
+TEST_CASE_METHOD(SchemeTest, "HeapImage") {
+    ExpectNoError("(define base 10)");
+    ExpectNoError("(define (add-base x) (+ x base))");
+    ExpectNoError("(define (make-counter) (let ((n 0)) (lambda () (set! n (+ n 1)) n)))");
+    ExpectNoError("(define counter (make-counter))");
+    ExpectEq("(counter)", "1");
+    ExpectNoError("(define (count-to n) (let loop ((i 0)) (if (= i n) i (loop (+ i 1)))))");
+    ExpectEq("(count-to 5)", "5");
+    ExpectNoError("(define (squares xs) (fold + 0 (map (lambda (x) (* x x)) xs)))");
+    ExpectEq("(squares '(1 2 3))", "14");
+    ExpectNoError(
+        "(define-syntax swap! "
+        "  (syntax-rules () ((_ a b) (let ((tmp a)) (set! a b) (set! b tmp)))))");
+    ExpectNoError("(define data '(1 (2 #t) x))");
+    ExpectNoError("(save-image \"scheme_test.img\")");
+
+    Compilation loaded;
+    LoadImage("scheme_test.img", loaded.scope);
+    std::remove("scheme_test.img");
+    REQUIRE(loaded.Build("(counter)") == "2");
+    REQUIRE(loaded.Build("(counter)") == "3");
+    REQUIRE(loaded.Build("(add-base 1)") == "11");
+    loaded.Build("(define base 20)");
+    REQUIRE(loaded.Build("(add-base 1)") == "21");
+    REQUIRE(loaded.Build("(count-to 100)") == "100");
+    REQUIRE(loaded.Build("(squares '(1 2 3 4))") == "30");
+    REQUIRE(loaded.Build("data") == "(1 (2 #t) x)");
+    loaded.Build("(define p 1)");
+    loaded.Build("(define q 2)");
+    loaded.Build("(swap! p q)");
+    REQUIRE(loaded.Build("(list p q)") == "(2 1)");
+    REQUIRE(loaded.Build("(car data)") == "1");
+    // The image is a copy: the saved program goes on from where it was.
+    ExpectEq("(counter)", "2");
+
+    ExpectNoError("(define k (call/cc (lambda (k) k)))");
+    ExpectRuntimeError("(save-image \"scheme_test.img\")");
+    ExpectSyntaxError("(save-image)");
+    // The closing quote is missing before the end of the line or of the input.
+    ExpectSyntaxError("(save-image \"scheme_test.img)");
+    ExpectSyntaxError("(save-image \"scheme_test.img\n\")");
+    REQUIRE_THROWS_AS(LoadImage("scheme_test.img", loaded.scope), RuntimeError);
+    std::ofstream("scheme_test.img") << "(define x 1)";
+    REQUIRE_THROWS_AS(LoadImage("scheme_test.img", loaded.scope), RuntimeError);
+    std::remove("scheme_test.img");
+}
+
+TEST_CASE_METHOD(SchemeTest, "Fork") {
+    ExpectNoError("(define x 1)");
+    ExpectNoError("(define (get-x) x)");
+    ExpectNoError("(define (set-x! v) (set! x v))");
+    ExpectNoError("(define (double) (* 2 (get-x)))");
+    ExpectNoError("(define (add-x i) (+ i x))");
+    for (int i = 0; i < 1000; ++i) {
+        ExpectNoError("(define v" + std::to_string(i) + " " + std::to_string(i) + ")");
+    }
+    auto fork = compilation.Fork();
+    REQUIRE(fork->Build("(double)") == "2");
+    fork->Build("(set-x! 5)");
+    REQUIRE(fork->Build("(double)") == "10");
+    ExpectEq("(double)", "2");
+    // The procedures of the origin run on the variables of the fork, builtins and other
+    // threads calling them included.
+    REQUIRE(fork->Build("(map add-x '(1 2))") == "(6 7)");
+    REQUIRE(fork->Build("(pmap add-x '(1 2 3))") == "(6 7 8)");
+    REQUIRE(fork->Build("(touch (future (add-x 1)))") == "6");
+    ExpectEq("(map add-x '(1 2))", "(2 3)");
+    fork->Build("(define (get-x) 7)");
+    REQUIRE(fork->Build("(double)") == "14");
+    ExpectEq("(double)", "2");
+
+    fork->Build("(define y 3)");
+    ExpectNameError("y");
+    ExpectNoError("(define z 4)");
+    REQUIRE_THROWS_AS(fork->Build("z"), NameError);
+    REQUIRE(fork->Build("(+ v0 v999)") == "999");
+
+    auto nested = fork->Fork();
+    nested->Build("(set! v500 0)");
+    REQUIRE(nested->Build("v500") == "0");
+    REQUIRE(fork->Build("v500") == "500");
+    ExpectEq("v500", "500");
+    REQUIRE(nested->Build("(double)") == "14");
+    nested.reset();
+    fork.reset();
+    ExpectEq("(+ (double) v999)", "1001");
+}
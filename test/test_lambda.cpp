@@ -50,4 +50,166 @@ TEST_CASE_METHOD(SchemeTest, "DefineLambdaSugar") {
 
     ExpectNoError("(define (zero) 0)");
     ExpectEq("(zero)", "0");
-}
\ No newline at end of file
+}
+TEST_CASE_METHOD(SchemeTest, "EveryCallHasItsOwnFrame") {
+    ExpectNoError("(define (sum n) (if (= n 0) 0 (+ (sum (- n 1)) n)))");
+    ExpectEq("(sum 10)", "55");
+
+    ExpectNoError("(define (rest . xs) xs)");
+    ExpectEq("(rest 1 2 3)", "(1 2 3)");
+    ExpectRuntimeError("(sum 1 2)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "DeepNonTailRecursion") {
+    ExpectNoError("(define (count n) (if (= n 0) 0 (+ 1 (count (- n 1)))))");
+    ExpectEq("(count 100000)", "100000");
+
+    ExpectNoError("(define (build n) (if (= n 0) '() (cons n (build (- n 1)))))");
+    ExpectEq("(list-tail (build 100000) 99998)", "(2 1)");
+
+    ExpectNoError("(define slow-add (lambda (x y) (if (= x 0) y (slow-add (- x 1) (+ y 1)))))");
+    ExpectEq("(slow-add 100000 0)", "100000");
+}
+
+TEST_CASE_METHOD(SchemeTest, "ClosuresShareCapturedVariables") {
+    ExpectNoError(
+        "(define (make-counter)"
+        "  (define n 0)"
+        "  (define (inc) (set! n (+ n 1)) n)"
+        "  (define (get) n)"
+        "  (lambda (op) (if (= op 0) (inc) (get))))");
+    ExpectNoError("(define c (make-counter))");
+    ExpectEq("(c 0)", "1");
+    ExpectEq("(c 0)", "2");
+    ExpectEq("(c 1)", "2");
+
+    ExpectNoError(
+        "(define (parity n)"
+        "  (define (even? n) (if (= n 0) #t (odd? (- n 1))))"
+        "  (define (odd? n) (if (= n 0) #f (even? (- n 1))))"
+        "  (even? n))");
+    ExpectEq("(parity 10)", "#t");
+    ExpectEq("(parity 7)", "#f");
+
+    ExpectNoError("(define (adder x) (lambda (y) (lambda (z) (+ x y z))))");
+    ExpectEq("(((adder 1) 10) 100)", "111");
+    ExpectNoError("(define x 1000)");
+    ExpectEq("(((lambda (x) (lambda () x)) 5))", "5");
+    ExpectEq("((lambda () x))", "1000");
+}
+
+TEST_CASE_METHOD(SchemeTest, "RecursiveInternalDefinitionsAreReleased") {
+    // The internal procedures keep the argument alive only while something can call them.
+    std::shared_ptr<Object> sentinel = std::make_shared<Cell>(nullptr, nullptr);
+    std::weak_ptr<Object> watch = sentinel;
+    compilation.scope->Init("sentinel", std::move(sentinel));
+    ExpectNoError(
+        "(define (outer x)"
+        "  (define (lp i) (if (= i 0) x (lp (- i 1))))"
+        "  (define (even? n) (if (= n 0) (lp 2) (odd? (- n 1))))"
+        "  (define (odd? n) (if (= n 0) #f (even? (- n 1))))"
+        "  (even? 4))");
+    ExpectEq("(outer 1)", "1");
+    ExpectEq("(pair? (outer sentinel))", "#t");
+    ExpectNoError("(set! sentinel #f)");
+    REQUIRE(watch.expired());
+
+    // A procedure that outlives its frame still reaches itself.
+    ExpectNoError("(define (keep x) (define (lp i) (if (= i 0) x (lp (- i 1)))) lp)");
+    ExpectNoError("(define kept (keep 7))");
+    ExpectEq("(kept 3)", "7");
+}
+
+TEST_CASE_METHOD(SchemeTest, "LambdaInOperatorPosition") {
+    ExpectNoError("(define (f x) ((lambda (y) (set! x (+ x y)) x) 10))");
+    ExpectEq("(f 1)", "11");
+
+    ExpectNoError("(define (g a) ((lambda (b) (lambda () (+ a b))) 2))");
+    ExpectEq("((g 1))", "3");
+    ExpectEq("((lambda (x . rest) rest) 1 2 3)", "(2 3)");
+
+    ExpectRuntimeError("((lambda (x) x))");
+    ExpectRuntimeError("((lambda (x) x) 1 2)");
+    ExpectSyntaxError("((lambda (1) 1) 1)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "LetForms") {
+    ExpectNoError("(define x 10)");
+    ExpectEq("(let ((x 1) (y x)) (+ x y))", "11");
+    ExpectEq("(let* ((x 1) (y x)) (+ x y))", "2");
+    ExpectEq("(let () 5)", "5");
+    ExpectEq("x", "10");
+
+    ExpectEq(
+        "(letrec ((even? (lambda (n) (if (= n 0) #t (odd? (- n 1)))))"
+        "         (odd? (lambda (n) (if (= n 0) #f (even? (- n 1))))))"
+        "  (even? 100))",
+        "#t");
+
+    ExpectNoError("(define (counter) (let ((n 0)) (lambda () (set! n (+ n 1)) n)))");
+    ExpectNoError("(define c (counter))");
+    ExpectEq("(c)", "1");
+    ExpectEq("(c)", "2");
+
+    ExpectNoError("(define (loop i acc) (if (= i 0) acc (let ((j (- i 1))) (loop j (+ acc 1)))))");
+    ExpectEq("(loop 100000 0)", "100000");
+
+    ExpectSyntaxError("(let)");
+    ExpectSyntaxError("(let ((x)) x)");
+    ExpectSyntaxError("(let ((1 2)) 3)");
+    ExpectSyntaxError("(let ((x 1)))");
+}
+
+TEST_CASE_METHOD(SchemeTest, "TailRecursionModuloCons") {
+    ExpectNoError(
+        "(define (my-map f l) (if (null? l) '() (cons (f (car l)) (my-map f (cdr l)))))");
+    ExpectEq("(my-map (lambda (x) (* x x)) '(1 2 3))", "(1 4 9)");
+    ExpectEq("(my-map (lambda (x) x) '())", "()");
+    ExpectNoError(
+        "(define (range a b) (let loop ((i a)) (if (< i b) (cons i (loop (+ i 1))) '())))");
+    ExpectEq("(range 0 5)", "(0 1 2 3 4)");
+    ExpectNoError("(define long (range 0 1000000))");
+    ExpectEq("(length (my-map (lambda (x) (+ x 1)) long))", "1000000");
+    ExpectEq("(list-tail (my-map (lambda (x) (+ x 1)) long) 999998)", "(999999 1000000)");
+
+    // Elements are evaluated before the recursive call, in order.
+    ExpectNoError("(define seen '())");
+    ExpectNoError("(define (note x) (set! seen (cons x seen)) x)");
+    ExpectEq("(my-map note '(1 2 3))", "(1 2 3)");
+    ExpectEq("seen", "(3 2 1)");
+
+    // Re-entering a continuation taken inside does not change a list returned before.
+    ExpectNoError("(define k #f)");
+    ExpectNoError(
+        "(define (build n) (if (= n 0) (call/cc (lambda (c) (set! k c) '()))"
+        "  (cons n (build (- n 1)))))");
+    ExpectNoError("(define first (build 3))");
+    ExpectNoError("(define saved first)");
+    ExpectNoError("(k '(0))");
+    ExpectEq("first", "(3 2 1 0)");
+    ExpectEq("saved", "(3 2 1)");
+
+    ExpectNoError("(define (cons a b) (list a b))");
+    ExpectEq("(my-map (lambda (x) x) '(1 2))", "(1 (2 ()))");
+}
+
+TEST_CASE_METHOD(SchemeTest, "LambdaPassedToIteration") {
+    ExpectNoError("(define (scale xs k) (map (lambda (x) (* x k)) xs))");
+    ExpectEq("(scale '(1 2 3) 10)", "(10 20 30)");
+    ExpectNoError("(define (count xs) (define n 0) (for-each (lambda (x) (set! n (+ n x))) xs) n)");
+    ExpectEq("(count '(1 2 3))", "6");
+    ExpectEq("(filter (lambda (x) (> x 1)) '(1 2 3))", "(2 3)");
+    ExpectEq("(fold (lambda (x acc) (cons x acc)) '() '(1 2 3))", "(3 2 1)");
+    ExpectEq("(map (lambda (x y) (+ x y)) '(1 2) '(10 20))", "(11 22)");
+
+    // Procedures made in its frames still capture them.
+    ExpectNoError("(define (adders ns) (map (lambda (n) (lambda (x) (+ x n))) ns))");
+    ExpectEq("((car (cdr (adders '(1 2 3)))) 10)", "12");
+
+    // A procedure of the program named map gets a procedure, which may escape.
+    ExpectNoError("(define k 100)");
+    ExpectNoError(
+        "(define (make k) ((lambda (map) (map (lambda (x) (* x k)) 0)) (lambda (f x) f)))");
+    ExpectEq("((make 2) 4)", "8");
+    ExpectRuntimeError("(map (lambda (x y) x) '(1 2))");
+}
@@ -1,4 +1,5 @@
 #include <test/scheme_test.h>
+#include "pool.h"
 
 TEST_CASE_METHOD(SchemeTest, "ListsAreNotSelfEvaliating") {
     ExpectRuntimeError("()");
@@ -77,3 +78,238 @@ TEST_CASE_METHOD(SchemeTest, "ListOperations") {
     ExpectRuntimeError("(list-ref '(1 2 3) 10)");
     ExpectRuntimeError("(list-tail '(1 2 3) 10)");
 }
+
+TEST_CASE_METHOD(SchemeTest, "PrintNestedData") {
+    ExpectEq("'((1 2) (3) ((4)) . 5)", "((1 2) (3) ((4)) . 5)");
+    ExpectEq("'(a (b (c (d . #t))) -12)", "(a (b (c (d . #t))) -12)");
+
+    std::string out = "result: ";
+    compilation.Build("'(1 (2))", &out);
+    REQUIRE(out == "result: (1 (2))");
+}
+
+TEST_CASE_METHOD(SchemeTest, "ReadLongAndDeepData") {
+    std::string list = "'(";
+    for (int i = 0; i < 200000; ++i) {
+        list += std::to_string(i % 10) + " ";
+    }
+    ExpectNoError("(define long " + list + "))");
+    ExpectEq("(list-tail long 199997)", "(7 8 9)");
+
+    std::string deep = std::string(100000, '(') + "1" + std::string(100000, ')');
+    ExpectNoError("(define deep '" + deep + ")");
+    ExpectEq("(list-ref deep 0)", deep.substr(1, deep.size() - 2));
+}
+
+TEST_CASE_METHOD(SchemeTest, "DropHugeData") {
+    auto element = std::make_shared<Number>(1);
+    std::shared_ptr<Object> list;
+    for (int i = 0; i < 10000000; ++i) {
+        list = std::make_shared<Cell>(element, list);
+    }
+    std::shared_ptr<Object> deep = element;
+    for (int i = 0; i < 1000000; ++i) {
+        deep = std::make_shared<Cell>(deep, nullptr);
+    }
+    compilation.scope->Init("huge", list);
+    compilation.scope->Init("deep", deep);
+    list = nullptr;
+    deep = nullptr;
+
+    ExpectEq("(list-tail huge 9999999)", "(1)");
+    ExpectNoError("(define huge 0)");
+    ExpectNoError("(define deep 0)");
+    ExpectEq("huge", "0");
+}
+
+TEST_CASE_METHOD(SchemeTest, "ListBuiltins") {
+    ExpectNoError("(define xs '(1 2 3 4))");
+    ExpectEq("(length xs)", "4");
+    ExpectEq("(length '())", "0");
+    ExpectRuntimeError("(length '(1 . 2))");
+    ExpectEq("(append '(1) '(2 3) '() '(4 . 5))", "(1 2 3 4 . 5)");
+    ExpectEq("(append)", "()");
+    ExpectEq("(append '() 7)", "7");
+    ExpectEq("(reverse xs)", "(4 3 2 1)");
+
+    ExpectEq("(map (lambda (x) (* x x)) xs)", "(1 4 9 16)");
+    ExpectEq("(map + xs '(10 20))", "(11 22)");
+    ExpectNoError("(define sum 0)");
+    ExpectNoError("(for-each (lambda (x) (set! sum (+ sum x))) xs)");
+    ExpectEq("sum", "10");
+    ExpectEq("(filter (lambda (x) (> x 2)) xs)", "(3 4)");
+    ExpectEq("(filter (lambda (x) (= x 2)) xs)", "(2)");
+    ExpectEq("(fold + 0 xs)", "10");
+    ExpectEq("(fold cons '() xs)", "(4 3 2 1)");
+    ExpectEq("(fold (lambda (x y acc) (+ acc (* x y))) 0 xs xs)", "30");
+
+    ExpectEq("(member 3 xs)", "(3 4)");
+    ExpectEq("(member 5 xs)", "#f");
+    ExpectEq("(member '(1) '(a (1) b))", "((1) b)");
+    ExpectEq("(member 2 xs (lambda (x y) (< x y)))", "(3 4)");
+    ExpectEq("(assoc 'b '((a 1) (b 2)))", "(b 2)");
+    ExpectEq("(assoc 'c '((a 1) (b 2)))", "#f");
+    ExpectEq("(equal? '(1 (a #t)) '(1 (a #t)))", "#t");
+    ExpectEq("(equal? '(1 2) '(1 2 3))", "#f");
+
+    ExpectRuntimeError("(map 1 xs)");
+    ExpectRuntimeError("(map car)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "DeepRecursionThroughListBuiltins") {
+    ExpectNoError("(define (nest n) (if (= n 0) '() (list (nest (- n 1)))))");
+    ExpectNoError("(define tree (nest 100000))");
+    ExpectNoError("(define (depth t) (if (pair? t) (+ 1 (fold max 0 (map depth t))) 0))");
+    ExpectEq("(depth tree)", "100000");
+    ExpectNoError(
+        "(define (leaves t) (if (pair? t) (fold + 0 (map leaves (filter list? t))) 1))");
+    ExpectEq("(leaves tree)", "1");
+    ExpectNoError("(define n 0)");
+    ExpectNoError("(define (walk t) (set! n (+ n 1)) (for-each walk t))");
+    ExpectNoError("(walk tree)");
+    ExpectEq("n", "100001");
+
+    // A continuation captured inside map can be re-entered.
+    ExpectNoError("(define k #f)");
+    ExpectNoError("(define runs 0)");
+    ExpectNoError(
+        "(define (f) (let ((out (map (lambda (x) (call/cc (lambda (c) (if (= x 2) (set! k c)) "
+        "x))) '(1 2 3)))) (set! runs (+ runs 1)) (if (< runs 3) (k (* 10 runs)) out)))");
+    ExpectEq("(f)", "(1 20 3)");
+
+    // Builtins that still call back on the C++ stack stop at a bounded depth.
+    ExpectNoError(
+        "(define (nested-sort n) (if (= n 0) 0 "
+        "(begin (sort (list 1 2) (lambda (a b) (nested-sort (- n 1)) #t)) 0)))");
+    ExpectEq("(nested-sort 100)", "0");
+    ExpectRuntimeError("(nested-sort 100000)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "Sort") {
+    ExpectEq("(sort '(3 1 2) <)", "(1 2 3)");
+    ExpectEq("(sort '(3 1 2) >)", "(3 2 1)");
+    ExpectEq("(list-sort < '(5 4 3 2 1 0))", "(0 1 2 3 4 5)");
+    ExpectEq("(sort '() <)", "()");
+    ExpectNoError("(define xs '(2 3 1))");
+    ExpectEq("(sort! xs <)", "(1 2 3)");
+    ExpectEq("xs", "(1 2 3)");
+    // The quoted list itself is sorted.
+    ExpectNoError("(define (constant) '(2 3 1))");
+    ExpectEq("(sort! (constant) <)", "(1 2 3)");
+    ExpectEq("(constant)", "(1 2 3)");
+
+    // Stable: pairs with equal keys keep their order.
+    ExpectEq("(sort '((2 a) (1 b) (2 c) (1 d)) (lambda (x y) (< (car x) (car y))))",
+             "((1 b) (1 d) (2 a) (2 c))");
+    ExpectRuntimeError("(sort '(1 a) <)");
+    ExpectRuntimeError("(sort '(1 . 2) <)");
+
+    std::string list = "(list";
+    for (int i = 0; i < 100000; ++i) {
+        list += " " + std::to_string((i * 7919) % 100000);
+    }
+    ExpectNoError("(define long " + list + "))");
+    ExpectEq("(list-tail (sort long <) 99997)", "(99997 99998 99999)");
+    ExpectEq("(list-tail (sort long (lambda (x y) (> x y))) 99998)", "(1 0)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "FusedPipelines") {
+    ExpectNoError("(define xs '(1 2 3 4 5 6))");
+    ExpectNoError("(define (odd? x) (= (- x (* 2 (/ x 2))) 1))");
+    ExpectNoError("(define (square x) (* x x))");
+    ExpectEq("(fold + 0 (map square (filter odd? xs)))", "35");
+    ExpectEq("(map square (filter odd? xs))", "(1 9 25)");
+    ExpectEq("(filter odd? (map square xs))", "(1 9 25)");
+    ExpectEq("(length (filter odd? (map (lambda (x) (+ x 1)) xs)))", "3");
+    ExpectEq("(fold cons '() (map square (map square xs)))", "(1296 625 256 81 16 1)");
+    ExpectNoError("(define sum 0)");
+    ExpectNoError("(for-each (lambda (x) (set! sum (+ sum x))) (filter odd? xs))");
+    ExpectEq("sum", "9");
+    ExpectRuntimeError("(length (map square '(1 2 . 3)))");
+
+    // The same code, once the stages mean something else.
+    ExpectNoError("(define (total) (fold + 0 (map square (filter odd? xs))))");
+    ExpectEq("(total)", "35");
+    ExpectNoError("(define (filter p l) l)");
+    ExpectEq("(total)", "91");
+    ExpectNoError("(set! fold (lambda (f init l) (length l)))");
+    ExpectEq("(total)", "6");
+    ExpectEq("((lambda (map) (length (map square xs))) (lambda (f l) '(1)))", "1");
+}
+
+TEST_CASE_METHOD(SchemeTest, "ParallelMap") {
+    // Workers even on a single core, unless an earlier test has made the pool already.
+    WorkStealingPool::SetThreadCount(4);
+    ExpectNoError("(define (square x) (* x x))");
+    ExpectEq("(pmap square '(1 2 3 4 5))", "(1 4 9 16 25)");
+    ExpectEq("(pmap square '())", "()");
+    ExpectEq("(preduce + 0 '(1 2 3 4 5))", "15");
+    ExpectEq("(preduce + 0 '())", "0");
+    // init is used once and the chunks are combined in order, whatever their number, which
+    // grows with the length of the list up to four for every thread.
+    ExpectEq("(preduce + 1 '(0 1 2 3 4 5 6 7 8 9))", "46");
+    std::string lists;
+    std::string expected;
+    for (int i = 1; i <= 40; ++i) {
+        lists += " '(" + std::to_string(i) + ")";
+        expected += " " + std::to_string(i);
+        ExpectEq("(preduce append '(0) (list" + lists + "))", "(0" + expected + ")");
+    }
+    // Chunks whose result is '() are combined too.
+    ExpectEq("(preduce append '() '((1) () () () () () () () () () () () (2)))", "(1 2)");
+    ExpectEq("(pfor-each square '(1 2 3))", "()");
+    ExpectRuntimeError("(pmap square '(1 2 . 3))");
+    ExpectRuntimeError("(pmap square '(1 a 3))");
+    ExpectRuntimeError("(preduce + 0)");
+
+    // Forms that are rewritten on use, run on many threads at once.
+    ExpectNoError(
+        "(define (work n) (let loop ((i 0) (acc '())) "
+        "(if (= i n) (length acc) (loop (+ i 1) `(,i ,@acc)))))");
+    std::string list = "(list";
+    for (int i = 0; i < 2000; ++i) {
+        list += " " + std::to_string(i % 50);
+    }
+    ExpectNoError("(define ns " + list + "))");
+    ExpectEq("(equal? (pmap work ns) (map work ns))", "#t");
+    ExpectEq("(preduce + 0 (pmap (lambda (n) (let* ((a n) (b (* a 2))) (- b a))) ns))",
+             "49000");
+    ExpectEq("(preduce + 0 (pmap (lambda (xs) (preduce + 0 xs)) (list ns ns ns)))", "147000");
+    ExpectEq("(pmap (lambda (k) (map (lambda (x) (* x k)) '(1 2))) '(1 2 3))", "((1 2) (2 4) (3 6))");
+
+    // Globals assigned on some threads while the others look them up.
+    ExpectNoError("(define last 0)");
+    ExpectEq("(preduce + 0 (pmap (lambda (n) (set! last n) (+ n (length ns) (* 0 last))) ns))",
+             "4049000");
+    ExpectEq("(< last 50)", "#t");
+}
+
+TEST_CASE_METHOD(SchemeTest, "Futures") {
+    WorkStealingPool::SetThreadCount(4);
+    ExpectEq("(touch (future (+ 1 2)))", "3");
+    ExpectEq("(touch 5)", "5");
+    ExpectNoError("(define side 0)");
+    ExpectNoError("(define f (future (set! side 1) (* 6 7)))");
+    ExpectEq("(list (touch f) (touch f))", "(42 42)");
+    ExpectEq("side", "1");
+    ExpectSyntaxError("(future)");
+    ExpectNoError("(define g (future (car '())))");
+    ExpectRuntimeError("(touch g)");
+
+    // Fork/join: every future is touched by the thread that made it.
+    ExpectNoError(
+        "(define (psum lo hi) (if (< (- hi lo) 8) "
+        "(do ((i lo (+ i 1)) (s 0 (+ s i))) ((= i hi) s)) "
+        "(let* ((mid (/ (+ lo hi) 2)) (left (future (psum lo mid)))) "
+        "(+ (psum mid hi) (touch left)))))");
+    ExpectEq("(psum 0 2000)", "1999000");
+    ExpectEq("(preduce + 0 (pmap (lambda (n) (touch (future (psum 0 n)))) '(10 100 1000)))",
+             "504495");
+
+    // The forms of code that several threads run are rewritten once, for all of them.
+    ExpectNoError("(define-syntax twice (syntax-rules () ((_ e) (+ e e))))");
+    ExpectNoError("(define (tw n) (let ((m (twice n))) `(,m)))");
+    ExpectEq("(let ((a (future (tw 1))) (b (future (tw 2)))) (list (touch a) (touch b) (tw 3)))",
+             "((2) (4) (6))");
+    ExpectEq("(pmap tw '(1 2 3 4))", "((2) (4) (6) (8))");
+}
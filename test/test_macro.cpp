@@ -0,0 +1,93 @@
+#include <test/scheme_test.h>
+
+TEST_CASE_METHOD(SchemeTest, "SyntaxRules") {
+    ExpectNoError(
+        "(define-syntax swap!"
+        "  (syntax-rules () ((_ a b) (let ((tmp a)) (set! a b) (set! b tmp)))))");
+    ExpectNoError("(define x 1)");
+    ExpectNoError("(define y 2)");
+    ExpectNoError("(swap! x y)");
+    ExpectEq("(list x y)", "(2 1)");
+
+    ExpectNoError(
+        "(define-syntax my-or"
+        "  (syntax-rules ()"
+        "    ((_) #f)"
+        "    ((_ e) e)"
+        "    ((_ e r ...) (let ((t e)) (if (not (eq? t #f)) t (my-or r ...))))))");
+    ExpectNoError("(define (eq? a b) (if (boolean? a) (if (boolean? b) (= 0 0) #f) #f))");
+    ExpectEq("(my-or)", "#f");
+    ExpectEq("(my-or 5)", "5");
+    ExpectEq("(my-or #f #f 7)", "7");
+
+    ExpectNoError(
+        "(define-syntax my-list-of-pairs"
+        "  (syntax-rules () ((_ (a b) ...) (list (cons a b) ...))))");
+    ExpectEq("(my-list-of-pairs (1 2) (3 4))", "((1 . 2) (3 . 4))");
+    ExpectEq("(my-list-of-pairs)", "()");
+
+    ExpectSyntaxError("(swap! x)");
+    ExpectSyntaxError("(define-syntax bad (lambda (x) x))");
+}
+
+TEST_CASE_METHOD(SchemeTest, "MacroLiteralsAndEllipsis") {
+    ExpectNoError(
+        "(define-syntax for"
+        "  (syntax-rules (from to)"
+        "    ((_ v from a to b body ...)"
+        "     (let loop ((v a)) (when (< v b) body ... (loop (+ v 1)))))))");
+    ExpectNoError("(define sum 0)");
+    ExpectNoError("(for i from 0 to 5 (set! sum (+ sum i)))");
+    ExpectEq("sum", "10");
+    ExpectSyntaxError("(for i in 0 to 5 1)");
+
+    ExpectNoError(
+        "(define-syntax tail-list"
+        "  (syntax-rules ::: () ((_ a ::: z) (quote (z a :::)))))");
+    ExpectEq("(tail-list 1 2 3)", "(3 1 2)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "MacroExpandedOncePerUse") {
+    ExpectNoError("(define-syntax inc! (syntax-rules () ((_ v) (set! v (+ v 1)))))");
+    ExpectNoError("(define (count-to n) (let loop ((i 0)) (if (= i n) i (begin (inc! i) (loop i)))))");
+    ExpectEq("(count-to 1000)", "1000");
+    ExpectEq("(count-to 10)", "10");
+
+    ExpectEq(
+        "(let-syntax ((double (syntax-rules () ((_ e) (* 2 e)))))"
+        "  (double 21))",
+        "42");
+    ExpectNoError("(define (f) (define-syntax twice (syntax-rules () ((_ e) (begin e e)))) (twice 3))");
+    ExpectEq("(f)", "3");
+}
+
+TEST_CASE_METHOD(SchemeTest, "MacroTemplatesReferToVariablesOfTheUse") {
+    // The closures capture what the expansions refer to, not only what the uses name.
+    ExpectNoError("(define-syntax getx (syntax-rules () ((_) x)))");
+    ExpectNoError("(define (f x) (lambda () (getx)))");
+    ExpectEq("((f 42))", "42");
+    ExpectNoError(
+        "(define (g y) (let-syntax ((gety (syntax-rules () ((_) y)))) (lambda () (gety))))");
+    ExpectEq("((g 7))", "7");
+    ExpectNoError(
+        "(define (h z) (define-syntax getz (syntax-rules () ((_) z))) (lambda () (getz)))");
+    ExpectEq("((h 8))", "8");
+    // A variable of the same name as a macro is not a macro use.
+    ExpectNoError("(define (k getx) (lambda () (getx)))");
+    ExpectEq("((k (lambda () 'shadowed)))", "shadowed");
+    // A use that matches no rule is an error only when it is evaluated.
+    ExpectNoError("(define (never) (lambda () (getx 1 2)))");
+    ExpectSyntaxError("((never))");
+}
+
+TEST_CASE_METHOD(SchemeTest, "EscapedEllipsis") {
+    // Pattern variables are still substituted in an escaped template.
+    ExpectNoError("(define-syntax m (syntax-rules () ((_ x) (... (list x)))))");
+    ExpectEq("(m 5)", "(5)");
+    ExpectNoError("(define-syntax dots (syntax-rules () ((_ x) (quote (... (x ...))))))");
+    ExpectEq("(dots 1)", "(1 ...)");
+    // Every use gets cells of its own, so rewriting one expansion leaves the template alone.
+    ExpectNoError("(define-syntax make-adder (syntax-rules () ((_) (... (lambda (n) (+ n 1))))))");
+    ExpectEq("((make-adder) 1)", "2");
+    ExpectEq("((make-adder) 2)", "3");
+}
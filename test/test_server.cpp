@@ -0,0 +1,177 @@
+#include <catch.hpp>
+#include "scheme.h"
+#include "pool.h"
+#include "serve.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstring>
+#include <thread>
+
+namespace {
+// A server on a socket of its own, on a thread of its own, for as long as the object lives.
+class TestServer {
+public:
+    explicit TestServer(size_t threads, const std::shared_ptr<Scope> &prelude = nullptr)
+        : path_("/tmp/scheme-test-" + std::to_string(getpid()) + ".sock") {
+        listen_fd_ = Listen(path_);
+        REQUIRE(listen_fd_ >= 0);
+        thread_ = std::thread(
+            [this, threads, prelude] { Serve(listen_fd_, threads, prelude, false, is_stopping_); });
+    }
+    TestServer(const TestServer &) = delete;
+    TestServer &operator=(const TestServer &) = delete;
+    ~TestServer() {
+        // A connection wakes the reading thread up to see the flag.
+        is_stopping_ = true;
+        close(Connect());
+        thread_.join();
+        close(listen_fd_);
+        unlink(path_.c_str());
+    }
+
+    int Connect() const {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strcpy(address.sun_path, path_.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+        return fd;
+    }
+
+private:
+    std::string path_;
+    int listen_fd_;
+    std::atomic<bool> is_stopping_{false};
+    std::thread thread_;
+};
+
+// A connection that sends requests a line at a time and reads the answers without their time.
+class Client {
+public:
+    explicit Client(const TestServer &server) : fd_(server.Connect()) {
+    }
+    Client(const Client &) = delete;
+    Client &operator=(const Client &) = delete;
+    ~Client() {
+        close(fd_);
+    }
+
+    void Send(const std::string &data) {
+        for (size_t sent = 0; sent < data.size();) {
+            ssize_t size = send(fd_, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            REQUIRE(size > 0);
+            sent += size;
+        }
+    }
+
+    // The next answer, as "ok value" or "error kind", or "" if none comes within half a minute.
+    std::string Answer() {
+        size_t end;
+        while ((end = input_.find('\n')) == std::string::npos) {
+            pollfd wait{fd_, POLLIN, 0};
+            char buffer[1 << 12];
+            ssize_t size;
+            if (poll(&wait, 1, 30000) <= 0 || (size = read(fd_, buffer, sizeof(buffer))) <= 0) {
+                return "";
+            }
+            input_.append(buffer, size);
+        }
+        std::string line = input_.substr(0, end);
+        input_.erase(0, end + 1);
+        size_t kind = line.find(' ');
+        size_t time = line.find(' ', kind + 1);
+        return line.substr(0, kind) + line.substr(time);
+    }
+
+    std::string Ask(const std::string &request) {
+        Send(request + "\n");
+        return Answer();
+    }
+
+    void StopSending() {
+        shutdown(fd_, SHUT_WR);
+    }
+
+private:
+    int fd_;
+    std::string input_;
+};
+}  // namespace
+
+TEST_CASE("ServerProtocol") {
+    TestServer server(2);
+    Client client(server);
+    REQUIRE(client.Ask("(+ 1 2)") == "ok 3");
+    REQUIRE(client.Ask("(car '())") == "error runtime");
+    REQUIRE(client.Ask("undefined-variable") == "error name");
+    REQUIRE(client.Ask("(1 . )") == "error syntax");
+    // Several requests in one packet are answered in order, the blank lines skipped.
+    client.Send("(define x 5)\r\n\n(* x x)\n");
+    REQUIRE(client.Answer() == "ok ()");
+    REQUIRE(client.Answer() == "ok 25");
+
+    // Every client has a session of its own.
+    Client other(server);
+    REQUIRE(other.Ask("x") == "error name");
+    REQUIRE(other.Ask("(define x 7)") == "ok ()");
+    REQUIRE(client.Ask("x") == "ok 5");
+}
+
+TEST_CASE("ServerHalfClose") {
+    TestServer server(1);
+    // A client that stops sending still gets its answers, even after it has stopped reading
+    // for a while, and meanwhile does not hold up the others.
+    Client greedy(server);
+    std::string requests =
+        "(define (numbers n acc) (if (= n 0) acc (numbers (- n 1) (cons n acc))))\n";
+    for (int i = 0; i < 4; ++i) {
+        requests += "(numbers 20000 '())\n";
+    }
+    greedy.Send(requests + "'last");
+    greedy.StopSending();
+    Client other(server);
+    REQUIRE(other.Ask("(+ 1 2)") == "ok 3");
+    REQUIRE(greedy.Answer() == "ok ()");
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(greedy.Answer().size() > 100000);
+    }
+    REQUIRE(greedy.Answer() == "ok last");
+    REQUIRE(greedy.Answer().empty());
+}
+
+TEST_CASE("ServerPrelude") {
+    Compilation prelude;
+    prelude.Build("(define (h) 1)");
+    prelude.Build("(define (call-h) (h))");
+    SharedCodeScope shared;
+    TestServer server(2, prelude.scope);
+    // What one session assigns, even a name of the prelude, the others never see.
+    Client first(server);
+    Client second(server);
+    REQUIRE(first.Ask("(set! h (lambda () 99))") == "ok ()");
+    REQUIRE(first.Ask("(call-h)") == "ok 99");
+    REQUIRE(second.Ask("(h)") == "ok 1");
+    REQUIRE(second.Ask("(call-h)") == "ok 1");
+    REQUIRE(prelude.Build("(h)") == "1");
+}
+
+TEST_CASE("ServerPreludeThreads") {
+    Compilation prelude;
+    prelude.Build("(define-syntax twice (syntax-rules () ((_ e) (+ e e))))");
+    prelude.Build("(define (pairs n) (let loop ((i 0) (acc '())) "
+                  "(if (= i n) acc (loop (+ i 1) (let ((x (twice i))) `((,i . ,x) . ,acc))))))");
+    SharedCodeScope shared;
+    TestServer server(4, prelude.scope);
+    // Sessions on several threads run the same code of the prelude, which is rewritten once.
+    std::vector<std::unique_ptr<Client>> clients;
+    for (int i = 0; i < 4; ++i) {
+        clients.push_back(std::make_unique<Client>(server));
+        clients.back()->Send("(length (pairs 3000))\n(car (pairs 3))\n");
+    }
+    for (auto &client : clients) {
+        REQUIRE(client->Answer() == "ok 3000");
+        REQUIRE(client->Answer() == "ok (2 . 4)");
+    }
+}
@@ -5,7 +5,7 @@ bool IsDigit(char x) {
 }
 
 bool IsSpecialChar(char x) {
-    return x == '(' || x == ')' || x == '\'' || x == '.';
+    return x == '(' || x == ')' || x == '\'' || x == '`' || x == ',' || x == '.';
 }
 
 bool IsOperation(char x) {
@@ -13,9 +13,9 @@ bool IsOperation(char x) {
 }
 
 bool IsSpaces(char x) {
-    return x == ' ' || x == '\n' || x == 32;
+    return x == ' ' || x == '\n' || x == '\t' || x == '\r';
 }
 
 bool IsCorrectChar(char x) {
-    return !IsSpecialChar(x) && x != EOF && !IsSpaces(x);
+    return !IsSpecialChar(x) && x != EOF && x != ';' && !IsSpaces(x);
 }
\ No newline at end of file
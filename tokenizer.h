@@ -1,12 +1,15 @@
 #pragma once
 
+#include "exeption.h"
 #include <iostream>
 #include <variant>
 #include <string>
 
+// ', `, , and ,@ abbreviate (quote x), (quasiquote x), (unquote x) and (unquote-splicing x).
 struct QuoteToken {
-    bool operator==(const QuoteToken &) const {
-        return true;
+    std::string name = "quote";
+    bool operator==(const QuoteToken &rhs) const {
+        return name == rhs.name;
     }
 };
 
@@ -48,26 +51,55 @@ class Tokenizer {
 public:
     explicit Tokenizer(std::istream *in) : in_(in) {
         is_end_ = false;
-        Next();
+        is_fetched_ = false;
     }
     bool IsEnd() {
+        Fetch();
         return is_end_;
     }
     Token GetToken() {
+        Fetch();
         return cur_token_;
     }
+    // The next token is only pulled from the stream when somebody asks for it, so an
+    // interactive reader is not blocked waiting for input after the closing bracket.
     void Next() {
+        is_fetched_ = false;
+    }
+
+private:
+    void Fetch() {
+        if (is_fetched_) {
+            return;
+        }
+        is_fetched_ = true;
         RidOfSpace();
         char cur = in_->peek();
         if (cur == EOF) {
             is_end_ = true;
             return;
         }
-        if (IsSpecialChar(cur)) {
-            if (cur == '.') {
+        if (cur == '.') {
+            // A lone dot separates the tail of a pair; more dots make the ellipsis symbol.
+            in_->get();
+            if (in_->peek() == '.') {
+                cur_token_ = SymbolToken{"." + ReadDots()};
+            } else {
                 cur_token_ = DotToken{};
-            } else if (cur == '\'') {
+            }
+        } else if (cur == ',') {
+            in_->get();
+            if (in_->peek() == '@') {
+                in_->get();
+                cur_token_ = QuoteToken{"unquote-splicing"};
+            } else {
+                cur_token_ = QuoteToken{"unquote"};
+            }
+        } else if (IsSpecialChar(cur)) {
+            if (cur == '\'') {
                 cur_token_ = QuoteToken{};
+            } else if (cur == '`') {
+                cur_token_ = QuoteToken{"quasiquote"};
             } else if (cur == '(') {
                 cur_token_ = BracketToken::OPEN;
             } else {
@@ -85,15 +117,23 @@ public:
             }
         } else if (IsDigit(cur)) {
             cur_token_ = ConstantToken{ReadInt()};
+        } else if (cur == '"') {
+            cur_token_ = SymbolToken{ReadQuoted()};
         } else {
             cur_token_ = SymbolToken{ReadString()};
         }
     }
-
-private:
     void RidOfSpace() {
-        while (IsSpaces(in_->peek())) {
-            in_->get();
+        while (true) {
+            while (IsSpaces(in_->peek())) {
+                in_->get();
+            }
+            if (in_->peek() != ';') {
+                return;
+            }
+            while (in_->peek() != '\n' && in_->peek() != EOF) {
+                in_->get();
+            }
         }
     }
     int64_t ReadInt() {  // without minus
@@ -105,6 +145,27 @@ private:
         }
         return result;
     }
+    std::string ReadDots() {
+        std::string result;
+        while (in_->peek() == '.') {
+            result += '.';
+            in_->get();
+        }
+        return result;
+    }
+    // There are no strings: "text" reads as a symbol with the quotes in its name, and between
+    // them anything but a line break goes, dots and brackets included. The closing quote has to
+    // come before the end of the line.
+    std::string ReadQuoted() {
+        std::string result{char(in_->get())};
+        while (in_->peek() != EOF && in_->peek() != '\n') {
+            result += char(in_->get());
+            if (result.back() == '"') {
+                return result;
+            }
+        }
+        throw SyntaxError{};
+    }
     std::string ReadString() {
         std::string result;
         while (IsCorrectChar(in_->peek())) {
@@ -115,5 +176,6 @@ private:
     }
     Token cur_token_;
     bool is_end_;
+    bool is_fetched_;
     std::istream *in_;
 };
\ No newline at end of file